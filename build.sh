@@ -1,14 +1,82 @@
 #!/usr/bin/env bash
 
+# The flags given by the caller, before the debug defaults below fill them in
+CallerCompilerFlags="$CompilerFlags"
 CompilerFlags="${CompilerFlags:- -O0 -g -fno-exceptions -fno-rtti -Wall -Wextra -Wmissing-field-initializers -DDEVELOPER}"
 CC="${CC:-g++}"
+# No fused multiply-adds, so that deterministic mode gives the same results whatever the -march
+DeterminismFlags="-ffp-contract=off"
 
 mkdir -p build
 
 pushd build > /dev/null
+    if [ "$1" == "headless" ]; then
+        # Physics only, no raylib or GL, for machines without a display
+        echo "BUILDING HEADLESS"
+        echo "---------------------"
+        "$CC" $CompilerFlags $DeterminismFlags -DPHYSICS_HEADLESS ../src/headless.cpp -o c_physics_headless -lm -lpthread
+        CompileSuccess=$?
+        if [ $CompileSuccess -ne 0 ]; then
+            echo "BUILD FAILED"
+        fi
+        popd > /dev/null
+        exit $CompileSuccess
+    fi
+
+    if [ "$1" == "test" ]; then
+        # Replay regression tests on the headless runner: any change to the results of a step
+        # changes the hash chain of the deterministic pyramid and fails them
+        echo "BUILDING HEADLESS"
+        echo "---------------------"
+        "$CC" $CompilerFlags $DeterminismFlags -DPHYSICS_HEADLESS ../src/headless.cpp -o c_physics_headless -lm -lpthread
+        if [ $? -ne 0 ]; then
+            echo "BUILD FAILED"
+            popd > /dev/null
+            exit 1
+        fi
+
+        echo "RUNNING TESTS"
+        echo "---------------------"
+        Failed=0
+        RunTest() {
+            Name="$1"
+            shift
+            if ./c_physics_headless "$@" > "test_$Name.log" 2>&1; then
+                echo "PASSED $Name"
+            else
+                echo "FAILED $Name, see build/test_$Name.log"
+                Failed=1
+            fi
+        }
+        PyramidHash=1ab421f6ae502d83
+        RunTest replay ../scenes/pyramid.txt -steps 10000 -deterministic 1 -expect $PyramidHash
+        RunTest replay_threads ../scenes/pyramid.txt -steps 10000 -deterministic 1 -threads 4 -expect $PyramidHash
+        RunTest replay_tree ../scenes/pyramid.txt -steps 10000 -deterministic 1 -broadphase tree -expect $PyramidHash
+        RunTest replay_grid ../scenes/pyramid.txt -steps 10000 -deterministic 1 -broadphase grid -expect $PyramidHash
+        # Tens of thousands of bodies, more than the scratch memory starts out with
+        RunTest large ../scenes/pyramid_large.txt -steps 3
+        RunTest large_threads ../scenes/pyramid_large.txt -steps 3 -threads 4
+        popd > /dev/null
+        exit $Failed
+    fi
+
+    if [ "$1" == "bench" ]; then
+        # Benchmarks are optimized unless CompilerFlags says otherwise
+        BenchFlags="${CallerCompilerFlags:- -O2 -g -fno-exceptions -fno-rtti -Wall -Wextra -Wmissing-field-initializers}"
+        echo "BUILDING BENCHMARKS"
+        echo "---------------------"
+        "$CC" $BenchFlags $DeterminismFlags -DPHYSICS_HEADLESS ../src/bench.cpp -o c_physics_bench -lm -lpthread
+        CompileSuccess=$?
+        if [ $CompileSuccess -ne 0 ]; then
+            echo "BUILD FAILED"
+        fi
+        popd > /dev/null
+        exit $CompileSuccess
+    fi
+
     echo "BUILDING GAME"
     echo "---------------------"
-    "$CC" $CompilerFlags ../src/main.cpp -o c_physics -lm -lGL -lraylib
+    "$CC" $CompilerFlags $DeterminismFlags ../src/main.cpp -o c_physics -lm -lpthread -lGL -lraylib
     CompileSuccess=$?
 
     if [ $CompileSuccess -eq 0 ]; then
@@ -18,9 +86,6 @@ pushd build > /dev/null
                echo "---------------------"
                ./c_physics
                ;;
-           "test")
-               echo "NO TESTS"
-               ;;
            *)
        esac
     else
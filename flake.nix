@@ -25,7 +25,38 @@
               cp build/c_physics $out/bin/c_physics
             '';
           };
+          c_physics_headless = pkgs.stdenv.mkDerivation {
+            name = "c_physics_headless";
+            src = ./.;
+            buildPhase = ''
+              export CompilerFlags="-O3 -fno-exceptions -fno-rtti"
+              bash ./build.sh headless
+            '';
+            # Replay regression tests, see build.sh test
+            doCheck = true;
+            checkPhase = ''
+              export CompilerFlags="-O3 -fno-exceptions -fno-rtti"
+              bash ./build.sh test
+            '';
+            installPhase = ''
+              mkdir -p $out/bin
+              cp build/c_physics_headless $out/bin/c_physics_headless
+            '';
+          };
+          c_physics_bench = pkgs.stdenv.mkDerivation {
+            name = "c_physics_bench";
+            src = ./.;
+            buildPhase = ''
+              export CompilerFlags="-O3 -fno-exceptions -fno-rtti"
+              bash ./build.sh bench
+            '';
+            installPhase = ''
+              mkdir -p $out/bin
+              cp build/c_physics_bench $out/bin/c_physics_bench
+            '';
+          };
         };
         defaultPackage = packages.c_physics;
+        checks.replay = packages.c_physics_headless;
       });
 }
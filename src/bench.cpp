@@ -0,0 +1,940 @@
+// Benchmarks of the physics core, builds without raylib or a display:
+//
+//   ./build.sh bench
+//   build/c_physics_bench [-filter text] [-steps N] [-threads N] [-min_time seconds]
+//                         [-iterations N] [-tolerance m/s] [-solver iterations|substep]
+//                         [-substeps N] [-split_impulses 0|1] [-position_iterations N]
+//                         [-broadphase grid|tree|sap|all] [-thread_sweep 0|1]
+//
+// Microbenchmarks time the hot functions on their own, WriteSnapshot and RestoreSnapshot of a
+// box pile at 1k and 10k bodies, and the grid broad phase of that pile against the all pairs
+// loop it replaced (BroadPhaseGrid/N and BroadPhaseBruteForce/N). ArbiterTableInsert and
+// ArbiterTableGet run on the same keys as HashTableArbiterSet and HashTableArbiterGet, the
+// HashTable of arbiters the ArbiterTable replaced. CollideFindAxes runs the separating axis
+// test COLLIDE_LANES pairs at a time and CollideFindAxesScalar one pair at a time, their
+// "ops_per_sec" are pairs per second. Both are scalar in a build with -DPHYSICS_NO_SIMD in
+// CompilerFlags. LoadSceneFile/N maps a scene file of a box pile into an empty world and
+// AddBody/N builds the same world body by body, at 10k and 100k bodies.
+//
+// Scenarios time whole steps of a scene at 100, 1k and 10k bodies:
+//
+//   pyramid  a pyramid stack on a static ground
+//   rain     randomly sized and rotated boxes falling onto the ground, like the ones the game
+//            spawns on a mouse click
+//   field    a wide flat field of boxes resting next to each other
+//   pile     a dense pile of boxes dropped into a pit
+//
+// Every benchmark prints one JSON object per line, so results can be collected and compared
+// across commits:
+//
+//   {"name":"murmur64/8","ns_per_op":4.1,"ops_per_sec":243902439,"ops":67108864}
+//   {"name":"pyramid/1000","bodies":1036,"threads":1,"steps":300,"steps_per_sec":812.3,
+//    "mean_ms":1.231,"p50_ms":1.102,"p99_ms":3.870,"max_ms":4.220,"iterations":7.41,
+//    "penetration":0.0123,"position_iterations":0.00,
+//    "kinetic_energy":0.512}
+//
+// -filter only runs the benchmarks whose name contains the text. -iterations and -tolerance
+// set the solver iteration cap and tolerance of the scenarios, "iterations" is the average
+// number of iterations a step took. -solver substep runs the scenarios with SOLVER_SUBSTEP and
+// -substeps substeps, "iterations" then counts substeps. "penetration" is the deepest contact
+// penetration after the last step in meters, how well the solver holds up the stacks.
+// -split_impulses 1 recovers penetration in a separate pass of at most -position_iterations,
+// "position_iterations" is the average number of them a step took. "kinetic_energy" is the
+// energy left in the bodies after the last step in joules, how quietly the scene rests.
+// -broadphase picks the broad phase of the scenarios, all runs every scenario with each of them
+// as pile/1000/grid, pile/1000/tree and pile/1000/sap. -thread_sweep 1 runs every scenario on
+// 1, 2, ... up to -threads threads as pile/1000/threads_1, pile/1000/threads_2 and so on.
+//
+// pyramid/1000 and pile/1000 run once more as pile/1000/velocity_bias and
+// pile/1000/split_impulses and so on, to compare the penetration and kinetic energy of both
+// ways to recover penetration whatever -split_impulses says.
+#ifndef PHYSICS_HEADLESS
+#  define PHYSICS_HEADLESS
+#endif
+
+#include "language_layer.h"
+#include "memory.h"
+#include "physics.h"
+
+// UNITY BUILD
+#include "language_layer.cpp"
+#include "memory.cpp"
+#include "thread_pool.cpp"
+#include "broad_phase.cpp"
+#include "physics_profile.cpp"
+#include "physics.cpp"
+#include "physics_snapshot.cpp"
+#include "physics_scene.cpp"
+
+struct BenchOptions {
+  const char *filter;
+  u32 steps;
+  u32 threads;
+  f64 min_time;  // seconds a microbenchmark runs for at least
+  u32 iterations;  // 0 = the world default
+  f32 tolerance;  // < 0 = the world default
+  physics::SolverType solver_type;
+  u32 substeps;  // 0 = the world default
+  b32 split_impulses;
+  u32 position_iterations;  // 0 = the world default
+  physics::BroadPhaseType broad_phase;
+  b32 all_broad_phases;
+  b32 thread_sweep;  // run the scenarios at 1 to threads threads
+};
+
+// Indexed by BroadPhaseType
+global const char *bench_broad_phase_names[] = {"grid", "tree", "sap"};
+
+global BenchOptions bench_options;
+global volatile u64 bench_sink;  // results go here so the compiler keeps the work
+
+internal f64 SecondsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+}
+
+internal b32 ParseBroadPhase(const char *name, physics::BroadPhaseType *type) {
+  for (u32 i = 0; i < ArrayCount(bench_broad_phase_names); i++) {
+    if (strcmp(name, bench_broad_phase_names[i]) == 0) {
+      *type = (physics::BroadPhaseType)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+internal b32 BenchSelected(const char *name) {
+  return !bench_options.filter || strstr(name, bench_options.filter);
+}
+
+// xorshift64, the scenes have to be the same on every run
+global u64 bench_random_state = 0x9e3779b97f4a7c15ull;
+
+internal f32 RandomRange(f32 min, f32 max) {
+  bench_random_state ^= bench_random_state << 13;
+  bench_random_state ^= bench_random_state >> 7;
+  bench_random_state ^= bench_random_state << 17;
+  return min + (max - min) * (f32)(bench_random_state >> 40) / (f32)(1 << 24);
+}
+
+//
+// Microbenchmarks
+//
+
+// Calls run with a growing number of calls, doubling the number of calls until min_time has
+// passed, and reports the time per operation. Each call does ops_per_call operations.
+typedef void BenchRun(void *data, u32 calls);
+
+internal void RunMicro(const char *name, BenchRun *run, void *data, u64 ops_per_call) {
+  if (!BenchSelected(name)) {
+    return;
+  }
+
+  run(data, 1);  // warm up the caches
+  u32 calls = 1;
+  f64 elapsed = 0.0;
+  for (;;) {
+    f64 start = SecondsNow();
+    run(data, calls);
+    elapsed = SecondsNow() - start;
+    if (elapsed >= bench_options.min_time || calls >= (1u << 30)) {
+      break;
+    }
+    calls *= 2;
+  }
+
+  u64 ops = ops_per_call * calls;
+  Log("{\"name\":\"%s\",\"ns_per_op\":%.3f,\"ops_per_sec\":%.0f,\"ops\":%llu}\n", name,
+      elapsed * 1e9 / ops, ops / elapsed, (unsigned long long)ops);
+}
+
+#define BENCH_BOX_PAIRS 64
+
+// A world of BENCH_BOX_PAIRS overlapping, rotated box pairs
+struct CollideBench {
+  physics::World *world;
+  physics::BroadPhasePair pairs[BENCH_BOX_PAIRS];
+  physics::BoxPairAxis axes[BENCH_BOX_PAIRS];
+};
+
+internal void CollideBenchRun(void *data, u32 calls) {
+  CollideBench *bench = (CollideBench *)data;
+  u64 contacts = 0;
+  for (u32 call = 0; call < calls; call++) {
+    for (u32 i = 0; i < BENCH_BOX_PAIRS; i++) {
+      physics::Arbiter arbiter
+          = physics::Collide(bench->world, bench->pairs[i].a, bench->pairs[i].b, bench->axes[i]);
+      contacts += arbiter.contacts_count;
+    }
+  }
+  bench_sink = contacts;
+}
+
+internal void CollideFindAxesBenchRun(void *data, u32 calls) {
+  CollideBench *bench = (CollideBench *)data;
+  for (u32 call = 0; call < calls; call++) {
+    physics::CollideFindAxes(bench->world, bench->pairs, BENCH_BOX_PAIRS, bench->axes);
+  }
+  bench_sink = bench->axes[0].axis;
+}
+
+// The scalar separating axis test CollideFindAxes runs on the pairs that do not fill a batch of
+// COLLIDE_LANES, on every pair
+internal void CollideFindAxesScalarBenchRun(void *data, u32 calls) {
+  CollideBench *bench = (CollideBench *)data;
+  physics::World *world = bench->world;
+  physics::Bodies *bodies = &world->bodies;
+  for (u32 call = 0; call < calls; call++) {
+    for (u32 i = 0; i < BENCH_BOX_PAIRS; i++) {
+      u32 i1 = bench->pairs[i].a;
+      u32 i2 = bench->pairs[i].b;
+      if (!physics::CollideFindAxis(bench->axes + i, bodies->width[i1] * 0.5f,
+                                    bodies->width[i2] * 0.5f, bodies->position[i1],
+                                    bodies->position[i2], world->rotations[i1],
+                                    world->rotations[i2])) {
+        bench->axes[i].axis = physics::NO_AXIS;
+      }
+    }
+  }
+  bench_sink = bench->axes[0].axis;
+}
+
+struct ClipBench {
+  physics::ClipVertex in[BENCH_BOX_PAIRS][2];
+  v2 normals[BENCH_BOX_PAIRS];
+};
+
+internal void ClipBenchRun(void *data, u32 calls) {
+  ClipBench *bench = (ClipBench *)data;
+  u64 points = 0;
+  for (u32 call = 0; call < calls; call++) {
+    for (u32 i = 0; i < BENCH_BOX_PAIRS; i++) {
+      physics::ClipVertex out[2];
+      points += physics::ClipSegmentToLine(out, bench->in[i], bench->normals[i], 0.1f,
+                                           physics::EDGE1);
+    }
+  }
+  bench_sink = points;
+}
+
+#define BENCH_HASH_KEYS 2048
+global HashTable<u32, BENCH_HASH_KEYS * 2> bench_hash_table;
+global u64 bench_hash_keys[BENCH_HASH_KEYS];
+
+internal void HashTableSetBenchRun(void * /* data */, u32 calls) {
+  for (u32 call = 0; call < calls; call++) {
+    HashTableClear(&bench_hash_table);
+    for (u32 i = 0; i < BENCH_HASH_KEYS; i++) {
+      HashTableSet(&bench_hash_table, bench_hash_keys[i], i);
+    }
+  }
+  bench_sink = bench_hash_table.entries_count;
+}
+
+internal void HashTableGetBenchRun(void * /* data */, u32 calls) {
+  u64 sum = 0;
+  for (u32 call = 0; call < calls; call++) {
+    for (u32 i = 0; i < BENCH_HASH_KEYS; i++) {
+      sum += *HashTableGet(&bench_hash_table, bench_hash_keys[i]);
+    }
+  }
+  bench_sink = sum;
+}
+
+// The arbiter cache before and after ArbiterTable: a HashTable of whole arbiters keyed by
+// murmur64 of the pair, the way the world kept them, against the ArbiterTable keyed by the body
+// indices. Every key is unique, as in a step.
+global HashTable<physics::Arbiter, BENCH_HASH_KEYS * 2> bench_arbiter_hash_table;
+
+struct ArbiterCacheBench {
+  physics::ArbiterTable table;
+  physics::Arbiter arbiters[BENCH_HASH_KEYS];
+  u32 arbiters_count;
+};
+
+internal void HashTableArbiterSetBenchRun(void *data, u32 calls) {
+  ArbiterCacheBench *bench = (ArbiterCacheBench *)data;
+  for (u32 call = 0; call < calls; call++) {
+    HashTableClear(&bench_arbiter_hash_table);
+    for (u32 i = 0; i < bench->arbiters_count; i++) {
+      physics::Arbiter *a = bench->arbiters + i;
+      HashTableSet(&bench_arbiter_hash_table, murmur64(&a->key, sizeof(a->key)), *a);
+    }
+  }
+  bench_sink = bench_arbiter_hash_table.entries_count;
+}
+
+internal void HashTableArbiterGetBenchRun(void *data, u32 calls) {
+  ArbiterCacheBench *bench = (ArbiterCacheBench *)data;
+  u64 sum = 0;
+  for (u32 call = 0; call < calls; call++) {
+    for (u32 i = 0; i < bench->arbiters_count; i++) {
+      u64 key = bench->arbiters[i].key;
+      sum += HashTableGet(&bench_arbiter_hash_table, murmur64(&key, sizeof(key)))->i2;
+    }
+  }
+  bench_sink = sum;
+}
+
+internal void ArbiterTableInsertBenchRun(void *data, u32 calls) {
+  ArbiterCacheBench *bench = (ArbiterCacheBench *)data;
+  for (u32 call = 0; call < calls; call++) {
+    physics::ArbiterTableClear(&bench->table);
+    for (u32 i = 0; i < bench->arbiters_count; i++) {
+      physics::Arbiter *a = bench->arbiters + i;
+      physics::ArbiterTableInsert(&bench->table, a->key, *a);
+    }
+  }
+  bench_sink = bench->table.arbiters_count;
+}
+
+internal void ArbiterTableGetBenchRun(void *data, u32 calls) {
+  ArbiterCacheBench *bench = (ArbiterCacheBench *)data;
+  u64 sum = 0;
+  for (u32 call = 0; call < calls; call++) {
+    for (u32 i = 0; i < bench->arbiters_count; i++) {
+      sum += physics::ArbiterTableGet(&bench->table, bench->arbiters[i].key)->i2;
+    }
+  }
+  bench_sink = sum;
+}
+
+struct MurmurBench {
+  u8 data[1024];
+  u32 size;
+};
+
+internal void MurmurBenchRun(void *data, u32 calls) {
+  MurmurBench *bench = (MurmurBench *)data;
+  u64 hash = 0;
+  for (u32 call = 0; call < calls; call++) {
+    bench->data[0] = (u8)call;
+    hash ^= murmur64(bench->data, bench->size);
+  }
+  bench_sink = hash;
+}
+
+internal void ApplyImpulseBenchRun(void *data, u32 calls) {
+  physics::World *world = (physics::World *)data;
+  physics::ArbiterTable *table = &world->arbiter_table;
+  for (u32 call = 0; call < calls; call++) {
+    for (u32 i = 0; i < table->arbiters_count; i++) {
+      physics::ArbiterApplyImpulse(world, table->arbiters + i);
+    }
+  }
+  bench_sink = (u64)world->bodies.velocity[1].y;
+}
+
+internal void AddPyramid(physics::World *world, u32 base_count, f32 size);
+
+internal void RunMicrobenchmarks() {
+  MemoryArena arena = MemoryArenaInitialize();
+  MemoryArena scratch_arena = MemoryArenaInitialize();
+  Defer(MemoryArenaRelease(&arena));
+  Defer(MemoryArenaRelease(&scratch_arena));
+
+  {
+    physics::World world;
+    physics::InitWorld(&world, &arena, &scratch_arena, {0.0f, -10.0f}, 2 * BENCH_BOX_PAIRS);
+    CollideBench bench = {};
+    bench.world = &world;
+    for (u32 i = 0; i < BENCH_BOX_PAIRS; i++) {
+      v2 position = {i * 4.0f, 0.0f};
+      v2 offset = {RandomRange(0.4f, 0.7f), RandomRange(-0.2f, 0.2f)};
+      physics::BodyHandle a = physics::AddBody(&world, position, {1.0f, 1.0f}, 1.0f);
+      physics::BodyHandle b = physics::AddBody(&world, position + offset, {1.0f, 0.5f}, 1.0f);
+      physics::BodyRotation(&world, a) = RandomRange(-0.3f, 0.3f);
+      physics::BodyRotation(&world, b) = RandomRange(0.0f, PI);
+      bench.pairs[i] = {2 * i, 2 * i + 1};
+    }
+    physics::UpdateProxies(&world, 0);
+    physics::CollideFindAxes(&world, bench.pairs, BENCH_BOX_PAIRS, bench.axes);
+    for (u32 i = 0; i < BENCH_BOX_PAIRS; i++) {
+      Assert(bench.axes[i].axis != physics::NO_AXIS);
+    }
+
+    RunMicro("CollideFindAxes", CollideFindAxesBenchRun, &bench, BENCH_BOX_PAIRS);
+    RunMicro("CollideFindAxesScalar", CollideFindAxesScalarBenchRun, &bench, BENCH_BOX_PAIRS);
+    RunMicro("Collide", CollideBenchRun, &bench, BENCH_BOX_PAIRS);
+    MemoryArenaClear(&arena);
+  }
+
+  {
+    ClipBench bench = {};
+    for (u32 i = 0; i < BENCH_BOX_PAIRS; i++) {
+      bench.in[i][0].v = {RandomRange(-1.0f, 1.0f), RandomRange(-1.0f, 1.0f)};
+      bench.in[i][1].v = {RandomRange(-1.0f, 1.0f), RandomRange(-1.0f, 1.0f)};
+      f32 angle = RandomRange(0.0f, 2.0f * PI);
+      bench.normals[i] = {Cos(angle), Sin(angle)};
+    }
+    RunMicro("ClipSegmentToLine", ClipBenchRun, &bench, BENCH_BOX_PAIRS);
+  }
+
+  {
+    HashTableInit(&bench_hash_table);
+    for (u32 i = 0; i < BENCH_HASH_KEYS; i++) {
+      // Arbiter keys, pairs of body indices
+      u32 i1 = (u32)RandomRange(0.0f, 4096.0f);
+      bench_hash_keys[i] = ((u64)i1 << 32) | (i1 + 1 + (u32)RandomRange(0.0f, 64.0f));
+    }
+    RunMicro("HashTableSet", HashTableSetBenchRun, 0, BENCH_HASH_KEYS);
+    RunMicro("HashTableGet", HashTableGetBenchRun, 0, BENCH_HASH_KEYS);
+
+    ArbiterCacheBench *bench
+        = (ArbiterCacheBench *)MemoryArenaPush(&arena, sizeof(ArbiterCacheBench));
+    *bench = {};
+    physics::ArbiterTableInit(&bench->table, &arena, BENCH_HASH_KEYS);
+    physics::ArbiterTableReserveBodies(&bench->table, 4096 + 64);  // the largest i2 above
+    for (u32 i = 0; i < BENCH_HASH_KEYS; i++) {
+      u64 key = bench_hash_keys[i];
+      if (physics::ArbiterTableGet(&bench->table, key)) {
+        continue;
+      }
+      physics::Arbiter *a = bench->arbiters + bench->arbiters_count++;
+      a->i1 = (u32)(key >> 32);
+      a->i2 = (u32)key;
+      a->key = key;
+      physics::ArbiterTableInsert(&bench->table, key, *a);
+    }
+    HashTableInit(&bench_arbiter_hash_table);
+    RunMicro("HashTableArbiterSet", HashTableArbiterSetBenchRun, bench, bench->arbiters_count);
+    RunMicro("HashTableArbiterGet", HashTableArbiterGetBenchRun, bench, bench->arbiters_count);
+    RunMicro("ArbiterTableInsert", ArbiterTableInsertBenchRun, bench, bench->arbiters_count);
+    RunMicro("ArbiterTableGet", ArbiterTableGetBenchRun, bench, bench->arbiters_count);
+    MemoryArenaClear(&arena);
+  }
+
+  {
+    MurmurBench bench = {};
+    for (u32 i = 0; i < ArrayCount(bench.data); i++) {
+      bench.data[i] = (u8)RandomRange(0.0f, 255.0f);
+    }
+    bench.size = 8;
+    RunMicro("murmur64/8", MurmurBenchRun, &bench, 1);
+    bench.size = 1024;
+    RunMicro("murmur64/1024", MurmurBenchRun, &bench, 1);
+  }
+
+  {
+    // The arbiters of a settled pyramid, pre-stepped by the last step
+    physics::World world;
+    physics::InitWorld(&world, &arena, &scratch_arena, {0.0f, -10.0f}, 1024);
+    world.time_to_sleep = 0.0f;
+    physics::AddBody(&world, {0.0f, -1.5f}, {60.0f, 3.0f}, F32_Max);
+    AddPyramid(&world, 20, 1.0f);
+    for (u32 i = 0; i < 60; i++) {
+      physics::Step(&world, world.fixed_dt);
+    }
+    RunMicro("ArbiterApplyImpulse", ApplyImpulseBenchRun, &world,
+             world.arbiter_table.arbiters_count);
+  }
+}
+
+//
+// Scenarios
+//
+
+internal void AddPyramid(physics::World *world, u32 base_count, f32 size) {
+  for (u32 row = 0; row < base_count; row++) {
+    u32 row_count = base_count - row;
+    f32 x = (row_count - 1) * size * -0.5f;
+    f32 y = size * 0.5f + row * size;
+    for (u32 i = 0; i < row_count; i++) {
+      physics::AddBody(world, {x + i * size, y}, {size, size}, 1.0f);
+    }
+  }
+}
+
+internal void ScenePyramid(physics::World *world, u32 bodies_count) {
+  u32 base_count = (u32)SquareRoot(2.0f * bodies_count);
+  physics::AddBody(world, {0.0f, -1.5f}, {base_count * 4.0f, 3.0f}, F32_Max);
+  AddPyramid(world, base_count, 1.0f);
+}
+
+// Boxes with the sizes, mass and rotations of the ones spawned by clicks in main.cpp
+internal void SceneRain(physics::World *world, u32 bodies_count) {
+  f32 width = SquareRoot((f32)bodies_count) * 2.0f;
+  physics::AddBody(world, {0.0f, -1.5f}, {width * 2.0f, 3.0f}, F32_Max);
+  for (u32 i = 0; i < bodies_count; i++) {
+    v2 position = {RandomRange(-width, width), RandomRange(2.0f, 2.0f + width * 2.0f)};
+    v2 size = {2.0f * RandomRange(0.01f, 1.0f), RandomRange(0.1f, 1.0f)};
+    physics::BodyHandle h = physics::AddBody(world, position, size, 25.0f);
+    physics::BodyRotation(world, h) = RandomRange(0.0f, 2.0f * PI);
+  }
+}
+
+internal void SceneField(physics::World *world, u32 bodies_count) {
+  f32 spacing = 1.5f;
+  f32 width = bodies_count * spacing;
+  physics::AddBody(world, {width * 0.5f, -1.5f}, {width + 4.0f, 3.0f}, F32_Max);
+  for (u32 i = 0; i < bodies_count; i++) {
+    physics::AddBody(world, {i * spacing, 0.5f}, {1.0f, 1.0f}, 1.0f);
+  }
+}
+
+internal void ScenePile(physics::World *world, u32 bodies_count) {
+  u32 columns = (u32)SquareRoot((f32)bodies_count) / 2 + 1;
+  f32 size = 0.5f;
+  f32 half_width = columns * size * 0.5f + size;
+  f32 height = (bodies_count / columns + 1) * size * 1.1f;
+  physics::AddBody(world, {0.0f, -1.5f}, {half_width * 2.0f + 4.0f, 3.0f}, F32_Max);
+  physics::AddBody(world, {-half_width - 0.5f, height * 0.5f}, {1.0f, height + 2.0f}, F32_Max);
+  physics::AddBody(world, {half_width + 0.5f, height * 0.5f}, {1.0f, height + 2.0f}, F32_Max);
+  for (u32 i = 0; i < bodies_count; i++) {
+    u32 row = i / columns;
+    u32 column = i % columns;
+    v2 position = {-half_width + size * (column + 1.0f) + RandomRange(-0.05f, 0.05f),
+                   size * (row + 0.5f) * 1.1f};
+    physics::BodyHandle h = physics::AddBody(world, position, {size, size}, 1.0f);
+    physics::BodyRotation(world, h) = RandomRange(-0.2f, 0.2f);
+  }
+}
+
+typedef void BenchScene(physics::World *world, u32 bodies_count);
+
+internal int CompareF64(const void *a, const void *b) {
+  f64 x = *(const f64 *)a;
+  f64 y = *(const f64 *)b;
+  return (x > y) - (x < y);
+}
+
+// variant is appended to the name, for scenarios that run with other options than the rest
+internal void RunScenario(const char *scene_name, BenchScene *scene, u32 bodies_count,
+                          const char *variant = "") {
+  char name[64];
+  snprintf(name, sizeof(name), "%s/%u%s", scene_name, bodies_count, variant);
+  if (!BenchSelected(name)) {
+    return;
+  }
+
+  MemoryArena arena = MemoryArenaInitialize();
+  MemoryArena scratch_arena = MemoryArenaInitialize();
+  Defer(MemoryArenaRelease(&arena));
+  Defer(MemoryArenaRelease(&scratch_arena));
+
+  physics::World world;
+  physics::InitWorld(&world, &arena, &scratch_arena, {0.0f, -10.0f}, bodies_count + 8);
+  bench_random_state = 0x9e3779b97f4a7c15ull;
+  scene(&world, bodies_count);
+  if (bench_options.iterations > 0) {
+    world.iterations = bench_options.iterations;
+  }
+  if (bench_options.tolerance >= 0.0f) {
+    world.solver_tolerance = bench_options.tolerance;
+  }
+  world.solver_type = bench_options.solver_type;
+  if (bench_options.substeps > 0) {
+    world.solver_substeps = bench_options.substeps;
+  }
+  world.split_impulses = bench_options.split_impulses;
+  if (bench_options.position_iterations > 0) {
+    world.position_iterations = bench_options.position_iterations;
+  }
+  physics::SetBroadPhase(&world, bench_options.broad_phase);
+
+  ThreadPool pool;
+  ThreadPoolInit(&pool, bench_options.threads, Megabytes(16));
+  Defer(ThreadPoolShutdown(&pool));
+  world.thread_pool = &pool;
+
+  u32 steps = bench_options.steps;
+  f64 *times = (f64 *)MemoryArenaPush(&arena, sizeof(f64) * steps);
+  f64 total = 0.0;
+  u64 iterations_total = 0;
+  u64 position_iterations_total = 0;
+  for (u32 i = 0; i < steps; i++) {
+    f64 start = SecondsNow();
+    physics::Step(&world, world.fixed_dt);
+    times[i] = SecondsNow() - start;
+    total += times[i];
+    iterations_total += world.solver_iterations;
+    position_iterations_total += world.solver_position_iterations;
+  }
+
+  f32 penetration = 0.0f;
+  physics::ArbiterTable *table = &world.arbiter_table;
+  for (u32 i = 0; i < table->arbiters_count; i++) {
+    physics::Arbiter *a = table->arbiters + i;
+    for (u32 j = 0; j < a->contacts_count; j++) {
+      penetration = Max(penetration, -a->contacts[j].seperation);
+    }
+  }
+
+  f64 kinetic_energy = 0.0;
+  physics::Bodies *bodies = &world.bodies;
+  for (u32 i = 0; i < bodies->count; i++) {
+    if (bodies->inv_mass[i] > 0.0f) {
+      v2 v = bodies->velocity[i];
+      f32 w = bodies->angular_velocity[i];
+      kinetic_energy += 0.5 * (v.x * v.x + v.y * v.y) / bodies->inv_mass[i];
+      kinetic_energy += 0.5 * w * w / bodies->inv_inertia[i];
+    }
+  }
+
+  qsort(times, steps, sizeof(f64), CompareF64);
+  Log("{\"name\":\"%s\",\"bodies\":%u,\"threads\":%u,\"steps\":%u,\"steps_per_sec\":%.1f,"
+      "\"mean_ms\":%.4f,\"p50_ms\":%.4f,\"p99_ms\":%.4f,\"max_ms\":%.4f,\"iterations\":%.2f,"
+      "\"penetration\":%.4f,\"position_iterations\":%.2f,\"kinetic_energy\":%.3f}\n",
+      name, world.bodies.count, pool.threads_count, steps, steps / total, total * 1e3 / steps,
+      times[steps / 2] * 1e3, times[(u32)(steps * 0.99)] * 1e3, times[steps - 1] * 1e3,
+      (f64)iterations_total / steps, penetration, (f64)position_iterations_total / steps,
+      kinetic_energy);
+}
+
+//
+// Snapshots
+//
+
+struct SnapshotBench {
+  physics::World *world;
+  void *buffer;
+  u64 size;
+};
+
+internal void SnapshotWriteBenchRun(void *data, u32 calls) {
+  SnapshotBench *bench = (SnapshotBench *)data;
+  u64 size = 0;
+  for (u32 call = 0; call < calls; call++) {
+    size += physics::WriteSnapshot(bench->world, bench->buffer, bench->size);
+  }
+  bench_sink = size;
+}
+
+internal void SnapshotRestoreBenchRun(void *data, u32 calls) {
+  SnapshotBench *bench = (SnapshotBench *)data;
+  u32 restored = 0;
+  for (u32 call = 0; call < calls; call++) {
+    restored += physics::RestoreSnapshot(bench->world, bench->buffer, bench->size);
+  }
+  Assert(restored == calls);
+  bench_sink = restored;
+}
+
+// Saves and restores a pile of bodies_count boxes that has been falling for a few steps, which
+// is what a rollback does every frame
+internal void RunSnapshot(u32 bodies_count) {
+  char write_name[64];
+  char restore_name[64];
+  snprintf(write_name, sizeof(write_name), "WriteSnapshot/%u", bodies_count);
+  snprintf(restore_name, sizeof(restore_name), "RestoreSnapshot/%u", bodies_count);
+  if (!BenchSelected(write_name) && !BenchSelected(restore_name)) {
+    return;
+  }
+
+  MemoryArena arena = MemoryArenaInitialize();
+  MemoryArena scratch_arena = MemoryArenaInitialize();
+  Defer(MemoryArenaRelease(&arena));
+  Defer(MemoryArenaRelease(&scratch_arena));
+
+  physics::World world;
+  physics::InitWorld(&world, &arena, &scratch_arena, {0.0f, -10.0f}, bodies_count + 8);
+  bench_random_state = 0x9e3779b97f4a7c15ull;
+  ScenePile(&world, bodies_count);
+  for (u32 i = 0; i < 30; i++) {
+    physics::Step(&world, world.fixed_dt);
+  }
+
+  SnapshotBench bench = {};
+  bench.world = &world;
+  bench.size = physics::SnapshotSize(&world);
+  bench.buffer = MemoryArenaPush(&arena, bench.size);
+  RunMicro(write_name, SnapshotWriteBenchRun, &bench, 1);
+  physics::WriteSnapshot(&world, bench.buffer, bench.size);
+  RunMicro(restore_name, SnapshotRestoreBenchRun, &bench, 1);
+}
+
+//
+// Broad phase
+//
+
+struct BroadPhaseBench {
+  physics::World *world;
+  physics::PairBuffer pairs;
+};
+
+internal void GridBenchRun(void *data, u32 calls) {
+  BroadPhaseBench *bench = (BroadPhaseBench *)data;
+  physics::World *world = bench->world;
+  for (u32 call = 0; call < calls; call++) {
+    physics::GridBuild(&world->grid, world->proxies, world->proxies_count);
+    physics::GridQueryPairs(&world->grid, world->proxies, world->proxies_count, &bench->pairs);
+  }
+  bench_sink = bench->pairs.pairs_count;
+}
+
+// What the broad phase did before the grid: every proxy against every other one. The old
+// loop went straight to Collide for each pair, so this is a lower bound of what it cost.
+internal void BruteForceBenchRun(void *data, u32 calls) {
+  BroadPhaseBench *bench = (BroadPhaseBench *)data;
+  physics::BroadPhaseProxy *proxies = bench->world->proxies;
+  u32 proxies_count = bench->world->proxies_count;
+  for (u32 call = 0; call < calls; call++) {
+    bench->pairs.pairs_count = 0;
+    for (u32 i = 0; i < proxies_count; i++) {
+      for (u32 j = i + 1; j < proxies_count; j++) {
+        if (proxies[i].is_static && proxies[j].is_static) {
+          continue;
+        }
+        if (physics::AABBOverlap(proxies[i].aabb, proxies[j].aabb)) {
+          physics::PushPair(&bench->pairs, i, j);
+        }
+      }
+    }
+  }
+  bench_sink = bench->pairs.pairs_count;
+}
+
+// Finds the pairs of a pile of bodies_count boxes with the grid and with the all pairs loop
+// the grid replaced. Both have to find the same number of pairs.
+internal void RunBroadPhase(u32 bodies_count) {
+  char grid_name[64];
+  char brute_force_name[64];
+  snprintf(grid_name, sizeof(grid_name), "BroadPhaseGrid/%u", bodies_count);
+  snprintf(brute_force_name, sizeof(brute_force_name), "BroadPhaseBruteForce/%u", bodies_count);
+  if (!BenchSelected(grid_name) && !BenchSelected(brute_force_name)) {
+    return;
+  }
+
+  MemoryArena arena = MemoryArenaInitialize();
+  MemoryArena scratch_arena = MemoryArenaInitialize();
+  Defer(MemoryArenaRelease(&arena));
+  Defer(MemoryArenaRelease(&scratch_arena));
+
+  physics::World world;
+  physics::InitWorld(&world, &arena, &scratch_arena, {0.0f, -10.0f}, bodies_count + 8);
+  bench_random_state = 0x9e3779b97f4a7c15ull;
+  ScenePile(&world, bodies_count);
+  for (u32 i = 0; i < 30; i++) {
+    physics::Step(&world, world.fixed_dt);
+  }
+
+  BroadPhaseBench bench = {};
+  bench.world = &world;
+  physics::PairBufferInit(&bench.pairs, &arena, 4 * bodies_count);
+  GridBenchRun(&bench, 1);
+  u32 grid_pairs_count = bench.pairs.pairs_count;
+  BruteForceBenchRun(&bench, 1);
+  Assert(bench.pairs.pairs_count == grid_pairs_count);
+
+  RunMicro(grid_name, GridBenchRun, &bench, 1);
+  RunMicro(brute_force_name, BruteForceBenchRun, &bench, 1);
+}
+
+//
+// Scene files
+//
+
+// Builds a world from a scene file or from the same bodies with AddBody, into an arena that is
+// cleared before every build
+struct SceneLoadBench {
+  MemoryArena *arena;
+  MemoryArena *scratch_arena;
+  const char *path;
+  u32 bodies_count;
+  v2 *position;
+  v2 *width;
+  f32 *mass;
+  f32 *rotation;
+};
+
+internal void LoadSceneFileBenchRun(void *data, u32 calls) {
+  SceneLoadBench *bench = (SceneLoadBench *)data;
+  u32 loaded = 0;
+  for (u32 call = 0; call < calls; call++) {
+    MemoryArenaClear(bench->arena);
+    physics::World world;
+    physics::InitWorld(&world, bench->arena, bench->scratch_arena, {0.0f, -10.0f}, 0);
+    physics::SceneMapping mapping = {};
+    loaded += physics::LoadSceneFile(&world, bench->path, &mapping);
+    physics::UnmapSceneFile(&mapping);
+  }
+  Assert(loaded == calls);
+  bench_sink = loaded;
+}
+
+internal void AddBodyBenchRun(void *data, u32 calls) {
+  SceneLoadBench *bench = (SceneLoadBench *)data;
+  u32 added = 0;
+  for (u32 call = 0; call < calls; call++) {
+    MemoryArenaClear(bench->arena);
+    physics::World world;
+    physics::InitWorld(&world, bench->arena, bench->scratch_arena, {0.0f, -10.0f},
+                       bench->bodies_count);
+    for (u32 i = 0; i < bench->bodies_count; i++) {
+      physics::BodyHandle h
+          = physics::AddBody(&world, bench->position[i], bench->width[i], bench->mass[i]);
+      physics::BodyRotation(&world, h) = bench->rotation[i];
+    }
+    added += world.bodies.count;
+  }
+  bench_sink = added;
+}
+
+// Loads a box pile of bodies_count boxes from a scene file and builds it with AddBody. The
+// file goes to /tmp and is deleted afterwards.
+internal void RunSceneLoad(u32 bodies_count) {
+  char load_name[64];
+  char add_name[64];
+  snprintf(load_name, sizeof(load_name), "LoadSceneFile/%u", bodies_count);
+  snprintf(add_name, sizeof(add_name), "AddBody/%u", bodies_count);
+  if (!BenchSelected(load_name) && !BenchSelected(add_name)) {
+    return;
+  }
+
+  MemoryArena arena = MemoryArenaInitialize();
+  MemoryArena scratch_arena = MemoryArenaInitialize();
+  MemoryArena world_arena = MemoryArenaInitialize();
+  MemoryArena world_scratch_arena = MemoryArenaInitialize();
+  Defer(MemoryArenaRelease(&arena));
+  Defer(MemoryArenaRelease(&scratch_arena));
+  Defer(MemoryArenaRelease(&world_arena));
+  Defer(MemoryArenaRelease(&world_scratch_arena));
+
+  physics::World world;
+  physics::InitWorld(&world, &arena, &scratch_arena, {0.0f, -10.0f}, bodies_count + 8);
+  bench_random_state = 0x9e3779b97f4a7c15ull;
+  ScenePile(&world, bodies_count);
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/c_physics_bench_%u.scene", bodies_count);
+  if (!physics::WriteSceneFile(&world, path)) {
+    return;
+  }
+  Defer(unlink(path));
+
+  SceneLoadBench bench = {};
+  bench.arena = &world_arena;
+  bench.scratch_arena = &world_scratch_arena;
+  bench.path = path;
+  physics::Bodies *bodies = &world.bodies;
+  bench.bodies_count = bodies->count;
+  bench.position = (v2 *)MemoryArenaPush(&arena, sizeof(v2) * bodies->count);
+  bench.width = (v2 *)MemoryArenaPush(&arena, sizeof(v2) * bodies->count);
+  bench.mass = (f32 *)MemoryArenaPush(&arena, sizeof(f32) * bodies->count);
+  bench.rotation = (f32 *)MemoryArenaPush(&arena, sizeof(f32) * bodies->count);
+  for (u32 i = 0; i < bodies->count; i++) {
+    bench.position[i] = bodies->position[i];
+    bench.width[i] = bodies->width[i];
+    bench.mass[i] = bodies->inv_mass[i] > 0.0f ? 1.0f / bodies->inv_mass[i] : F32_Max;
+    bench.rotation[i] = bodies->rotation[i];
+  }
+
+  RunMicro(load_name, LoadSceneFileBenchRun, &bench, 1);
+  RunMicro(add_name, AddBodyBenchRun, &bench, 1);
+}
+
+int main(int argc, char **argv) {
+  bench_options.steps = 300;
+  bench_options.threads = 1;
+  bench_options.min_time = 0.2;
+  bench_options.tolerance = -1.0f;
+  for (i32 i = 1; i + 1 < argc; i += 2) {
+    const char *option = argv[i];
+    const char *value = argv[i + 1];
+    if (strcmp(option, "-filter") == 0) {
+      bench_options.filter = value;
+    } else if (strcmp(option, "-steps") == 0) {
+      bench_options.steps = (u32)Max(CStringToI32(value), 1);
+    } else if (strcmp(option, "-threads") == 0) {
+      bench_options.threads = (u32)Max(CStringToI32(value), 1);
+    } else if (strcmp(option, "-min_time") == 0) {
+      bench_options.min_time = atof(value);
+    } else if (strcmp(option, "-iterations") == 0) {
+      bench_options.iterations = (u32)Max(CStringToI32(value), 1);
+    } else if (strcmp(option, "-tolerance") == 0) {
+      bench_options.tolerance = CStringToF32(value);
+    } else if (strcmp(option, "-solver") == 0 && strcmp(value, "iterations") == 0) {
+      bench_options.solver_type = physics::SOLVER_ITERATIONS;
+    } else if (strcmp(option, "-solver") == 0 && strcmp(value, "substep") == 0) {
+      bench_options.solver_type = physics::SOLVER_SUBSTEP;
+    } else if (strcmp(option, "-substeps") == 0) {
+      bench_options.substeps = (u32)Max(CStringToI32(value), 1);
+    } else if (strcmp(option, "-split_impulses") == 0) {
+      bench_options.split_impulses = CStringToI32(value) != 0;
+    } else if (strcmp(option, "-position_iterations") == 0) {
+      bench_options.position_iterations = (u32)Max(CStringToI32(value), 1);
+    } else if (strcmp(option, "-thread_sweep") == 0) {
+      bench_options.thread_sweep = CStringToI32(value) != 0;
+    } else if (strcmp(option, "-broadphase") == 0 && strcmp(value, "all") == 0) {
+      bench_options.all_broad_phases = true;
+    } else if (strcmp(option, "-broadphase") == 0
+               && ParseBroadPhase(value, &bench_options.broad_phase)) {
+      bench_options.all_broad_phases = false;
+    } else {
+      LogError("Unknown option %s %s", option, value);
+      Log("usage: %s [-filter text] [-steps N] [-threads N] [-min_time seconds] "
+          "[-iterations N] [-tolerance m/s] [-solver iterations|substep] [-substeps N] "
+          "[-split_impulses 0|1] [-position_iterations N] [-broadphase grid|tree|sap|all] "
+          "[-thread_sweep 0|1]\n",
+          argv[0]);
+      return 1;
+    }
+  }
+
+  RunMicrobenchmarks();
+  RunSnapshot(1000);
+  RunSnapshot(10000);
+  RunBroadPhase(1000);
+  RunBroadPhase(10000);
+  RunSceneLoad(10000);
+  RunSceneLoad(100000);
+
+  struct {
+    const char *name;
+    BenchScene *scene;
+  } scenes[] = {
+      {"pyramid", ScenePyramid},
+      {"rain", SceneRain},
+      {"field", SceneField},
+      {"pile", ScenePile},
+  };
+  u32 sizes[] = {100, 1000, 10000};
+  // -broadphase all runs every scenario once per broad phase and -thread_sweep 1 once per
+  // thread count, the stacks below run with the grid and -threads
+  u32 broad_phases_count = bench_options.all_broad_phases ? ArrayCount(bench_broad_phase_names) : 1;
+  u32 threads = bench_options.threads;
+  for (u32 type = 0; type < broad_phases_count; type++) {
+    for (u32 t = bench_options.thread_sweep ? 1 : threads; t <= threads; t++) {
+      char variant[32] = "";
+      u32 variant_length = 0;
+      if (bench_options.all_broad_phases) {
+        bench_options.broad_phase = (physics::BroadPhaseType)type;
+        variant_length += snprintf(variant + variant_length, sizeof(variant) - variant_length,
+                                   "/%s", bench_broad_phase_names[type]);
+      }
+      if (bench_options.thread_sweep) {
+        snprintf(variant + variant_length, sizeof(variant) - variant_length, "/threads_%u", t);
+      }
+      bench_options.threads = t;
+      for (u32 i = 0; i < ArrayCount(scenes); i++) {
+        for (u32 j = 0; j < ArrayCount(sizes); j++) {
+          RunScenario(scenes[i].name, scenes[i].scene, sizes[j], variant);
+        }
+      }
+    }
+  }
+  if (bench_options.all_broad_phases) {
+    bench_options.broad_phase = physics::BROAD_PHASE_GRID;
+  }
+  bench_options.threads = threads;
+
+  // The stacks, without and with split impulses
+  struct {
+    const char *name;
+    BenchScene *scene;
+  } stacks[] = {
+      {"pyramid", ScenePyramid},
+      {"pile", ScenePile},
+  };
+  b32 split_impulses = bench_options.split_impulses;
+  for (u32 i = 0; i < ArrayCount(stacks); i++) {
+    bench_options.split_impulses = false;
+    RunScenario(stacks[i].name, stacks[i].scene, 1000, "/velocity_bias");
+    bench_options.split_impulses = true;
+    RunScenario(stacks[i].name, stacks[i].scene, 1000, "/split_impulses");
+  }
+  bench_options.split_impulses = split_impulses;
+
+  return 0;
+}
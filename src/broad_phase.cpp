@@ -0,0 +1,998 @@
+#include "broad_phase.h"
+
+#include "language_layer.h"
+
+namespace physics {
+  b32 AABBOverlap(const AABB &a, const AABB &b) {
+    return a.min.x <= b.max.x && b.min.x <= a.max.x && a.min.y <= b.max.y && b.min.y <= a.max.y;
+  }
+
+  inline i32 GridCellCoordinate(Grid *grid, f32 x) { return (i32)floorf(x / grid->cell_size); }
+
+  inline u32 GridCellHash(i32 cell_x, i32 cell_y) {
+    return ((u32)cell_x * 73856093u) ^ ((u32)cell_y * 19349663u);
+  }
+
+  void GridInit(Grid *grid, MemoryArena *arena, f32 cell_size) {
+    Assert(cell_size > 0.0f);
+
+    *grid = {};
+    grid->arena = arena;
+    grid->cell_size = cell_size;
+  }
+
+  void GridBuild(Grid *grid, BroadPhaseProxy *proxies, u32 proxies_count) {
+    grid->entries_count = 0;
+    grid->large_proxies_count = 0;
+
+    if (proxies_count > grid->proxies_capacity) {
+      u32 capacity = Max(grid->proxies_capacity * 2, proxies_count);
+      grid->large_proxies = (u32 *)MemoryArenaPush(grid->arena, sizeof(u32) * capacity);
+      grid->is_large = (b8 *)MemoryArenaPush(grid->arena, sizeof(b8) * capacity);
+      grid->proxies_capacity = capacity;
+    }
+
+    // Insert every proxy into the cells it touches
+    for (u32 i = 0; i < proxies_count; i++) {
+      AABB *box = &proxies[i].aabb;
+      i32 x0 = GridCellCoordinate(grid, box->min.x);
+      i32 y0 = GridCellCoordinate(grid, box->min.y);
+      i32 x1 = GridCellCoordinate(grid, box->max.x);
+      i32 y1 = GridCellCoordinate(grid, box->max.y);
+
+      i32 cells_count = (x1 - x0 + 1) * (y1 - y0 + 1);
+      grid->is_large[i] = cells_count > GRID_MAX_CELLS_PER_BODY;
+      if (grid->is_large[i]) {
+        grid->large_proxies[grid->large_proxies_count++] = i;
+        continue;
+      }
+
+      MemoryArenaReserveArray(grid->arena, &grid->entries, &grid->entries_capacity,
+                              grid->entries_count, grid->entries_count + cells_count);
+      for (i32 y = y0; y <= y1; y++) {
+        for (i32 x = x0; x <= x1; x++) {
+          GridEntry *e = grid->entries + grid->entries_count++;
+          e->cell_x = x;
+          e->cell_y = y;
+          e->proxy = i;
+        }
+      }
+    }
+
+    // Keep roughly one entry per bucket
+    u32 buckets_count = 64;
+    while (buckets_count < grid->entries_count) {
+      buckets_count <<= 1;
+    }
+    if (buckets_count > grid->buckets_capacity) {
+      grid->bucket_start = (u32 *)MemoryArenaPush(grid->arena, sizeof(u32) * (buckets_count + 1));
+      grid->bucket_cursor = (u32 *)MemoryArenaPush(grid->arena, sizeof(u32) * buckets_count);
+      grid->buckets_capacity = buckets_count;
+    }
+    grid->buckets_count = buckets_count;
+
+    if (grid->entries_capacity > grid->sorted_entries_capacity) {
+      grid->sorted_entries
+          = (GridEntry *)MemoryArenaPush(grid->arena, sizeof(GridEntry) * grid->entries_capacity);
+      grid->sorted_entries_capacity = grid->entries_capacity;
+    }
+
+    // Counting sort entries by bucket
+    u32 mask = buckets_count - 1;
+    u32 *bucket_cursor = grid->bucket_cursor;
+    MemorySet(bucket_cursor, 0, sizeof(u32) * buckets_count);
+    for (u32 i = 0; i < grid->entries_count; i++) {
+      GridEntry *e = grid->entries + i;
+      bucket_cursor[GridCellHash(e->cell_x, e->cell_y) & mask]++;
+    }
+
+    u32 sum = 0;
+    for (u32 i = 0; i < buckets_count; i++) {
+      u32 count = bucket_cursor[i];
+      grid->bucket_start[i] = sum;
+      bucket_cursor[i] = sum;
+      sum += count;
+    }
+    grid->bucket_start[buckets_count] = sum;
+
+    for (u32 i = 0; i < grid->entries_count; i++) {
+      GridEntry *e = grid->entries + i;
+      u32 bucket = GridCellHash(e->cell_x, e->cell_y) & mask;
+      grid->sorted_entries[bucket_cursor[bucket]++] = *e;
+    }
+  }
+
+  void PairBufferInit(PairBuffer *buffer, MemoryArena *arena, u32 capacity) {
+    *buffer = {};
+    buffer->arena = arena;
+    MemoryArenaReserveArray(arena, &buffer->pairs, &buffer->pairs_capacity, 0, capacity);
+  }
+
+  internal void PushPair(PairBuffer *buffer, u32 a, u32 b) {
+    if (buffer->pairs_count == buffer->pairs_capacity) {
+      MemoryArenaReserveArray(buffer->arena, &buffer->pairs, &buffer->pairs_capacity,
+                              buffer->pairs_count, buffer->pairs_count + 1);
+    }
+
+    BroadPhasePair *p = buffer->pairs + buffer->pairs_count++;
+    p->a = Min(a, b);
+    p->b = Max(a, b);
+  }
+
+  // Finds all pairs of overlapping proxies in the grid. Each pair is reported exactly once:
+  // proxies sharing several cells are only paired in the cell that holds the minimum corner of
+  // their intersection.
+  void GridQueryPairs(Grid *grid, BroadPhaseProxy *proxies, u32 proxies_count,
+                      PairBuffer *pairs) {
+    pairs->pairs_count = 0;
+
+    for (u32 bucket = 0; bucket < grid->buckets_count; bucket++) {
+      u32 start = grid->bucket_start[bucket];
+      u32 end = grid->bucket_start[bucket + 1];
+
+      for (u32 i = start; i < end; i++) {
+        GridEntry *ei = grid->sorted_entries + i;
+        BroadPhaseProxy *pi = proxies + ei->proxy;
+
+        for (u32 j = i + 1; j < end; j++) {
+          GridEntry *ej = grid->sorted_entries + j;
+          BroadPhaseProxy *pj = proxies + ej->proxy;
+
+          // Different cells can hash into the same bucket
+          if (ei->cell_x != ej->cell_x || ei->cell_y != ej->cell_y) {
+            continue;
+          }
+
+          if (pi->is_static && pj->is_static) {
+            continue;
+          }
+
+          if (!AABBOverlap(pi->aabb, pj->aabb)) {
+            continue;
+          }
+
+          i32 owner_x = GridCellCoordinate(grid, Max(pi->aabb.min.x, pj->aabb.min.x));
+          i32 owner_y = GridCellCoordinate(grid, Max(pi->aabb.min.y, pj->aabb.min.y));
+          if (owner_x != ei->cell_x || owner_y != ei->cell_y) {
+            continue;
+          }
+
+          PushPair(pairs, ei->proxy, ej->proxy);
+        }
+      }
+    }
+
+    // Large proxies are tested against every other proxy
+    for (u32 li = 0; li < grid->large_proxies_count; li++) {
+      u32 i = grid->large_proxies[li];
+      BroadPhaseProxy *pi = proxies + i;
+
+      for (u32 j = 0; j < proxies_count; j++) {
+        BroadPhaseProxy *pj = proxies + j;
+        if (i == j || (pi->is_static && pj->is_static)) {
+          continue;
+        }
+
+        // Large vs large pairs are only reported from the lower index
+        if (grid->is_large[j] && j < i) {
+          continue;
+        }
+
+        if (AABBOverlap(pi->aabb, pj->aabb)) {
+          PushPair(pairs, i, j);
+        }
+      }
+    }
+  }
+
+  // Dynamic AABB tree
+  //-----------------------------------------------
+  inline AABB AABBUnion(const AABB &a, const AABB &b) {
+    AABB result;
+    result.min = {Min(a.min.x, b.min.x), Min(a.min.y, b.min.y)};
+    result.max = {Max(a.max.x, b.max.x), Max(a.max.y, b.max.y)};
+    return result;
+  }
+
+  inline f32 AABBPerimeter(const AABB &a) {
+    return 2.0f * ((a.max.x - a.min.x) + (a.max.y - a.min.y));
+  }
+
+  inline b32 AABBContains(const AABB &outer, const AABB &inner) {
+    return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && inner.max.x <= outer.max.x
+           && inner.max.y <= outer.max.y;
+  }
+
+  // Slab test of the segment p1 -> p2 against the box
+  b32 AABBSegmentOverlap(const AABB &box, v2 p1, v2 p2) {
+    f32 t_min = 0.0f;
+    f32 t_max = 1.0f;
+    v2 d = p2 - p1;
+
+    f32 origin[2] = {p1.x, p1.y};
+    f32 dir[2] = {d.x, d.y};
+    f32 lo[2] = {box.min.x, box.min.y};
+    f32 hi[2] = {box.max.x, box.max.y};
+    for (u32 axis = 0; axis < 2; axis++) {
+      if (AbsoluteValue(dir[axis]) < 1e-9f) {
+        if (origin[axis] < lo[axis] || origin[axis] > hi[axis]) {
+          return false;
+        }
+      } else {
+        f32 inv_d = 1.0f / dir[axis];
+        f32 t1 = (lo[axis] - origin[axis]) * inv_d;
+        f32 t2 = (hi[axis] - origin[axis]) * inv_d;
+        if (t1 > t2) {
+          Swap(t1, t2);
+        }
+        t_min = Max(t_min, t1);
+        t_max = Min(t_max, t2);
+        if (t_min > t_max) {
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  // Links the nodes from first up to the capacity into the free list
+  internal void TreeLinkFreeNodes(DynamicTree *tree, u32 first) {
+    for (u32 i = first; i < tree->nodes_capacity; i++) {
+      tree->nodes[i].next = i + 1;
+      tree->nodes[i].height = -1;
+    }
+    tree->nodes[tree->nodes_capacity - 1].next = TREE_NULL_NODE;
+    tree->free_list = first;
+  }
+
+  void TreeInit(DynamicTree *tree, MemoryArena *arena, u32 proxies_capacity) {
+    *tree = {};
+    tree->arena = arena;
+    tree->root = TREE_NULL_NODE;
+
+    MemoryArenaReserveArray(arena, &tree->leaves, &tree->proxies_capacity, 0,
+                            Max(proxies_capacity, 16u));
+    MemoryArenaReserveArray(arena, &tree->nodes, &tree->nodes_capacity, 0,
+                            2 * tree->proxies_capacity);
+    TreeLinkFreeNodes(tree, 0);
+  }
+
+  // Removes every proxy, keeps the node and leaf arrays for the next TreeSync
+  void TreeClear(DynamicTree *tree) {
+    tree->root = TREE_NULL_NODE;
+    tree->proxies_count = 0;
+    tree->reinsert_count = 0;
+    TreeLinkFreeNodes(tree, 0);
+  }
+
+  internal u32 TreeAllocateNode(DynamicTree *tree) {
+    if (tree->free_list == TREE_NULL_NODE) {
+      u32 old_capacity = tree->nodes_capacity;
+      MemoryArenaReserveArray(tree->arena, &tree->nodes, &tree->nodes_capacity, old_capacity,
+                              old_capacity + 1);
+      TreeLinkFreeNodes(tree, old_capacity);
+    }
+
+    u32 index = tree->free_list;
+    TreeNode *node = tree->nodes + index;
+    tree->free_list = node->next;
+
+    node->parent = TREE_NULL_NODE;
+    node->child1 = TREE_NULL_NODE;
+    node->child2 = TREE_NULL_NODE;
+    node->height = 0;
+    node->proxy = TREE_NULL_NODE;
+    return index;
+  }
+
+  internal void TreeFreeNode(DynamicTree *tree, u32 index) {
+    tree->nodes[index].next = tree->free_list;
+    tree->nodes[index].height = -1;
+    tree->free_list = index;
+  }
+
+  // Performs a left or right rotation if node A is imbalanced. Returns the new subtree root.
+  internal u32 TreeBalance(DynamicTree *tree, u32 ia) {
+    TreeNode *A = tree->nodes + ia;
+    if (A->height < 2) {
+      return ia;
+    }
+
+    u32 ib = A->child1;
+    u32 ic = A->child2;
+    TreeNode *B = tree->nodes + ib;
+    TreeNode *C = tree->nodes + ic;
+
+    i32 balance = C->height - B->height;
+
+    // Rotate C up
+    if (balance > 1) {
+      u32 i_f = C->child1;
+      u32 ig = C->child2;
+      TreeNode *F = tree->nodes + i_f;
+      TreeNode *G = tree->nodes + ig;
+
+      C->child1 = ia;
+      C->parent = A->parent;
+      A->parent = ic;
+
+      if (C->parent != TREE_NULL_NODE) {
+        if (tree->nodes[C->parent].child1 == ia) {
+          tree->nodes[C->parent].child1 = ic;
+        } else {
+          tree->nodes[C->parent].child2 = ic;
+        }
+      } else {
+        tree->root = ic;
+      }
+
+      if (F->height > G->height) {
+        C->child2 = i_f;
+        A->child2 = ig;
+        G->parent = ia;
+        A->aabb = AABBUnion(B->aabb, G->aabb);
+        C->aabb = AABBUnion(A->aabb, F->aabb);
+        A->height = 1 + Max(B->height, G->height);
+        C->height = 1 + Max(A->height, F->height);
+      } else {
+        C->child2 = ig;
+        A->child2 = i_f;
+        F->parent = ia;
+        A->aabb = AABBUnion(B->aabb, F->aabb);
+        C->aabb = AABBUnion(A->aabb, G->aabb);
+        A->height = 1 + Max(B->height, F->height);
+        C->height = 1 + Max(A->height, G->height);
+      }
+
+      return ic;
+    }
+
+    // Rotate B up
+    if (balance < -1) {
+      u32 id = B->child1;
+      u32 ie = B->child2;
+      TreeNode *D = tree->nodes + id;
+      TreeNode *E = tree->nodes + ie;
+
+      B->child1 = ia;
+      B->parent = A->parent;
+      A->parent = ib;
+
+      if (B->parent != TREE_NULL_NODE) {
+        if (tree->nodes[B->parent].child1 == ia) {
+          tree->nodes[B->parent].child1 = ib;
+        } else {
+          tree->nodes[B->parent].child2 = ib;
+        }
+      } else {
+        tree->root = ib;
+      }
+
+      if (D->height > E->height) {
+        B->child2 = id;
+        A->child1 = ie;
+        E->parent = ia;
+        A->aabb = AABBUnion(C->aabb, E->aabb);
+        B->aabb = AABBUnion(A->aabb, D->aabb);
+        A->height = 1 + Max(C->height, E->height);
+        B->height = 1 + Max(A->height, D->height);
+      } else {
+        B->child2 = ie;
+        A->child1 = id;
+        D->parent = ia;
+        A->aabb = AABBUnion(C->aabb, D->aabb);
+        B->aabb = AABBUnion(A->aabb, E->aabb);
+        A->height = 1 + Max(C->height, D->height);
+        B->height = 1 + Max(A->height, E->height);
+      }
+
+      return ib;
+    }
+
+    return ia;
+  }
+
+  // Walks from index to the root refitting bounds and rebalancing
+  internal void TreeRefitAncestors(DynamicTree *tree, u32 index) {
+    while (index != TREE_NULL_NODE) {
+      index = TreeBalance(tree, index);
+
+      TreeNode *node = tree->nodes + index;
+      TreeNode *child1 = tree->nodes + node->child1;
+      TreeNode *child2 = tree->nodes + node->child2;
+      node->height = 1 + Max(child1->height, child2->height);
+      node->aabb = AABBUnion(child1->aabb, child2->aabb);
+
+      index = node->parent;
+    }
+  }
+
+  internal void TreeInsertLeaf(DynamicTree *tree, u32 leaf) {
+    if (tree->root == TREE_NULL_NODE) {
+      tree->root = leaf;
+      tree->nodes[leaf].parent = TREE_NULL_NODE;
+      return;
+    }
+
+    // Find the best sibling by descending along the cheapest perimeter increase
+    AABB leaf_aabb = tree->nodes[leaf].aabb;
+    u32 index = tree->root;
+    while (tree->nodes[index].height > 0) {
+      TreeNode *node = tree->nodes + index;
+      u32 child1 = node->child1;
+      u32 child2 = node->child2;
+
+      f32 area = AABBPerimeter(node->aabb);
+      f32 combined_area = AABBPerimeter(AABBUnion(node->aabb, leaf_aabb));
+
+      // Cost of creating a new parent for this node and the new leaf
+      f32 cost = 2.0f * combined_area;
+      // Minimum cost of pushing the leaf further down the tree
+      f32 inheritance_cost = 2.0f * (combined_area - area);
+
+      f32 cost1 = AABBPerimeter(AABBUnion(leaf_aabb, tree->nodes[child1].aabb))
+                  + inheritance_cost;
+      if (tree->nodes[child1].height > 0) {
+        cost1 -= AABBPerimeter(tree->nodes[child1].aabb);
+      }
+      f32 cost2 = AABBPerimeter(AABBUnion(leaf_aabb, tree->nodes[child2].aabb))
+                  + inheritance_cost;
+      if (tree->nodes[child2].height > 0) {
+        cost2 -= AABBPerimeter(tree->nodes[child2].aabb);
+      }
+
+      if (cost < cost1 && cost < cost2) {
+        break;
+      }
+
+      index = cost1 < cost2 ? child1 : child2;
+    }
+
+    u32 sibling = index;
+    u32 old_parent = tree->nodes[sibling].parent;
+    u32 new_parent = TreeAllocateNode(tree);
+    TreeNode *parent = tree->nodes + new_parent;
+    parent->parent = old_parent;
+    parent->aabb = AABBUnion(leaf_aabb, tree->nodes[sibling].aabb);
+    parent->height = tree->nodes[sibling].height + 1;
+    parent->child1 = sibling;
+    parent->child2 = leaf;
+    tree->nodes[sibling].parent = new_parent;
+    tree->nodes[leaf].parent = new_parent;
+
+    if (old_parent != TREE_NULL_NODE) {
+      if (tree->nodes[old_parent].child1 == sibling) {
+        tree->nodes[old_parent].child1 = new_parent;
+      } else {
+        tree->nodes[old_parent].child2 = new_parent;
+      }
+    } else {
+      tree->root = new_parent;
+    }
+
+    TreeRefitAncestors(tree, tree->nodes[leaf].parent);
+  }
+
+  internal void TreeRemoveLeaf(DynamicTree *tree, u32 leaf) {
+    if (leaf == tree->root) {
+      tree->root = TREE_NULL_NODE;
+      return;
+    }
+
+    u32 parent = tree->nodes[leaf].parent;
+    u32 grand_parent = tree->nodes[parent].parent;
+    u32 sibling = tree->nodes[parent].child1 == leaf ? tree->nodes[parent].child2
+                                                     : tree->nodes[parent].child1;
+
+    if (grand_parent != TREE_NULL_NODE) {
+      if (tree->nodes[grand_parent].child1 == parent) {
+        tree->nodes[grand_parent].child1 = sibling;
+      } else {
+        tree->nodes[grand_parent].child2 = sibling;
+      }
+      tree->nodes[sibling].parent = grand_parent;
+      TreeFreeNode(tree, parent);
+
+      TreeRefitAncestors(tree, grand_parent);
+    } else {
+      tree->root = sibling;
+      tree->nodes[sibling].parent = TREE_NULL_NODE;
+      TreeFreeNode(tree, parent);
+    }
+  }
+
+  internal AABB TreeFattenAABB(const AABB &aabb) {
+    AABB fat;
+    fat.min = {aabb.min.x - TREE_AABB_MARGIN, aabb.min.y - TREE_AABB_MARGIN};
+    fat.max = {aabb.max.x + TREE_AABB_MARGIN, aabb.max.y + TREE_AABB_MARGIN};
+    return fat;
+  }
+
+  // Creates leaves for new proxies and reinserts the ones that escaped their fat AABB
+  void TreeSync(DynamicTree *tree, BroadPhaseProxy *proxies, u32 proxies_count) {
+    tree->reinsert_count = 0;
+
+    for (u32 i = 0; i < tree->proxies_count; i++) {
+      u32 leaf = tree->leaves[i];
+      if (AABBContains(tree->nodes[leaf].aabb, proxies[i].aabb)) {
+        continue;
+      }
+
+      TreeRemoveLeaf(tree, leaf);
+      tree->nodes[leaf].aabb = TreeFattenAABB(proxies[i].aabb);
+      TreeInsertLeaf(tree, leaf);
+      tree->reinsert_count++;
+    }
+
+    MemoryArenaReserveArray(tree->arena, &tree->leaves, &tree->proxies_capacity,
+                            tree->proxies_count, proxies_count);
+    for (u32 i = tree->proxies_count; i < proxies_count; i++) {
+      u32 leaf = TreeAllocateNode(tree);
+      tree->nodes[leaf].aabb = TreeFattenAABB(proxies[i].aabb);
+      tree->nodes[leaf].proxy = i;
+      TreeInsertLeaf(tree, leaf);
+      tree->leaves[i] = leaf;
+    }
+    tree->proxies_count = proxies_count;
+  }
+
+  // Removes a proxy, the last proxy takes over its index
+  void TreeRemoveProxy(DynamicTree *tree, u32 proxy) {
+    Assert(proxy < tree->proxies_count);
+    u32 leaf = tree->leaves[proxy];
+    TreeRemoveLeaf(tree, leaf);
+    TreeFreeNode(tree, leaf);
+
+    u32 last = tree->proxies_count - 1;
+    if (proxy != last) {
+      tree->leaves[proxy] = tree->leaves[last];
+      tree->nodes[tree->leaves[proxy]].proxy = proxy;
+    }
+    tree->proxies_count--;
+  }
+
+  // Collects the proxies whose fat AABB overlaps the region. Returns the number of proxies
+  // written to out.
+  u32 TreeQueryAABB(DynamicTree *tree, const AABB &region, u32 *out, u32 out_max) {
+    u32 count = 0;
+    if (tree->root == TREE_NULL_NODE) {
+      return count;
+    }
+
+    u32 stack[TREE_STACK_SIZE];
+    u32 stack_count = 0;
+    stack[stack_count++] = tree->root;
+
+    while (stack_count > 0) {
+      TreeNode *node = tree->nodes + stack[--stack_count];
+      if (!AABBOverlap(node->aabb, region)) {
+        continue;
+      }
+
+      if (node->height == 0) {
+        if (count < out_max) {
+          out[count++] = node->proxy;
+        }
+      } else {
+        Assert(stack_count + 2 <= TREE_STACK_SIZE);
+        stack[stack_count++] = node->child1;
+        stack[stack_count++] = node->child2;
+      }
+    }
+
+    return count;
+  }
+
+  // Collects the proxies whose fat AABB is hit by the segment p1 -> p2
+  u32 TreeQuerySegment(DynamicTree *tree, v2 p1, v2 p2, u32 *out, u32 out_max) {
+    u32 count = 0;
+    if (tree->root == TREE_NULL_NODE) {
+      return count;
+    }
+
+    u32 stack[TREE_STACK_SIZE];
+    u32 stack_count = 0;
+    stack[stack_count++] = tree->root;
+
+    while (stack_count > 0) {
+      TreeNode *node = tree->nodes + stack[--stack_count];
+      if (!AABBSegmentOverlap(node->aabb, p1, p2)) {
+        continue;
+      }
+
+      if (node->height == 0) {
+        if (count < out_max) {
+          out[count++] = node->proxy;
+        }
+      } else {
+        Assert(stack_count + 2 <= TREE_STACK_SIZE);
+        stack[stack_count++] = node->child1;
+        stack[stack_count++] = node->child2;
+      }
+    }
+
+    return count;
+  }
+
+  // Every dynamic proxy queries the tree with its tight AABB. Static proxies never query, so
+  // static-vs-static pairs are never produced, and dynamic-vs-dynamic pairs are only reported
+  // from the lower index.
+  void TreeQueryPairs(DynamicTree *tree, BroadPhaseProxy *proxies, u32 proxies_count,
+                      PairBuffer *pairs) {
+    pairs->pairs_count = 0;
+    if (tree->root == TREE_NULL_NODE) {
+      return;
+    }
+
+    u32 stack[TREE_STACK_SIZE];
+    for (u32 i = 0; i < proxies_count; i++) {
+      BroadPhaseProxy *pi = proxies + i;
+      if (pi->is_static) {
+        continue;
+      }
+
+      u32 stack_count = 0;
+      stack[stack_count++] = tree->root;
+
+      while (stack_count > 0) {
+        TreeNode *node = tree->nodes + stack[--stack_count];
+        if (!AABBOverlap(node->aabb, pi->aabb)) {
+          continue;
+        }
+
+        if (node->height == 0) {
+          u32 j = node->proxy;
+          BroadPhaseProxy *pj = proxies + j;
+          if (j == i || (!pj->is_static && j < i)) {
+            continue;
+          }
+
+          if (AABBOverlap(pi->aabb, pj->aabb)) {
+            PushPair(pairs, i, j);
+          }
+        } else {
+          Assert(stack_count + 2 <= TREE_STACK_SIZE);
+          stack[stack_count++] = node->child1;
+          stack[stack_count++] = node->child2;
+        }
+      }
+    }
+  }
+
+  // Sweep and prune
+  //-----------------------------------------------
+  inline u64 SapPairKey(u32 a, u32 b) { return ((u64)a << 32) | b; }
+
+  inline u32 SapPairHash(SweepAndPrune *sap, u64 key) {
+    key *= 0x9E3779B97F4A7C15ull;
+    return (u32)(key >> 32) & sap->pair_slots_mask;
+  }
+
+  // Returns the slot of the pair, or of the empty slot where it would be inserted
+  internal u32 SapFindSlot(SweepAndPrune *sap, u32 a, u32 b) {
+    u64 key = SapPairKey(a, b);
+    u32 slot = SapPairHash(sap, key);
+    while (sap->pair_slots[slot] != 0) {
+      BroadPhasePair *p = sap->pairs.pairs + sap->pair_slots[slot] - 1;
+      if (SapPairKey(p->a, p->b) == key) {
+        break;
+      }
+      slot = (slot + 1) & sap->pair_slots_mask;
+    }
+    return slot;
+  }
+
+  internal void SapAllocateSlots(SweepAndPrune *sap, u32 slots_count) {
+    Assert((slots_count & (slots_count - 1)) == 0);  // must be a power of two!
+
+    sap->pair_slots = (u32 *)MemoryArenaPushZero(sap->arena, sizeof(u32) * slots_count);
+    sap->pair_slots_mask = slots_count - 1;
+  }
+
+  internal void SapRehash(SweepAndPrune *sap, u32 slots_count) {
+    if (slots_count != sap->pair_slots_mask + 1) {
+      SapAllocateSlots(sap, slots_count);
+    } else {
+      MemorySet(sap->pair_slots, 0, sizeof(u32) * slots_count);
+    }
+    for (u32 i = 0; i < sap->pairs.pairs_count; i++) {
+      BroadPhasePair *p = sap->pairs.pairs + i;
+      sap->pair_slots[SapFindSlot(sap, p->a, p->b)] = i + 1;
+    }
+  }
+
+  internal void SapAddPair(SweepAndPrune *sap, u32 a, u32 b) {
+    if (a > b) {
+      Swap(a, b);
+    }
+
+    u32 slot = SapFindSlot(sap, a, b);
+    if (sap->pair_slots[slot] != 0) {
+      return;
+    }
+
+    PushPair(&sap->pairs, a, b);
+
+    // Keep the load factor at or below one half
+    if (2 * sap->pairs.pairs_count > sap->pair_slots_mask + 1) {
+      SapRehash(sap, 2 * (sap->pair_slots_mask + 1));
+    } else {
+      sap->pair_slots[slot] = sap->pairs.pairs_count;
+    }
+    sap->added_count++;
+  }
+
+  internal void SapRemovePair(SweepAndPrune *sap, u32 a, u32 b) {
+    if (a > b) {
+      Swap(a, b);
+    }
+
+    u32 slot = SapFindSlot(sap, a, b);
+    u32 index = sap->pair_slots[slot];
+    if (index == 0) {
+      return;
+    }
+    index--;
+
+    // Backward shift deletion keeps probe sequences intact without tombstones
+    u32 mask = sap->pair_slots_mask;
+    u32 hole = slot;
+    u32 next = (hole + 1) & mask;
+    while (sap->pair_slots[next] != 0) {
+      BroadPhasePair *p = sap->pairs.pairs + sap->pair_slots[next] - 1;
+      u32 home = SapPairHash(sap, SapPairKey(p->a, p->b));
+      // Move the entry into the hole if its home slot is not cyclically in (hole, next]
+      if (((next - home) & mask) >= ((next - hole) & mask)) {
+        sap->pair_slots[hole] = sap->pair_slots[next];
+        hole = next;
+      }
+      next = (next + 1) & mask;
+    }
+    sap->pair_slots[hole] = 0;
+
+    // Swap remove from the dense list and patch the slot of the moved pair
+    BroadPhasePair *pairs = sap->pairs.pairs;
+    u32 last = sap->pairs.pairs_count - 1;
+    if (index != last) {
+      BroadPhasePair moved = pairs[last];
+      pairs[index] = moved;
+      sap->pair_slots[SapFindSlot(sap, moved.a, moved.b)] = index + 1;
+    }
+    sap->pairs.pairs_count--;
+    sap->removed_count++;
+  }
+
+  inline f32 SapEndpointValue(BroadPhaseProxy *proxies, u32 axis, u32 data) {
+    AABB *box = &proxies[data >> 1].aabb;
+    v2 v = (data & 1) ? box->max : box->min;
+    return axis == 0 ? v.x : v.y;
+  }
+
+  // Orders by value, min endpoints before max endpoints at equal values so that touching
+  // boxes count as overlapping just like AABBOverlap.
+  inline b32 SapEndpointLess(const SapEndpoint &a, const SapEndpoint &b) {
+    return a.value < b.value || (a.value == b.value && (a.data & 1) < (b.data & 1));
+  }
+
+  internal void SapPairEvent(SweepAndPrune *sap, BroadPhaseProxy *proxies, u32 a, u32 b) {
+    if (proxies[a].is_static && proxies[b].is_static) {
+      return;
+    }
+
+    if (AABBOverlap(proxies[a].aabb, proxies[b].aabb)) {
+      SapAddPair(sap, a, b);
+    } else {
+      SapRemovePair(sap, a, b);
+    }
+  }
+
+  internal void SapInsertionSort(SweepAndPrune *sap, BroadPhaseProxy *proxies, u32 axis) {
+    SapEndpoint *endpoints = sap->endpoints[axis];
+    u32 count = 2 * sap->proxies_count;
+
+    for (u32 i = 1; i < count; i++) {
+      SapEndpoint e = endpoints[i];
+      u32 j = i;
+      while (j > 0 && SapEndpointLess(e, endpoints[j - 1])) {
+        SapEndpoint f = endpoints[j - 1];
+
+        // A min passing a max starts an overlap on this axis, a max passing a min ends one
+        if ((e.data & 1) != (f.data & 1)) {
+          SapPairEvent(sap, proxies, e.data >> 1, f.data >> 1);
+        }
+
+        endpoints[j] = f;
+        j--;
+      }
+      endpoints[j] = e;
+    }
+  }
+
+  internal int SapEndpointCompare(const void *a, const void *b) {
+    const SapEndpoint *ea = (const SapEndpoint *)a;
+    const SapEndpoint *eb = (const SapEndpoint *)b;
+    if (SapEndpointLess(*ea, *eb)) {
+      return -1;
+    }
+    if (SapEndpointLess(*eb, *ea)) {
+      return 1;
+    }
+    return 0;
+  }
+
+  // Sorts both axes from scratch and sweeps the x axis to rebuild the pair set
+  internal void SapRebuild(SweepAndPrune *sap, BroadPhaseProxy *proxies) {
+    MemorySet(sap->pair_slots, 0, sizeof(u32) * (sap->pair_slots_mask + 1));
+    sap->pairs.pairs_count = 0;
+
+    for (u32 axis = 0; axis < 2; axis++) {
+      qsort(sap->endpoints[axis], 2 * sap->proxies_count, sizeof(SapEndpoint),
+            SapEndpointCompare);
+    }
+
+    u32 *active = sap->active;
+    u32 active_count = 0;
+    SapEndpoint *endpoints = sap->endpoints[0];
+    for (u32 i = 0; i < 2 * sap->proxies_count; i++) {
+      u32 proxy = endpoints[i].data >> 1;
+      if (endpoints[i].data & 1) {
+        for (u32 k = 0; k < active_count; k++) {
+          if (active[k] == proxy) {
+            active[k] = active[--active_count];
+            break;
+          }
+        }
+      } else {
+        for (u32 k = 0; k < active_count; k++) {
+          SapPairEvent(sap, proxies, proxy, active[k]);
+        }
+        active[active_count++] = proxy;
+      }
+    }
+  }
+
+  void SapInit(SweepAndPrune *sap, MemoryArena *arena, u32 proxies_capacity) {
+    *sap = {};
+    sap->arena = arena;
+
+    PairBufferInit(&sap->pairs, arena, 4 * proxies_capacity);
+    u32 slots_count = 16;
+    while (slots_count < 2 * sap->pairs.pairs_capacity) {
+      slots_count <<= 1;
+    }
+    SapAllocateSlots(sap, slots_count);
+  }
+
+  // Removes every proxy and pair, keeps the arrays for the next SapUpdate
+  void SapClear(SweepAndPrune *sap) {
+    for (u32 i = 0; i < sap->proxies_capacity; i++) {
+      sap->moved_to[i] = i;
+      sap->moved_from[i] = i;
+    }
+    sap->proxies_count = 0;
+    sap->removed_proxies_count = 0;
+    sap->pairs.pairs_count = 0;
+    MemorySet(sap->pair_slots, 0, sizeof(u32) * (sap->pair_slots_mask + 1));
+    sap->added_count = 0;
+    sap->removed_count = 0;
+  }
+
+  // Removes a proxy along with its pairs, the last proxy takes over its index. Constant time,
+  // the endpoints and pairs still refer to the old indices until SapCompact.
+  void SapRemoveProxy(SweepAndPrune *sap, u32 proxy) {
+    Assert(proxy < sap->proxies_count);
+    u32 last = sap->proxies_count - 1;
+
+    sap->moved_to[sap->moved_from[proxy]] = SAP_REMOVED_PROXY;
+    if (proxy != last) {
+      u32 from = sap->moved_from[last];
+      sap->moved_to[from] = proxy;
+      sap->moved_from[proxy] = from;
+    }
+    sap->proxies_count--;
+    sap->removed_proxies_count++;
+  }
+
+  // Drops the endpoints and pairs of the proxies removed since the last call and renames those
+  // of the moved proxies. Linear in the number of proxies and pairs, but only after a removal.
+  void SapCompact(SweepAndPrune *sap) {
+    if (sap->removed_proxies_count == 0) {
+      return;
+    }
+
+    u32 *moved_to = sap->moved_to;
+    u32 compacted_count = sap->proxies_count + sap->removed_proxies_count;
+    for (u32 axis = 0; axis < 2; axis++) {
+      SapEndpoint *endpoints = sap->endpoints[axis];
+      u32 kept = 0;
+      for (u32 i = 0; i < 2 * compacted_count; i++) {
+        u32 proxy = moved_to[endpoints[i].data >> 1];
+        if (proxy == SAP_REMOVED_PROXY) {
+          continue;
+        }
+        endpoints[kept].value = endpoints[i].value;
+        endpoints[kept].data = (proxy << 1) | (endpoints[i].data & 1);
+        kept++;
+      }
+      Assert(kept == 2 * sap->proxies_count);
+    }
+
+    PairBuffer *pairs = &sap->pairs;
+    u32 kept = 0;
+    for (u32 i = 0; i < pairs->pairs_count; i++) {
+      u32 a = moved_to[pairs->pairs[i].a];
+      u32 b = moved_to[pairs->pairs[i].b];
+      if (a == SAP_REMOVED_PROXY || b == SAP_REMOVED_PROXY) {
+        continue;
+      }
+      pairs->pairs[kept].a = Min(a, b);
+      pairs->pairs[kept].b = Max(a, b);
+      kept++;
+    }
+    pairs->pairs_count = kept;
+    SapRehash(sap, sap->pair_slots_mask + 1);
+
+    for (u32 i = 0; i < compacted_count; i++) {
+      moved_to[i] = i;
+      sap->moved_from[i] = i;
+    }
+    sap->removed_proxies_count = 0;
+  }
+
+  void SapUpdate(SweepAndPrune *sap, BroadPhaseProxy *proxies, u32 proxies_count) {
+    sap->added_count = 0;
+    sap->removed_count = 0;
+    SapCompact(sap);
+
+    if (proxies_count > sap->proxies_capacity) {
+      u32 capacity = Max(sap->proxies_capacity * 2, proxies_count);
+      for (u32 axis = 0; axis < 2; axis++) {
+        SapEndpoint *endpoints
+            = (SapEndpoint *)MemoryArenaPush(sap->arena, sizeof(SapEndpoint) * 2 * capacity);
+        if (sap->proxies_count > 0) {
+          MemoryCopy(endpoints, sap->endpoints[axis],
+                     sizeof(SapEndpoint) * 2 * sap->proxies_count);
+        }
+        sap->endpoints[axis] = endpoints;
+      }
+      sap->active = (u32 *)MemoryArenaPush(sap->arena, sizeof(u32) * capacity);
+      sap->moved_to = (u32 *)MemoryArenaPush(sap->arena, sizeof(u32) * capacity);
+      sap->moved_from = (u32 *)MemoryArenaPush(sap->arena, sizeof(u32) * capacity);
+      for (u32 i = 0; i < capacity; i++) {
+        sap->moved_to[i] = i;
+        sap->moved_from[i] = i;
+      }
+      sap->proxies_capacity = capacity;
+    }
+
+    for (u32 axis = 0; axis < 2; axis++) {
+      SapEndpoint *endpoints = sap->endpoints[axis];
+      for (u32 i = 0; i < 2 * sap->proxies_count; i++) {
+        endpoints[i].value = SapEndpointValue(proxies, axis, endpoints[i].data);
+      }
+
+      // New proxies are appended and sorted into place like everything else
+      for (u32 i = sap->proxies_count; i < proxies_count; i++) {
+        SapEndpoint *e = endpoints + 2 * i;
+        e[0].data = i << 1;
+        e[0].value = SapEndpointValue(proxies, axis, e[0].data);
+        e[1].data = (i << 1) | 1;
+        e[1].value = SapEndpointValue(proxies, axis, e[1].data);
+      }
+    }
+
+    u32 new_count = proxies_count - sap->proxies_count;
+    sap->proxies_count = proxies_count;
+
+    // NOTE: insertion sort is quadratic for a large batch of new proxies (e.g. loading a
+    // scene), sort those from scratch instead.
+    if (new_count > SAP_REBUILD_THRESHOLD) {
+      SapRebuild(sap, proxies);
+      return;
+    }
+
+    SapInsertionSort(sap, proxies, 0);
+    SapInsertionSort(sap, proxies, 1);
+  }
+};  // namespace physics
@@ -0,0 +1,139 @@
+#pragma once
+#define GRID_MAX_CELLS_PER_BODY 16
+#define TREE_NULL_NODE 0xffffffff
+#define TREE_AABB_MARGIN 0.1f
+#define TREE_STACK_SIZE 256
+#define SAP_REBUILD_THRESHOLD 64
+#define SAP_REMOVED_PROXY 0xffffffff
+
+#include "language_layer.h"
+#include "memory.h"
+
+namespace physics {
+
+  enum BroadPhaseType { BROAD_PHASE_GRID, BROAD_PHASE_TREE, BROAD_PHASE_SAP };
+
+  struct AABB {
+    v2 min;
+    v2 max;
+  };
+
+  struct BroadPhaseProxy {
+    AABB aabb;
+    b32 is_static;
+  };
+
+  struct BroadPhasePair {
+    u32 a;  // a < b
+    u32 b;
+  };
+
+  struct PairBuffer {
+    MemoryArena *arena;
+    BroadPhasePair *pairs;
+    u32 pairs_count;
+    u32 pairs_capacity;
+  };
+
+  struct GridEntry {
+    i32 cell_x;
+    i32 cell_y;
+    u32 proxy;
+  };
+
+  // Spatial hash over a uniform grid, rebuilt from scratch every step.
+  //
+  // Every proxy is inserted into each cell its AABB touches. The cells are hashed into a power
+  // of two number of buckets and the entries are counting sorted by bucket, so that only
+  // proxies sharing a cell are tested against each other. Proxies that would touch more than
+  // GRID_MAX_CELLS_PER_BODY cells (e.g. the ground slab) are kept in a separate list and
+  // tested against everything instead.
+  struct Grid {
+    MemoryArena *arena;
+    f32 cell_size;
+
+    GridEntry *entries;
+    GridEntry *sorted_entries;
+    u32 entries_count;
+    u32 entries_capacity;
+    u32 sorted_entries_capacity;
+
+    u32 *bucket_start;  // buckets_count + 1
+    u32 *bucket_cursor;
+    u32 buckets_count;  // power of two
+    u32 buckets_capacity;
+
+    u32 *large_proxies;
+    u32 large_proxies_count;
+    b8 *is_large;
+    u32 proxies_capacity;
+  };
+
+  struct TreeNode {
+    AABB aabb;  // enlarged ("fat") for leaves
+
+    union {
+      u32 parent;
+      u32 next;  // free list
+    };
+    u32 child1;
+    u32 child2;
+
+    i32 height;  // leaf = 0, free node = -1
+    u32 proxy;
+  };
+
+  // Dynamic bounding volume tree, persistent across steps.
+  //
+  // Leaves store fat AABBs that are enlarged by TREE_AABB_MARGIN, so a proxy only has to be
+  // reinserted once its tight AABB leaves the fat one. Inner nodes are kept balanced with tree
+  // rotations on insert and remove.
+  struct DynamicTree {
+    MemoryArena *arena;
+
+    TreeNode *nodes;
+    u32 nodes_capacity;
+    u32 root;
+    u32 free_list;
+
+    u32 *leaves;  // proxy -> leaf node
+    u32 proxies_count;
+    u32 proxies_capacity;
+
+    u32 reinsert_count;  // proxies reinserted in the last TreeSync
+  };
+
+  struct SapEndpoint {
+    f32 value;
+    u32 data;  // proxy << 1 | is_max
+  };
+
+  // Sweep and prune over persistent sorted endpoint arrays, one per axis.
+  //
+  // The arrays are re-sorted with insertion sort every update, which is close to linear when
+  // bodies barely move. Every time a min endpoint passes a max endpoint (or vice versa) the
+  // pair is tested and added to or removed from the set of overlapping pairs, so pairs are
+  // never rediscovered from scratch.
+  struct SweepAndPrune {
+    MemoryArena *arena;
+
+    SapEndpoint *endpoints[2];
+    u32 *active;  // scratch for SapRebuild
+    u32 proxies_count;
+    u32 proxies_capacity;
+
+    // Removal only renames proxies here, the endpoints and pairs catch up in SapCompact.
+    // Proxy index at the last compaction -> current index (or SAP_REMOVED_PROXY) and back.
+    u32 *moved_to;
+    u32 *moved_from;
+    u32 removed_proxies_count;  // since the last compaction
+
+    // Overlapping pairs, dense list + open addressing index keyed on the pair
+    PairBuffer pairs;
+    u32 *pair_slots;  // pair index + 1, 0 = empty
+    u32 pair_slots_mask;
+
+    u32 added_count;  // pair events in the last SapUpdate
+    u32 removed_count;
+  };
+};  // namespace physics
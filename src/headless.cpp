@@ -0,0 +1,332 @@
+// Headless simulation driver, builds without raylib or a display:
+//
+//   ./build.sh headless
+//   build/c_physics_headless <scene> [-steps N] [-dt seconds] [-iterations N] [-tolerance m/s]
+//                            [-broadphase grid|tree|sap] [-threads N] [-deterministic 0|1]
+//                            [-hash_interval N] [-expect hash] [-write_scene path]
+//                            [-profile path] [-solver iterations|substep] [-substeps N]
+//                            [-split_impulses 0|1] [-position_iterations N]
+//
+// Loads a scene, runs it as fast as possible and reports steps/sec. The solver results only
+// depend on the scene and options, not on -threads.
+//
+// With -deterministic 1 the world runs in deterministic mode and reports the hash chain of the
+// body state over all steps, -hash_interval also prints it every N steps to find where two
+// runs part ways. -expect checks the final hash and fails the run if it differs, which makes a
+// replay regression check:
+//
+//   build/c_physics_headless scenes/pyramid.txt -steps 10000 -deterministic 1 -expect <hash>
+//
+// -solver substep switches the solver to SOLVER_SUBSTEP with -substeps substeps per step,
+// the "solver" line then reports substeps instead of iterations. -split_impulses 1 recovers
+// penetration in a separate pass of at most -position_iterations iterations.
+//
+// Scene files are plain text, one directive per line, '#' starts a comment:
+//
+//   gravity <x> <y>
+//   iterations <n>
+//   broadphase grid|tree|sap
+//   box <x> <y> <width> <height> <mass|static> [rotation] [friction]
+//   pyramid <x> <y> <base count> <box size>
+//
+// -write_scene converts the loaded scene to a binary scene file (see physics_scene.cpp), which
+// loads with an mmap instead of parsing and AddBody calls. The runner takes either kind:
+//
+//   build/c_physics_headless scenes/pyramid.txt -steps 0 -write_scene build/pyramid.scene
+//   build/c_physics_headless build/pyramid.scene -steps 1000
+//
+// -profile turns on the step profiler, prints the average and worst time of every phase over
+// the last PROFILE_HISTORY steps and writes them as a Chrome trace (chrome://tracing, Perfetto).
+//
+#ifndef PHYSICS_HEADLESS
+#  define PHYSICS_HEADLESS
+#endif
+
+#include "language_layer.h"
+#include "memory.h"
+#include "physics.h"
+
+// UNITY BUILD
+#include "language_layer.cpp"
+#include "memory.cpp"
+#include "thread_pool.cpp"
+#include "broad_phase.cpp"
+#include "physics_profile.cpp"
+#include "physics.cpp"
+#include "physics_snapshot.cpp"
+#include "physics_scene.cpp"
+
+internal f64 SecondsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+}
+
+internal b32 ParseBroadPhase(const char *name, physics::BroadPhaseType *type) {
+  if (strcmp(name, "grid") == 0) {
+    *type = physics::BROAD_PHASE_GRID;
+  } else if (strcmp(name, "tree") == 0) {
+    *type = physics::BROAD_PHASE_TREE;
+  } else if (strcmp(name, "sap") == 0) {
+    *type = physics::BROAD_PHASE_SAP;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+internal b32 ParseSolverType(const char *name, physics::SolverType *type) {
+  if (strcmp(name, "iterations") == 0) {
+    *type = physics::SOLVER_ITERATIONS;
+  } else if (strcmp(name, "substep") == 0) {
+    *type = physics::SOLVER_SUBSTEP;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+internal b32 LoadScene(physics::World *world, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    LogError("Could not open scene %s", path);
+    return false;
+  }
+  Defer(fclose(file));
+
+  char line[512];
+  u32 line_number = 0;
+  while (fgets(line, sizeof(line), file)) {
+    line_number++;
+
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = 0;
+    }
+
+    char directive[32];
+    if (sscanf(line, "%31s", directive) != 1) {
+      continue;
+    }
+
+    char *args = strstr(line, directive) + strlen(directive);
+    b32 ok = false;
+
+    if (strcmp(directive, "gravity") == 0) {
+      ok = sscanf(args, "%f %f", &world->gravity.x, &world->gravity.y) == 2;
+    } else if (strcmp(directive, "iterations") == 0) {
+      u32 iterations;
+      ok = sscanf(args, "%u", &iterations) == 1;
+      world->iterations = iterations;
+    } else if (strcmp(directive, "broadphase") == 0) {
+      char name[16];
+      physics::BroadPhaseType type;
+      ok = sscanf(args, "%15s", name) == 1 && ParseBroadPhase(name, &type);
+      if (ok) {
+        physics::SetBroadPhase(world, type);
+      }
+    } else if (strcmp(directive, "box") == 0) {
+      v2 position, width;
+      char mass_string[32];
+      f32 rotation = 0.0f;
+      f32 friction = 0.2f;
+      i32 count = sscanf(args, "%f %f %f %f %31s %f %f", &position.x, &position.y, &width.x,
+                         &width.y, mass_string, &rotation, &friction);
+      ok = count >= 5;
+      if (ok) {
+        f32 mass = strcmp(mass_string, "static") == 0 ? F32_Max : CStringToF32(mass_string);
+        physics::BodyHandle body = physics::AddBody(world, position, width, mass);
+        physics::BodyRotation(world, body) = rotation;
+        physics::GetBodyProperties(world, body)->friction = friction;
+      }
+    } else if (strcmp(directive, "pyramid") == 0) {
+      v2 base;
+      u32 count;
+      f32 size;
+      ok = sscanf(args, "%f %f %u %f", &base.x, &base.y, &count, &size) == 4;
+      for (u32 row = 0; ok && row < count; row++) {
+        u32 row_count = count - row;
+        f32 x = base.x - (row_count - 1) * size * 0.5f;
+        f32 y = base.y + size * 0.5f + row * size;
+        for (u32 i = 0; i < row_count; i++) {
+          physics::AddBody(world, {x + i * size, y}, {size, size}, 1.0f);
+        }
+      }
+    }
+
+    if (!ok) {
+      LogError("%s:%u: could not parse '%s'", path, line_number, directive);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    Log("usage: %s <scene> [-steps N] [-dt seconds] [-iterations N] [-tolerance m/s] "
+        "[-broadphase grid|tree|sap] [-threads N] [-deterministic 0|1] [-hash_interval N] "
+        "[-expect hash] [-write_scene path] [-profile path] [-solver iterations|substep] "
+        "[-substeps N] [-split_impulses 0|1] [-position_iterations N]\n",
+        argv[0]);
+    return 1;
+  }
+
+  MemoryArena arena = MemoryArenaInitialize();
+  MemoryArena scratch_arena = MemoryArenaInitialize();
+  Defer(MemoryArenaRelease(&arena));
+  Defer(MemoryArenaRelease(&scratch_arena));
+
+  physics::World world;
+  physics::InitWorld(&world, &arena, &scratch_arena, {0.0f, -10.0f}, 1024);
+
+  const char *scene_path = argv[1];
+  physics::SceneMapping scene_mapping = {};
+  Defer(physics::UnmapSceneFile(&scene_mapping));
+  f64 load_start = SecondsNow();
+  if (physics::IsSceneFile(scene_path)) {
+    if (!physics::LoadSceneFile(&world, scene_path, &scene_mapping)) {
+      return 1;
+    }
+  } else if (!LoadScene(&world, scene_path)) {
+    return 1;
+  }
+  f64 load_elapsed = SecondsNow() - load_start;
+
+  u32 steps = 1000;
+  u32 threads = 1;
+  u32 hash_interval = 0;
+  const char *expected_hash = 0;
+  const char *write_scene_path = 0;
+  const char *profile_path = 0;
+  f32 dt = world.fixed_dt;
+  for (i32 i = 2; i + 1 < argc; i += 2) {
+    const char *option = argv[i];
+    const char *value = argv[i + 1];
+    physics::BroadPhaseType type;
+    physics::SolverType solver_type;
+    if (strcmp(option, "-steps") == 0) {
+      steps = (u32)CStringToI32(value);
+    } else if (strcmp(option, "-dt") == 0) {
+      dt = CStringToF32(value);
+    } else if (strcmp(option, "-iterations") == 0) {
+      world.iterations = (usize)CStringToI32(value);
+    } else if (strcmp(option, "-tolerance") == 0) {
+      world.solver_tolerance = CStringToF32(value);
+    } else if (strcmp(option, "-solver") == 0 && ParseSolverType(value, &solver_type)) {
+      world.solver_type = solver_type;
+    } else if (strcmp(option, "-substeps") == 0) {
+      world.solver_substeps = (u32)Max(CStringToI32(value), 1);
+    } else if (strcmp(option, "-split_impulses") == 0) {
+      world.split_impulses = CStringToI32(value) != 0;
+    } else if (strcmp(option, "-position_iterations") == 0) {
+      world.position_iterations = (usize)CStringToI32(value);
+    } else if (strcmp(option, "-broadphase") == 0 && ParseBroadPhase(value, &type)) {
+      physics::SetBroadPhase(&world, type);
+    } else if (strcmp(option, "-threads") == 0) {
+      threads = (u32)Max(CStringToI32(value), 1);
+    } else if (strcmp(option, "-deterministic") == 0) {
+      world.deterministic = CStringToI32(value) != 0;
+    } else if (strcmp(option, "-hash_interval") == 0) {
+      hash_interval = (u32)CStringToI32(value);
+    } else if (strcmp(option, "-expect") == 0) {
+      expected_hash = value;
+    } else if (strcmp(option, "-write_scene") == 0) {
+      write_scene_path = value;
+    } else if (strcmp(option, "-profile") == 0) {
+      profile_path = value;
+    } else {
+      LogError("Unknown option %s %s", option, value);
+      return 1;
+    }
+  }
+
+  if (write_scene_path && !physics::WriteSceneFile(&world, write_scene_path)) {
+    return 1;
+  }
+
+  ThreadPool pool;
+  ThreadPoolInit(&pool, threads, Megabytes(16));
+  Defer(ThreadPoolShutdown(&pool));
+  world.thread_pool = &pool;
+  world.fixed_dt = dt;
+  world.profiler.enabled = profile_path != 0;
+
+  u64 iterations_total = 0;
+  u64 position_iterations_total = 0;
+  f64 start = SecondsNow();
+  for (u32 i = 0; i < steps; i++) {
+    physics::Step(&world, dt);
+    iterations_total += world.solver_iterations;
+    position_iterations_total += world.solver_position_iterations;
+    if (world.deterministic && hash_interval > 0 && (i + 1) % hash_interval == 0) {
+      Log("hash:     %016llx after %u steps\n", (unsigned long long)world.state_hash, i + 1);
+    }
+  }
+  f64 elapsed = SecondsNow() - start;
+
+  Log("scene:    %s, %u bodies, loaded in %.3f ms\n", scene_path, world.bodies.count,
+      load_elapsed * 1000.0);
+  Log("steps:    %u in %.3f s, dt %g s\n", steps, elapsed, dt);
+  if (steps > 0) {
+    Log("speed:    %.1f steps/sec, %.3f ms/step\n", steps / elapsed, elapsed * 1000.0 / steps);
+  }
+  Log("arbiters: %u in %u colors\n", world.arbiter_table.arbiters_count, world.colors_count);
+  if (world.solver_type == physics::SOLVER_SUBSTEP) {
+    Log("solver:   %u substeps per step\n", world.solver_substeps);
+  } else {
+    Log("solver:   %.2f iterations per step on average, at most %zu\n",
+        steps > 0 ? (f64)iterations_total / steps : 0.0, world.iterations);
+    if (world.split_impulses) {
+      Log("          %.2f position iterations per step on average, at most %zu\n",
+          steps > 0 ? (f64)position_iterations_total / steps : 0.0, world.position_iterations);
+    }
+  }
+  u32 sleeping_count = 0;
+  for (u32 i = 0; i < world.bodies.count; i++) {
+    sleeping_count += world.bodies.is_sleeping[i] ? 1 : 0;
+  }
+  Log("islands:  %u, %u bodies sleeping\n", world.islands_count, sleeping_count);
+  Log("threads:  %u\n", pool.threads_count);
+  Log("memory:   %.1f MB, %llu allocations in the last step\n",
+      (arena.alloc_position + scratch_arena.commit_position) / (f64)Megabytes(1),
+      (unsigned long long)world.allocation_count);
+
+  if (world.deterministic) {
+    Log("hash:     %016llx\n", (unsigned long long)world.state_hash);
+  }
+
+  if (profile_path) {
+    Log("profile:  last %u steps, average / max ms\n", (u32)Min((u64)steps, (u64)PROFILE_HISTORY));
+    for (u32 phase = 0; phase < physics::PROFILE_PHASES_COUNT; phase++) {
+      f64 average_ms, max_ms;
+      physics::ProfilePhaseStats(&world, (physics::ProfilePhase)phase, PROFILE_HISTORY,
+                                 &average_ms, &max_ms);
+      Log("  %-20s %8.3f %8.3f\n", physics::ProfilePhaseName((physics::ProfilePhase)phase),
+          average_ms, max_ms);
+    }
+    const physics::StepProfile *last = physics::ProfileGetStep(&world, 0);
+    if (last) {
+      Log("  pairs %u, contacts %u, arbiters %u, iterations %u in the last step\n",
+          last->pairs_tested, last->contacts_count, last->arbiters_count,
+          last->solver_iterations);
+    }
+    if (!physics::WriteProfileTrace(&world, profile_path)) {
+      return 1;
+    }
+  }
+  if (expected_hash) {
+    if (!world.deterministic) {
+      LogError("-expect needs -deterministic 1");
+      return 1;
+    }
+    if (strtoull(expected_hash, 0, 16) != world.state_hash) {
+      LogError("Hash mismatch, expected %s", expected_hash);
+      return 1;
+    }
+    Log("hash matches\n");
+  }
+
+  return 0;
+}
@@ -10,6 +10,7 @@
 //-----------------------------------------------
 #include <math.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,6 +48,7 @@
 #define Kilobytes(n) (n << 10)
 #define Megabytes(n) (n << 20)
 #define Gigabytes(n) (((u64)n) << 30)
+#define AlignUpPow2(x, p) (((x) + (p)-1) & ~((p)-1))
 #ifndef PI
 #  define PI (3.1415926535897f)
 #endif
@@ -145,11 +147,39 @@ namespace {
 #define Defer(code) auto GB_DEFER_3(_defer_) = gb__defer_func([&]() -> void { code; })
 }  // namespace
 
+// Raymath fallback
+//-----------------------------------------------
+#if !defined(RAYLIB_H) && !defined(RAYMATH_H)
+// NOTE: headless builds never include raylib, provide the parts of raymath that the
+// physics core uses instead.
+struct Vector2 {
+  float x;
+  float y;
+};
+
+inline float Clamp(float value, float min, float max) {
+  float result = (value < min) ? min : value;
+  if (result > max) result = max;
+  return result;
+}
+inline float Remap(float value, float input_start, float input_end, float output_start,
+                   float output_end) {
+  return (value - input_start) / (input_end - input_start) * (output_end - output_start)
+         + output_start;
+}
+inline Vector2 Vector2Zero(void) { return {0.0f, 0.0f}; }
+inline Vector2 Vector2Add(Vector2 a, Vector2 b) { return {a.x + b.x, a.y + b.y}; }
+inline Vector2 Vector2Subtract(Vector2 a, Vector2 b) { return {a.x - b.x, a.y - b.y}; }
+inline Vector2 Vector2Scale(Vector2 a, float s) { return {a.x * s, a.y * s}; }
+inline Vector2 Vector2Multiply(Vector2 a, Vector2 b) { return {a.x * b.x, a.y * b.y}; }
+inline float Vector2DotProduct(Vector2 a, Vector2 b) { return a.x * b.x + a.y * b.y; }
+inline float Vector2Length(Vector2 a) { return sqrtf(a.x * a.x + a.y * a.y); }
+#endif
+
 // Raylib cpp
 //-----------------------------------------------
-#ifdef RAYLIB_H
-#  define v2 Vector2
-#  define v3 Vector3
+#define v2 Vector2
+#define v3 Vector3
 
 inline v2 operator+(v2 a, v2 b) { return Vector2Add(a, b); }
 inline v2 operator-(v2 a, v2 b) { return Vector2Subtract(a, b); }
@@ -162,7 +192,6 @@ inline v2 Vector2Abs(v2 a) { return (v2){AbsoluteValue(a.x), AbsoluteValue(a.y)}
 inline f32 Vector2Cross(v2 a, v2 b) { return a.x * b.y - a.y * b.x; }
 inline v2 Vector2Cross(v2 a, f32 s) { return (v2){s * a.y, -s * a.x}; }
 inline v2 Vector2Cross(f32 s, v2 a) { return (v2){-s * a.y, s * a.x}; }
-#endif
 
 // Math
 //-----------------------------------------------
@@ -299,7 +328,7 @@ template <typename T, usize size> void HashTableClear(HashTable<T, size> *table)
 }
 
 template <typename T, usize size> isize HashTableAddEntry(HashTable<T, size> *table, u64 key) {
-  HashTableEntry<T> e = {0};
+  HashTableEntry<T> e = {};
   e.key = key;
   e.next = -1;
 
@@ -315,9 +344,9 @@ template <typename T, usize size> isize HashTableAddEntry(HashTable<T, size> *ta
 
 template <typename T, usize size>
 HashTableFindResult HashTableFind(HashTable<T, size> *table, u64 key) {
-  HashTableFindResult r = {-1, -1, -1};
+  // NOTE: the hash index is needed to insert into an empty table too
+  HashTableFindResult r = {(isize)(key & table->mask), -1, -1};
   if (table->entries_count > 0) {
-    r.hash_index = key & table->mask;
     r.entry_index = table->hashes[r.hash_index];
     while (r.entry_index >= 0) {
       if (table->entries[r.entry_index].key == key) {
@@ -359,37 +388,30 @@ template <typename T, usize size> void HashTableSet(HashTable<T, size> *table, u
   table->entries[index].value = value;
 }
 
-// Tagged Handle Resource pool
-//-----------------------------------------------
-// NOTE(anton): size must be a power of two -> binary modulo
-// template <typename T> struct ResourceHandle {
-//   u32 index;
-//   u32 generation;
-// };
-
-// template <typename T, usize size> struct ResourcePool {
-//   T slots[size];
-//   usize slots_count;
-
-//   u32 free_slots[size];
-//   usize free_slots_count;
-
-//   usize mask;  // used for binary modulo
-// };
-
-// template <typename T, usize size> void ResourcesPoolInit(ResourcePool<T, size> *r) {
-//   MemorySet((void *)r, 0, sizeof(ResourcePool<T, size>));
+template <typename T, usize size> void HashTableRemove(HashTable<T, size> *table, u64 key) {
+  HashTableFindResult r = HashTableFind(table, key);
+  if (r.entry_index < 0) {
+    return;
+  }
 
-//   r->mask = size - 1;
-//   Assert((size & r->mask) == 0);  // size must be a power of two!
+  // Unlink the entry from its chain
+  if (r.entry_prev >= 0) {
+    table->entries[r.entry_prev].next = table->entries[r.entry_index].next;
+  } else {
+    table->hashes[r.hash_index] = table->entries[r.entry_index].next;
+  }
 
-//   for (u32 i = 0; i < size; i++) {
-//     r->free_slots[i] = i;
-//   }
-// }
+  // Move the last entry into the hole to keep entries dense
+  isize last = table->entries_count - 1;
+  if (r.entry_index != last) {
+    HashTableFindResult moved = HashTableFind(table, table->entries[last].key);
+    if (moved.entry_prev >= 0) {
+      table->entries[moved.entry_prev].next = r.entry_index;
+    } else {
+      table->hashes[moved.hash_index] = r.entry_index;
+    }
+    table->entries[r.entry_index] = table->entries[last];
+  }
 
-// template <typename T, usize size>
-// T *ResourcePoolGet(ResourcePool<T, size> *r, ResourceHandle<T> handle) {
-//   Assert(handle.index < size);
-//   T *slot = r->slots[handle.index];
-// }
+  table->entries_count--;
+}
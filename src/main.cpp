@@ -25,21 +25,28 @@ global GameState* game;
 // UNITY BUILD
 #include "language_layer.cpp"
 #include "memory.cpp"
+#include "thread_pool.cpp"
 #include "renderer.cpp"
+#include "broad_phase.cpp"
+#include "physics_profile.cpp"
 #include "physics.cpp"
+#include "physics_snapshot.cpp"
+#include "physics_scene.cpp"
+#include "physics_draw.cpp"
 #include "player.cpp"
 
 void setup_physics_demo() {
   v2 mid = {GetScreenWidth() * PIXEL_2_METER * 0.5f, GetScreenHeight() * PIXEL_2_METER * 0.5f};
   physics::AddBody(&game->world, {mid.x, 0.0f}, {mid.x * 4.0f, 3.0f}, F32_Max);
-  physics::AddBody(&game->world, {0.f, 6.f}, {4.000000f, 0.250000f}, F32_Max)->rotation
-      = -0.261799f;
+  physics::BodyHandle h;
+  h = physics::AddBody(&game->world, {0.f, 6.f}, {4.000000f, 0.250000f}, F32_Max);
+  physics::BodyRotation(&game->world, h) = -0.261799f;
 
-  physics::AddBody(&game->world, {1.610000f, 2.620000f}, {4.000000f, 0.250000f}, F32_Max)->rotation
-      = PI / 8.f;
+  h = physics::AddBody(&game->world, {1.610000f, 2.620000f}, {4.000000f, 0.250000f}, F32_Max);
+  physics::BodyRotation(&game->world, h) = PI / 8.f;
 
-  physics::AddBody(&game->world, {6.460000f, 4.460000f}, {4.000000f, 0.250000f}, F32_Max)->rotation
-      = 0.261799f;
+  h = physics::AddBody(&game->world, {6.460000f, 4.460000f}, {4.000000f, 0.250000f}, F32_Max);
+  physics::BodyRotation(&game->world, h) = 0.261799f;
 }
 
 int main(int argc, char** argv) {
@@ -52,6 +59,7 @@ int main(int argc, char** argv) {
   Application application = {0};
   application.permanent_arena = MemoryArenaInitialize();
   application.frame_arena = MemoryArenaInitialize();
+  application.frame_arena.decommit_threshold = Megabytes(8);
   Defer(MemoryArenaRelease(&application.permanent_arena));
   Defer(MemoryArenaRelease(&application.frame_arena));
   app = &application;
@@ -59,7 +67,10 @@ int main(int argc, char** argv) {
   game = (GameState*)MemoryArenaPush(&app->permanent_arena, sizeof(GameState));
 
   game->renderer = RenderInit();
-  physics::InitWorld(&game->world, {0.0f, -10.0f});
+  physics::InitWorld(&game->world, &app->permanent_arena, &app->frame_arena, {0.0f, -10.0f},
+                     1024);
+  // NOTE: the ground slab is much larger than the boxes, which the grid handles poorly
+  physics::SetBroadPhase(&game->world, physics::BROAD_PHASE_TREE);
   v2 mid = {GetScreenWidth() * PIXEL_2_METER * 0.5f, GetScreenHeight() * PIXEL_2_METER * 0.5f};
 
   game->player = PlayerInit(&game->world);
@@ -68,6 +79,8 @@ int main(int argc, char** argv) {
   setup_physics_demo();
 
   while (!WindowShouldClose()) {
+    MemoryArenaClear(&app->frame_arena);
+
     // Update Game state
     //-----------------------------------------------
     game->world_cursor_position
@@ -76,17 +89,30 @@ int main(int argc, char** argv) {
     game->world_cursor_position.y += (GetScreenHeight() - GetMouseY()) * PIXEL_2_METER;
 
     if (IsMouseButtonPressed(0)) {
-      physics::Body* b = physics::AddBody(
+      physics::BodyHandle h = physics::AddBody(
           &game->world, game->world_cursor_position,
           {2.0f * (GetRandomValue(1, 100) / 100.0f), 1.0f * (GetRandomValue(10, 100) / 100.0f)},
           25.0f);
-      b->rotation = (GetRandomValue(0, 100) / 100.0f) * 2.0f * PI;
+      physics::BodyRotation(&game->world, h) = (GetRandomValue(0, 100) / 100.0f) * 2.0f * PI;
+    }
+
+    if (IsMouseButtonPressed(1)) {
+      physics::AABB region = {game->world_cursor_position, game->world_cursor_position};
+      physics::BodyHandle hits[8];
+      u32 hits_count = physics::QueryRegion(&game->world, region, hits, ArrayCount(hits));
+      for (u32 i = 0; i < hits_count; i++) {
+        b32 is_player = hits[i].index == game->player.body.index;
+        if (!is_player && physics::GetBodyProperties(&game->world, hits[i])->mass < F32_Max) {
+          physics::RemoveBody(&game->world, hits[i]);
+          break;
+        }
+      }
     }
 
     // Camera Update
     {
-      v2 camera_target = game->player.body->position;
-      camera_target += game->player.body->velocity * 0.18f;
+      v2 camera_target = physics::BodyInterpolatedPosition(&game->world, game->player.body);
+      camera_target += physics::BodyVelocity(&game->world, game->player.body) * 0.18f;
 
       game->renderer.world_camera.target
           = Vector2Lerp(game->renderer.world_camera.target, camera_target, 10.0f * GetFrameTime());
@@ -100,8 +126,8 @@ int main(int argc, char** argv) {
       game->renderer.world_camera.zoom += 0.18f * GetMouseWheelMove();
     }
 
-    PlayerUpdate(&game->player);
-    physics::Step(&game->world);
+    PlayerUpdate(&game->player, &game->world);
+    physics::Advance(&game->world, GetFrameTime());
 
     BeginDrawing();
     {
@@ -111,9 +137,9 @@ int main(int argc, char** argv) {
       //-----------------------------------------------
       RenderBegin(&game->renderer);
       {
-        PlayerDraw(&game->player);
+        PlayerDraw(&game->player, &game->world);
 
-        physics::Draw(&game->world);
+        physics::Draw(&game->world, &game->renderer);
       }
       RenderEnd(&game->renderer);
 
@@ -124,7 +150,8 @@ int main(int argc, char** argv) {
       DrawText("- WASD to move", 40, 40, 10, DARKGRAY);
       DrawText("- Space to jump", 40, 60, 10, DARKGRAY);
       DrawText("- Left click to spawn rigidbodies", 40, 80, 10, DARKGRAY);
-      DrawText("- Mouse Wheel to Zoom in-out, R to reset zoom", 40, 100, 10, DARKGRAY);
+      DrawText("- Right click to remove a rigidbody", 40, 100, 10, DARKGRAY);
+      DrawText("- Mouse Wheel to Zoom in-out, R to reset zoom", 40, 120, 10, DARKGRAY);
     }
     EndDrawing();
   }
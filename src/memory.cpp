@@ -1,28 +1,79 @@
 #include "memory.h"
 
+#include <sys/mman.h>
+
+// NOTE: reserving is an mmap without access rights, which takes address space but no
+// memory or swap. Committing makes pages accessible, they take memory once first touched.
+internal void *OSReserve(u64 size) {
+  void *memory = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return memory == MAP_FAILED ? 0 : memory;
+}
+
+internal b32 OSCommit(void *memory, u64 size) {
+  return mprotect(memory, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+// Hands the pages back, they read as zero when committed again
+internal void OSDecommit(void *memory, u64 size) {
+  madvise(memory, size, MADV_DONTNEED);
+  mprotect(memory, size, PROT_NONE);
+}
+
+internal void OSRelease(void *memory, u64 size) { munmap(memory, size); }
+
 internal MemoryArena MemoryArenaInitialize(void) {
-  MemoryArena arena = {0};
+  MemoryArena arena = {};
   arena.max = M_ARENA_MAX;
-  arena.base = malloc(arena.max);  // TODO(anton): anyway to reserve memory without committing?
-  arena.alloc_position = 0;
-  arena.commit_position = 0;
+  arena.base = OSReserve(arena.max);
+  Assert(arena.base);
   return arena;
 }
 
+// Returns size bytes aligned to M_ARENA_ALIGNMENT, so that arrays of small types like b8 do
+// not misalign everything pushed after them
 internal void *MemoryArenaPush(MemoryArena *arena, u64 size) {
   void *memory = 0;
-  if (arena->alloc_position + size > arena->commit_position) {
-    u64 commit_size = size;
-    commit_size += M_ARENA_COMMIT_SIZE - 1;
-    commit_size -= commit_size % M_ARENA_COMMIT_SIZE;
-    // os->Commit((u8 *)arena->base + arena->commit_position, commit_size);
-    arena->commit_position += commit_size;
+  u64 position = AlignUpPow2(arena->alloc_position, (u64)M_ARENA_ALIGNMENT);
+  Assert(position + size <= arena->max);
+  if (position + size > arena->commit_position) {
+    // NOTE: commit at least as much as is committed already, up to a limit, so that a
+    // growing arena takes a logarithmic number of commits.
+    u64 commit_end = position + size;
+    commit_end = Max(commit_end, arena->commit_position + Min(arena->commit_position,
+                                                              (u64)M_ARENA_COMMIT_MAX));
+    commit_end = AlignUpPow2(commit_end, (u64)M_ARENA_COMMIT_SIZE);
+    commit_end = Min(commit_end, arena->max);
+    b32 committed = OSCommit((u8 *)arena->base + arena->commit_position,
+                             commit_end - arena->commit_position);
+    Assert(committed);
+    arena->commit_position = commit_end;
+    arena->commit_count++;
   }
-  memory = (u8 *)arena->base + arena->alloc_position;
-  arena->alloc_position += size;
+  arena->push_count++;
+  memory = (u8 *)arena->base + position;
+  arena->alloc_position = position + size;
   return memory;
 }
 
+// Makes room for at least required elements in an arena backed array, keeping the first used
+// ones. The old block is left behind in the arena, growth is geometric so this wastes at most
+// as much as is in use.
+template <typename T>
+internal void MemoryArenaReserveArray(MemoryArena *arena, T **array, u32 *capacity, u32 used,
+                                      u32 required) {
+  if (required <= *capacity) {
+    return;
+  }
+
+  u32 new_capacity = Max(*capacity * 2, required);
+  T *new_array = (T *)MemoryArenaPush(arena, sizeof(T) * new_capacity);
+  if (used > 0) {
+    MemoryCopy(new_array, *array, sizeof(T) * used);
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+}
+
 internal void *MemoryArenaPushZero(MemoryArena *arena, u64 size) {
   void *memory = MemoryArenaPush(arena, size);
   MemorySet(memory, 0, size);
@@ -36,6 +87,26 @@ internal void MemoryArenaPop(MemoryArena *arena, u64 size) {
   arena->alloc_position -= size;
 }
 
-internal void MemoryArenaClear(MemoryArena *arena) { MemoryArenaPop(arena, arena->alloc_position); }
+internal MemoryArenaTemp MemoryArenaTempBegin(MemoryArena *arena) {
+  return {arena, arena->alloc_position};
+}
+
+internal void MemoryArenaTempEnd(MemoryArenaTemp temp) {
+  Assert(temp.arena->alloc_position >= temp.position);
+  temp.arena->alloc_position = temp.position;
+}
+
+internal void MemoryArenaClear(MemoryArena *arena) {
+  MemoryArenaPop(arena, arena->alloc_position);
 
-internal void MemoryArenaRelease(MemoryArena *arena) { free(arena->base); }
+  u64 keep = AlignUpPow2(arena->decommit_threshold, (u64)M_ARENA_COMMIT_SIZE);
+  if (arena->decommit_threshold > 0 && arena->commit_position > keep) {
+    OSDecommit((u8 *)arena->base + keep, arena->commit_position - keep);
+    arena->commit_position = keep;
+  }
+}
+
+internal void MemoryArenaRelease(MemoryArena *arena) {
+  OSRelease(arena->base, arena->max);
+  *arena = {};
+}
@@ -3,11 +3,31 @@
 #include "language_layer.h"
 
 #define M_ARENA_MAX Gigabytes(4)
-#define M_ARENA_COMMIT_SIZE Kilobytes(4)
+#define M_ARENA_COMMIT_SIZE Kilobytes(64)  // smallest commit, commits grow with the arena
+#define M_ARENA_COMMIT_MAX Megabytes(64)  // largest commit
+#define M_ARENA_ALIGNMENT 16  // of every push, enough for any type and for SSE loads
 
+// Linear allocator over a reserved range of address space. Pages are committed as the arena
+// grows and can be handed back to the OS when it is cleared, see decommit_threshold.
 struct MemoryArena {
   void *base;
   u64 max;
   u64 alloc_position;
   u64 commit_position;
+  // MemoryArenaClear decommits everything above this many bytes, 0 = keep everything
+  // committed. A frame arena that spikes now and then stays small this way.
+  u64 decommit_threshold;
+
+  // Debug counters, see World::allocation_count
+  u64 push_count;
+  u64 commit_count;
+};
+
+// Allocation position of an arena to return to, everything pushed in between is freed:
+//
+//   MemoryArenaTemp temp = MemoryArenaTempBegin(scratch);
+//   Defer(MemoryArenaTempEnd(temp));
+struct MemoryArenaTemp {
+  MemoryArena *arena;
+  u64 position;
 };
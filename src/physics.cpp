@@ -1,38 +1,521 @@
 #include "physics.h"
 
+#ifndef PHYSICS_HEADLESS
 #include <raylib.h>
 #include <raymath.h>
+#endif
 
 #include "language_layer.h"
 
 namespace physics {
-  void InitWorld(World *world, Vector2 gravity) {
+  inline u64 ArbiterKeyFromIndices(u32 i1, u32 i2) { return ((u64)i1 << 32) | i2; }
+
+  // Fibonacci hashing, the high bits of the product are well mixed
+  inline u32 ArbiterSlotHome(ArbiterTable *table, u64 key) {
+    return (u32)((key * 0x9E3779B97F4A7C15ull) >> table->slots_shift);
+  }
+
+  inline u32 ArbiterSlotsShift(u32 slots_count) {
+    u32 shift = 64;
+    while (slots_count > 1) {
+      shift--;
+      slots_count >>= 1;
+    }
+    return shift;
+  }
+
+  // Empties the index and resizes it to slots_count, the memory is reused when it is large
+  // enough
+  internal void ArbiterTableAllocateSlots(ArbiterTable *table, u32 slots_count) {
+    Assert((slots_count & (slots_count - 1)) == 0);  // must be a power of two!
+
+    if (slots_count > table->slots_capacity) {
+      table->slots
+          = (ArbiterSlot *)MemoryArenaPush(table->arena, sizeof(ArbiterSlot) * slots_count);
+      table->slots_capacity = slots_count;
+    }
+    MemorySet(table->slots, 0, sizeof(ArbiterSlot) * slots_count);
+    table->slots_mask = slots_count - 1;
+    table->slots_shift = ArbiterSlotsShift(slots_count);
+  }
+
+  void ArbiterTableInit(ArbiterTable *table, MemoryArena *arena, u32 capacity) {
+    Assert(capacity > 0);
+
+    *table = {};
+    table->arena = arena;
+    MemoryArenaReserveArray(arena, &table->arbiters, &table->arbiters_capacity, 0, capacity);
+
+    // Keep the load factor at or below one half
+    u32 slots_count = 1;
+    while (slots_count < 2 * capacity) {
+      slots_count <<= 1;
+    }
+    ArbiterTableAllocateSlots(table, slots_count);
+  }
+
+  // Makes room for the arbiter lists of capacity bodies, new bodies start with an empty list
+  void ArbiterTableReserveBodies(ArbiterTable *table, u32 capacity) {
+    u32 used = table->bodies_capacity;
+    MemoryArenaReserveArray(table->arena, &table->body_arbiters, &table->bodies_capacity, used,
+                            capacity);
+    if (table->bodies_capacity > used) {
+      MemorySet(table->body_arbiters + used, 0, sizeof(u32) * (table->bodies_capacity - used));
+    }
+  }
+
+  // Which end of the arbiter the body is, 0 for i1 and 1 for i2
+  inline u32 ArbiterEnd(Arbiter *a, u32 body) { return a->i1 == body ? 0 : 1; }
+
+  // Points the neighbours of an arbiter in both of its body lists (or the list heads) at its
+  // index, after it was linked in or moved.
+  internal void ArbiterTableRelink(ArbiterTable *table, u32 index) {
+    Arbiter *a = table->arbiters + index;
+    for (u32 end = 0; end < 2; end++) {
+      u32 body = end == 0 ? a->i1 : a->i2;
+      if (a->prev[end] != 0) {
+        Arbiter *prev = table->arbiters + a->prev[end] - 1;
+        prev->next[ArbiterEnd(prev, body)] = index + 1;
+      } else {
+        table->body_arbiters[body] = index + 1;
+      }
+      if (a->next[end] != 0) {
+        Arbiter *next = table->arbiters + a->next[end] - 1;
+        next->prev[ArbiterEnd(next, body)] = index + 1;
+      }
+    }
+  }
+
+  internal void ArbiterTableUnlink(ArbiterTable *table, u32 index) {
+    Arbiter *a = table->arbiters + index;
+    for (u32 end = 0; end < 2; end++) {
+      u32 body = end == 0 ? a->i1 : a->i2;
+      if (a->prev[end] != 0) {
+        Arbiter *prev = table->arbiters + a->prev[end] - 1;
+        prev->next[ArbiterEnd(prev, body)] = a->next[end];
+      } else {
+        table->body_arbiters[body] = a->next[end];
+      }
+      if (a->next[end] != 0) {
+        Arbiter *next = table->arbiters + a->next[end] - 1;
+        next->prev[ArbiterEnd(next, body)] = a->prev[end];
+      }
+    }
+  }
+
+  // Returns the slot holding key, or the empty slot where it would be inserted
+  inline u32 ArbiterTableFindSlot(ArbiterTable *table, u64 key) {
+    u32 slot = ArbiterSlotHome(table, key);
+    while (table->slots[slot].index != 0 && table->slots[slot].key != key) {
+      slot = (slot + 1) & table->slots_mask;
+    }
+    return slot;
+  }
+
+  Arbiter *ArbiterTableGet(ArbiterTable *table, u64 key) {
+    ArbiterSlot *slot = table->slots + ArbiterTableFindSlot(table, key);
+    return slot->index ? table->arbiters + slot->index - 1 : nullptr;
+  }
+
+  internal void ArbiterTableGrow(ArbiterTable *table) {
+    MemoryArenaReserveArray(table->arena, &table->arbiters, &table->arbiters_capacity,
+                            table->arbiters_count, table->arbiters_count + 1);
+
+    ArbiterTableAllocateSlots(table, (table->slots_mask + 1) * 2);
+    for (u32 i = 0; i < table->arbiters_count; i++) {
+      u64 key = table->arbiters[i].key;
+      u32 slot = ArbiterTableFindSlot(table, key);
+      table->slots[slot].key = key;
+      table->slots[slot].index = i + 1;
+    }
+  }
+
+  // Inserts a new arbiter, key must not be present yet
+  Arbiter *ArbiterTableInsert(ArbiterTable *table, u64 key, const Arbiter &arbiter) {
+    if (table->arbiters_count == table->arbiters_capacity) {
+      ArbiterTableGrow(table);
+    }
+
+    u32 index = table->arbiters_count++;
+    Arbiter *a = table->arbiters + index;
+    *a = arbiter;
+    a->key = key;
+
+    // Push to the front of both body lists
+    a->next[0] = table->body_arbiters[a->i1];
+    a->next[1] = table->body_arbiters[a->i2];
+    a->prev[0] = 0;
+    a->prev[1] = 0;
+    ArbiterTableRelink(table, index);
+
+    u32 slot = ArbiterTableFindSlot(table, key);
+    Assert(table->slots[slot].index == 0);
+    table->slots[slot].key = key;
+    table->slots[slot].index = index + 1;
+
+    return a;
+  }
+
+  // Backward shift deletion keeps probe sequences intact without tombstones
+  internal void ArbiterTableRemoveSlot(ArbiterTable *table, u32 slot) {
+    u32 hole = slot;
+    u32 next = (hole + 1) & table->slots_mask;
+    while (table->slots[next].index != 0) {
+      u32 home = ArbiterSlotHome(table, table->slots[next].key);
+      // Move the entry into the hole if its home slot is not cyclically in (hole, next]
+      if (((next - home) & table->slots_mask) >= ((next - hole) & table->slots_mask)) {
+        table->slots[hole] = table->slots[next];
+        hole = next;
+      }
+      next = (next + 1) & table->slots_mask;
+    }
+    table->slots[hole] = {};
+  }
+
+  void ArbiterTableRemove(ArbiterTable *table, u64 key) {
+    u32 slot = ArbiterTableFindSlot(table, key);
+    u32 index = table->slots[slot].index;
+    if (index == 0) {
+      return;
+    }
+    index--;
+
+    ArbiterTableUnlink(table, index);
+    ArbiterTableRemoveSlot(table, slot);
+
+    // Swap remove from the dense array and patch the slot and links of the moved arbiter
+    u32 last = table->arbiters_count - 1;
+    if (index != last) {
+      table->arbiters[index] = table->arbiters[last];
+      table->slots[ArbiterTableFindSlot(table, table->arbiters[index].key)].index = index + 1;
+      ArbiterTableRelink(table, index);
+    }
+    table->arbiters_count--;
+  }
+
+  // Moves an arbiter to a new key in place, the key must not be present yet
+  internal void ArbiterTableRekey(ArbiterTable *table, Arbiter *a, u64 key) {
+    ArbiterTableRemoveSlot(table, ArbiterTableFindSlot(table, a->key));
+    a->key = key;
+
+    u32 slot = ArbiterTableFindSlot(table, key);
+    Assert(table->slots[slot].index == 0);
+    table->slots[slot].key = key;
+    table->slots[slot].index = (u32)(a - table->arbiters) + 1;
+  }
+
+  // Only touches the slots in use instead of the whole index
+  void ArbiterTableClear(ArbiterTable *table) {
+    for (u32 i = 0; i < table->arbiters_count; i++) {
+      // NOTE: slots emptied earlier in this loop may sit in the middle of a probe
+      // sequence, so skip over empty slots instead of stopping at them. The key is still in
+      // the table, so this terminates.
+      u64 key = table->arbiters[i].key;
+      u32 slot = ArbiterSlotHome(table, key);
+      while (table->slots[slot].index == 0 || table->slots[slot].key != key) {
+        slot = (slot + 1) & table->slots_mask;
+      }
+      table->slots[slot] = {};
+      table->body_arbiters[table->arbiters[i].i1] = 0;
+      table->body_arbiters[table->arbiters[i].i2] = 0;
+    }
+    table->arbiters_count = 0;
+  }
+
+  template <typename T>
+  internal void ReserveBodyArray(World *world, T **array, u32 capacity) {
+    u32 array_capacity = world->bodies.capacity;
+    MemoryArenaReserveArray(world->arena, array, &array_capacity, world->bodies.count, capacity);
+  }
+
+  // Makes room for at least count bodies and everything that is sized per body
+  internal void ReserveBodies(World *world, u32 count) {
+    Bodies *bodies = &world->bodies;
+    if (count <= bodies->capacity) {
+      return;
+    }
+
+    u32 capacity = Max(bodies->capacity * 2, count);
+    ReserveBodyArray(world, &bodies->position, capacity);
+    ReserveBodyArray(world, &bodies->rotation, capacity);
+    ReserveBodyArray(world, &bodies->velocity, capacity);
+    ReserveBodyArray(world, &bodies->angular_velocity, capacity);
+    ReserveBodyArray(world, &bodies->force, capacity);
+    ReserveBodyArray(world, &bodies->torque, capacity);
+    ReserveBodyArray(world, &bodies->inv_mass, capacity);
+    ReserveBodyArray(world, &bodies->inv_inertia, capacity);
+    ReserveBodyArray(world, &bodies->width, capacity);
+    ReserveBodyArray(world, &bodies->properties, capacity);
+    ReserveBodyArray(world, &bodies->sleep_time, capacity);
+    ReserveBodyArray(world, &bodies->is_sleeping, capacity);
+    ReserveBodyArray(world, &world->body_colors, capacity);
+    ReserveBodyArray(world, &world->island_parent, capacity);
+    ReserveBodyArray(world, &world->island_index, capacity);
+    ReserveBodyArray(world, &world->body_slot, capacity);
+    ArbiterTableReserveBodies(&world->arbiter_table, capacity);
+
+    u32 slots_capacity = bodies->capacity;
+    MemoryArenaReserveArray(world->arena, &world->body_slots, &slots_capacity,
+                            world->body_slots_count, capacity);
+
+    u32 proxies_capacity = bodies->capacity;
+    MemoryArenaReserveArray(world->arena, &world->proxies, &proxies_capacity,
+                            world->proxies_count, capacity);
+    u32 query_capacity = bodies->capacity;
+    MemoryArenaReserveArray(world->arena, &world->query_results, &query_capacity, 0, capacity);
+    u32 rotations_capacity = bodies->capacity;
+    MemoryArenaReserveArray(world->arena, &world->rotations, &rotations_capacity,
+                            world->proxies_count, capacity);
+
+    u32 previous_capacity = bodies->capacity;
+    MemoryArenaReserveArray(world->arena, &world->previous_positions, &previous_capacity,
+                            world->previous_count, capacity);
+    previous_capacity = bodies->capacity;
+    MemoryArenaReserveArray(world->arena, &world->previous_rotations, &previous_capacity,
+                            world->previous_count, capacity);
+
+    bodies->capacity = capacity;
+  }
+
+  // A per body array of Bodies, see GetBodyArrays
+  struct BodyArray {
+    void **data;
+    u32 element_size;
+  };
+
+  // Lists the per body arrays in a fixed order, which the snapshot and scene file layouts
+  // follow. New arrays go at the end.
+  internal void GetBodyArrays(Bodies *bodies, BodyArray arrays[BODY_ARRAYS_COUNT]) {
+    u32 i = 0;
+    arrays[i++] = {(void **)&bodies->position, sizeof(*bodies->position)};
+    arrays[i++] = {(void **)&bodies->rotation, sizeof(*bodies->rotation)};
+    arrays[i++] = {(void **)&bodies->velocity, sizeof(*bodies->velocity)};
+    arrays[i++] = {(void **)&bodies->angular_velocity, sizeof(*bodies->angular_velocity)};
+    arrays[i++] = {(void **)&bodies->force, sizeof(*bodies->force)};
+    arrays[i++] = {(void **)&bodies->torque, sizeof(*bodies->torque)};
+    arrays[i++] = {(void **)&bodies->inv_mass, sizeof(*bodies->inv_mass)};
+    arrays[i++] = {(void **)&bodies->inv_inertia, sizeof(*bodies->inv_inertia)};
+    arrays[i++] = {(void **)&bodies->width, sizeof(*bodies->width)};
+    arrays[i++] = {(void **)&bodies->properties, sizeof(*bodies->properties)};
+    arrays[i++] = {(void **)&bodies->sleep_time, sizeof(*bodies->sleep_time)};
+    arrays[i++] = {(void **)&bodies->is_sleeping, sizeof(*bodies->is_sleeping)};
+    Assert(i == BODY_ARRAYS_COUNT);
+  }
+
+  // The world keeps everything in arena. Scratch is only used during Step and left as it was
+  // found, so it can be shared with other short lived memory like a frame arena, but not with
+  // the world arena.
+  void InitWorld(World *world, MemoryArena *arena, MemoryArena *scratch, Vector2 gravity,
+                 u32 body_capacity) {
+    Assert(arena != scratch);
     *world = {};
+    world->arena = arena;
+    world->scratch = scratch;
     world->gravity = gravity;
     world->iterations = 10;
-    HashTableInit(&world->arbiter_table);
+    world->solver_tolerance = 1e-4f;
+    world->position_iterations = 4;
+    world->solver_type = SOLVER_ITERATIONS;
+    world->solver_substeps = 4;
+    world->fixed_dt = 1.0f / 60.0f;
+    world->max_substeps = 4;
+    world->interpolation_alpha = 1.0f;
+    world->time_to_sleep = 0.5f;
+    world->sleep_linear_tolerance = 0.05f;
+    world->sleep_angular_tolerance = 0.05f;
+    world->free_body_slot = BODY_SLOT_NONE;
+
+    // NOTE: reserve enough up front that Step does not have to allocate for a scene of
+    // body_capacity bodies in the common case.
+    body_capacity = Max(body_capacity, 16u);
+    ArbiterTableInit(&world->arbiter_table, arena, 2 * body_capacity);
+    ReserveBodies(world, body_capacity);
+    GridInit(&world->grid, arena, 2.0f);
+    world->broad_phase_type = BROAD_PHASE_GRID;
+  }
+
+  // False once the body of the handle was removed
+  inline b32 BodyIsValid(World *world, BodyHandle handle) {
+    return handle.index < world->body_slots_count
+           && world->body_slots[handle.index].generation == handle.generation;
+  }
+
+  // Position of the body in the body arrays, changes when other bodies are removed
+  inline u32 BodyIndex(World *world, BodyHandle handle) {
+    Assert(BodyIsValid(world, handle));
+    return world->body_slots[handle.index].index;
+  }
+
+  inline BodyHandle BodyHandleFromIndex(World *world, u32 index) {
+    u32 slot = world->body_slot[index];
+    return {slot, world->body_slots[slot].generation};
+  }
+
+  inline b32 BodyIsAwake(Bodies *bodies, u32 index) {
+    return bodies->inv_mass[index] > 0.0f && !bodies->is_sleeping[index];
+  }
+
+  // NOTE: sleeping bodies do not move either, so the grid and the tree skip pairs of
+  // them. SAP only does work for bodies that move, and ignoring the events of sleeping bodies
+  // would break its pair set when a snapshot restore moves them.
+  inline b32 ProxyIsStatic(World *world, u32 index) {
+    if (world->broad_phase_type == BROAD_PHASE_SAP) {
+      return world->bodies.inv_mass[index] == 0.0f;
+    }
+    return !BodyIsAwake(&world->bodies, index);
+  }
+
+  internal void WakeBody(World *world, u32 index) {
+    world->bodies.sleep_time[index] = 0.0f;
+    world->bodies.is_sleeping[index] = false;
+    if (index < world->proxies_count) {
+      world->proxies[index].is_static = ProxyIsStatic(world, index);
+    }
+  }
+
+  // Bodies wake up by themselves when touched or pushed by a force or torque, call this after
+  // changing the position or velocity of a body directly.
+  void WakeBody(World *world, BodyHandle handle) {
+    WakeBody(world, BodyIndex(world, handle));
+  }
+
+  // Empties the tree or SAP in use, the next SyncBroadPhase refills it. They keep their
+  // storage when switching away, so only the first use allocates.
+  internal void ClearBroadPhase(World *world) {
+    if (world->broad_phase_type == BROAD_PHASE_TREE) {
+      if (world->tree.arena) {
+        TreeClear(&world->tree);
+      } else {
+        TreeInit(&world->tree, world->arena, world->bodies.capacity);
+      }
+    } else if (world->broad_phase_type == BROAD_PHASE_SAP) {
+      if (world->sap.arena) {
+        SapClear(&world->sap);
+      } else {
+        SapInit(&world->sap, world->arena, world->bodies.capacity);
+      }
+    }
+  }
+
+  // Refits the broad phase structures that persist across steps to the proxies
+  internal void SyncBroadPhase(World *world) {
+    if (world->broad_phase_type == BROAD_PHASE_TREE) {
+      TreeSync(&world->tree, world->proxies, world->proxies_count);
+    } else if (world->broad_phase_type == BROAD_PHASE_SAP) {
+      SapUpdate(&world->sap, world->proxies, world->proxies_count);
+    }
+  }
+
+  void SetBroadPhase(World *world, BroadPhaseType type) {
+    if (type == world->broad_phase_type) {
+      return;
+    }
+
+    world->broad_phase_type = type;
+    for (u32 i = 0; i < world->proxies_count; i++) {
+      world->proxies[i].is_static = ProxyIsStatic(world, i);
+    }
+    ClearBroadPhase(world);
+    SyncBroadPhase(world);
+  }
+
+  //
+  // Body accessors. The returned references are only valid until the next AddBody or
+  // RemoveBody, hold on to the handle instead.
+  //
+  // NOTE: the cached rotation and bounds of a body (see UpdateProxies) are refreshed at
+  // the end of Step, so moving an existing body between steps shows up one step late in the
+  // collision detection.
+  //
+  inline v2 &BodyPosition(World *world, BodyHandle handle) {
+    return world->bodies.position[BodyIndex(world, handle)];
+  }
+
+  inline f32 &BodyRotation(World *world, BodyHandle handle) {
+    return world->bodies.rotation[BodyIndex(world, handle)];
+  }
+
+  inline v2 &BodyVelocity(World *world, BodyHandle handle) {
+    return world->bodies.velocity[BodyIndex(world, handle)];
+  }
+
+  inline f32 &BodyAngularVelocity(World *world, BodyHandle handle) {
+    return world->bodies.angular_velocity[BodyIndex(world, handle)];
+  }
+
+  inline v2 &BodyForce(World *world, BodyHandle handle) {
+    return world->bodies.force[BodyIndex(world, handle)];
   }
 
-  Body *AddBody(World *world, v2 position, v2 width, f32 mass) {
-    Assert(world->bodies_count <= MAX_BODY_COUNT);
-    Body *body = world->bodies + world->bodies_count;
+  inline f32 &BodyTorque(World *world, BodyHandle handle) {
+    return world->bodies.torque[BodyIndex(world, handle)];
+  }
+
+  inline v2 BodyWidth(World *world, BodyHandle handle) {
+    return world->bodies.width[BodyIndex(world, handle)];
+  }
+
+  inline BodyProperties *GetBodyProperties(World *world, BodyHandle handle) {
+    return world->bodies.properties + BodyIndex(world, handle);
+  }
+
+  // A locked body keeps its rotation, the solver sees it as having infinite inertia
+  void SetBodyLockRotation(World *world, BodyHandle handle, b32 lock_rotation) {
+    BodyProperties *properties = GetBodyProperties(world, handle);
+    properties->lock_rotation = lock_rotation;
+
+    f32 inv_inertia = 0.0f;
+    if (!lock_rotation && properties->inertia < F32_Max) {
+      inv_inertia = 1.0f / properties->inertia;
+    }
+    world->bodies.inv_inertia[BodyIndex(world, handle)] = inv_inertia;
+  }
+
+  BodyHandle AddBody(World *world, v2 position, v2 width, f32 mass) {
+    ReserveBodies(world, world->bodies.count + 1);
 
-    *body = {0};
-    body->position = position;
-    body->width = width;
-    body->mass = mass;
-    body->friction = 0.2f;
-    body->inertia = F32_Max;
+    Bodies *bodies = &world->bodies;
+    u32 i = bodies->count;
+
+    // Reuse a free slot before growing the slots, so there are never more than bodies
+    u32 slot = world->free_body_slot;
+    if (slot != BODY_SLOT_NONE) {
+      world->free_body_slot = world->body_slots[slot].index;
+    } else {
+      slot = world->body_slots_count++;
+      world->body_slots[slot].generation = 1;
+    }
+    world->body_slots[slot].index = i;
+    world->body_slot[i] = slot;
+    BodyHandle handle = {slot, world->body_slots[slot].generation};
+
+    bodies->position[i] = position;
+    bodies->rotation[i] = 0.0f;
+    bodies->velocity[i] = Vector2Zero();
+    bodies->angular_velocity[i] = 0.0f;
+    bodies->force[i] = Vector2Zero();
+    bodies->torque[i] = 0.0f;
+    bodies->inv_mass[i] = 0.0f;
+    bodies->inv_inertia[i] = 0.0f;
+    bodies->width[i] = width;
+    bodies->sleep_time[i] = 0.0f;
+    bodies->is_sleeping[i] = false;
+
+    BodyProperties *properties = bodies->properties + i;
+    *properties = {};
+    properties->mass = mass;
+    properties->friction = 0.2f;
+    properties->inertia = F32_Max;
 
     if (mass < F32_Max) {
-      body->inv_mass = 1.0f / mass;
-      body->inertia = mass * (width.x * width.x + width.y * width.y) / 12.0f;
-      body->inv_inertia = 1.0f / body->inertia;
+      properties->inertia = mass * (width.x * width.x + width.y * width.y) / 12.0f;
+      bodies->inv_mass[i] = 1.0f / mass;
+      bodies->inv_inertia[i] = 1.0f / properties->inertia;
     }
 
-    world->bodies_count++;
+    bodies->count++;
 
-    return body;
+    return handle;
   }
 
   int ClipSegmentToLine(ClipVertex v_out[2], ClipVertex v_in[2], const v2 &normal, f32 offset,
@@ -125,16 +608,10 @@ namespace physics {
     c[1].v = pos + rot * c[1].v;
   }
 
-  u64 Collide(Contact *contacts, Body *b1, Body *b2) {
-    v2 h1 = b1->width * 0.5f;
-    v2 h2 = b2->width * 0.5f;
-
-    v2 pos1 = b1->position;
-    v2 pos2 = b2->position;
-
-    Matrix2x2 rot1 = Matrix2x2FromAngle(b1->rotation);
-    Matrix2x2 rot2 = Matrix2x2FromAngle(b2->rotation);
-
+  // Separating axis test of a box pair, the first half of Collide. Returns false when the boxes
+  // do not overlap.
+  internal b32 CollideFindAxis(BoxPairAxis *result, v2 h1, v2 h2, v2 pos1, v2 pos2,
+                               const Matrix2x2 &rot1, const Matrix2x2 &rot2) {
     Matrix2x2 rot1T = Matrix2x2Transpose(rot1);
     Matrix2x2 rot2T = Matrix2x2Transpose(rot2);
 
@@ -149,13 +626,13 @@ namespace physics {
     // Box 1 faces
     v2 face1 = Vector2Abs(d1) - h1 - (absC * h2);
     if (face1.x > 0.0f || face1.y > 0.0f) {
-      return 0;
+      return false;
     }
 
     // Box 2 faces
     v2 face2 = Vector2Abs(d2) - h2 - (absCT * h1);
     if (face2.x > 0.0f || face2.y > 0.0f) {
-      return 0;
+      return false;
     }
 
     // Find best axis
@@ -191,9 +668,21 @@ namespace physics {
       }
     }
 
+    result->axis = axis;
+    result->normal = normal;
+    return true;
+  }
+
+  // Clips the incident edge against the reference face found by CollideFindAxis, the second
+  // half of Collide.
+  internal u32 CollideClip(Contact *contacts, BoxPairAxis box_axis, v2 h1, v2 h2, v2 pos1,
+                           v2 pos2, const Matrix2x2 &rot1, const Matrix2x2 &rot2) {
+    Axis axis = box_axis.axis;
+    v2 normal = box_axis.normal;
+
     // Setup clipping plane data based on the separating axis
     v2 front_normal, side_normal;
-    ClipVertex incident_edge[2];
+    ClipVertex incident_edge[2] = {};
     f32 front, neg_side, pos_side;
     u8 neg_edge, pos_edge;
 
@@ -232,7 +721,8 @@ namespace physics {
         pos_edge = EDGE1;
         ComputeIncidentEdge(incident_edge, h1, pos1, rot1, front_normal);
       } break;
-      case FACE_B_Y: {
+      case FACE_B_Y:
+      default: {
         front_normal = normal * (-1.0f);
         front = Vector2DotProduct(pos2, front_normal) + h2.y;
         side_normal = rot2.col1;
@@ -289,23 +779,216 @@ namespace physics {
       }
     }
 
-    if (!b1->is_grounded) {
-      b1->is_grounded = (normal.y < 0.0f);
+    return num_contacts;
+  }
+
+  u32 Collide(Contact *contacts, World *world, u32 i1, u32 i2) {
+    Bodies *bodies = &world->bodies;
+    v2 h1 = bodies->width[i1] * 0.5f;
+    v2 h2 = bodies->width[i2] * 0.5f;
+    v2 pos1 = bodies->position[i1];
+    v2 pos2 = bodies->position[i2];
+    Matrix2x2 rot1 = world->rotations[i1];
+    Matrix2x2 rot2 = world->rotations[i2];
+
+    BoxPairAxis axis;
+    if (!CollideFindAxis(&axis, h1, h2, pos1, pos2, rot1, rot2)) {
+      return 0;
+    }
+    return CollideClip(contacts, axis, h1, h2, pos1, pos2, rot1, rot2);
+  }
+
+#if COLLIDE_LANES > 1
+  //
+  // Wide SAT. Every lane runs the exact operation sequence of CollideFindAxis, so the batched
+  // and the scalar path agree bit for bit (as long as the compiler is not allowed to contract
+  // a * b + c into fused multiply-adds, which the default x86-64 target cannot do).
+  //
+#if COLLIDE_LANES == 8
+  typedef __m256 LaneF32;
+  inline LaneF32 LaneLoad(const f32 *p) { return _mm256_loadu_ps(p); }
+  inline void LaneStore(f32 *p, LaneF32 a) { _mm256_storeu_ps(p, a); }
+  inline LaneF32 LaneSet(f32 a) { return _mm256_set1_ps(a); }
+  inline LaneF32 LaneAdd(LaneF32 a, LaneF32 b) { return _mm256_add_ps(a, b); }
+  inline LaneF32 LaneSub(LaneF32 a, LaneF32 b) { return _mm256_sub_ps(a, b); }
+  inline LaneF32 LaneMul(LaneF32 a, LaneF32 b) { return _mm256_mul_ps(a, b); }
+  inline LaneF32 LaneAnd(LaneF32 a, LaneF32 b) { return _mm256_and_ps(a, b); }
+  inline LaneF32 LaneAndNot(LaneF32 a, LaneF32 b) { return _mm256_andnot_ps(a, b); }
+  inline LaneF32 LaneOr(LaneF32 a, LaneF32 b) { return _mm256_or_ps(a, b); }
+  inline LaneF32 LaneXor(LaneF32 a, LaneF32 b) { return _mm256_xor_ps(a, b); }
+  inline LaneF32 LaneGreater(LaneF32 a, LaneF32 b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  inline LaneF32 LaneSelect(LaneF32 mask, LaneF32 a, LaneF32 b) {
+    return _mm256_blendv_ps(b, a, mask);
+  }
+  inline u32 LaneMask(LaneF32 mask) { return (u32)_mm256_movemask_ps(mask); }
+#else
+  typedef __m128 LaneF32;
+  inline LaneF32 LaneLoad(const f32 *p) { return _mm_loadu_ps(p); }
+  inline void LaneStore(f32 *p, LaneF32 a) { _mm_storeu_ps(p, a); }
+  inline LaneF32 LaneSet(f32 a) { return _mm_set1_ps(a); }
+  inline LaneF32 LaneAdd(LaneF32 a, LaneF32 b) { return _mm_add_ps(a, b); }
+  inline LaneF32 LaneSub(LaneF32 a, LaneF32 b) { return _mm_sub_ps(a, b); }
+  inline LaneF32 LaneMul(LaneF32 a, LaneF32 b) { return _mm_mul_ps(a, b); }
+  inline LaneF32 LaneAnd(LaneF32 a, LaneF32 b) { return _mm_and_ps(a, b); }
+  inline LaneF32 LaneAndNot(LaneF32 a, LaneF32 b) { return _mm_andnot_ps(a, b); }
+  inline LaneF32 LaneOr(LaneF32 a, LaneF32 b) { return _mm_or_ps(a, b); }
+  inline LaneF32 LaneXor(LaneF32 a, LaneF32 b) { return _mm_xor_ps(a, b); }
+  inline LaneF32 LaneGreater(LaneF32 a, LaneF32 b) { return _mm_cmpgt_ps(a, b); }
+  inline LaneF32 LaneSelect(LaneF32 mask, LaneF32 a, LaneF32 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+  }
+  inline u32 LaneMask(LaneF32 mask) { return (u32)_mm_movemask_ps(mask); }
+#endif
+
+  // NOTE: negation and Abs only touch the sign bit, like the scalar unary minus,
+  // multiplication by -1 and fabsf do.
+  inline LaneF32 LaneNegate(LaneF32 a) { return LaneXor(a, LaneSet(-0.0f)); }
+  inline LaneF32 LaneAbs(LaneF32 a) { return LaneAndNot(LaneSet(-0.0f), a); }
+
+  internal void CollideFindAxesWide(World *world, const BroadPhasePair *pairs,
+                                    BoxPairAxis *out) {
+    Bodies *bodies = &world->bodies;
+
+    // Gather the pairs into lanes
+    f32 g[12][COLLIDE_LANES];
+    for (u32 lane = 0; lane < COLLIDE_LANES; lane++) {
+      u32 i1 = pairs[lane].a;
+      u32 i2 = pairs[lane].b;
+      v2 h1 = bodies->width[i1] * 0.5f;
+      v2 h2 = bodies->width[i2] * 0.5f;
+      g[0][lane] = h1.x;
+      g[1][lane] = h1.y;
+      g[2][lane] = h2.x;
+      g[3][lane] = h2.y;
+      g[4][lane] = bodies->position[i1].x;
+      g[5][lane] = bodies->position[i1].y;
+      g[6][lane] = bodies->position[i2].x;
+      g[7][lane] = bodies->position[i2].y;
+      g[8][lane] = world->rotations[i1].m0;  // cos
+      g[9][lane] = world->rotations[i1].m1;  // sin
+      g[10][lane] = world->rotations[i2].m0;
+      g[11][lane] = world->rotations[i2].m1;
     }
 
-    return num_contacts;
+    LaneF32 h1x = LaneLoad(g[0]), h1y = LaneLoad(g[1]);
+    LaneF32 h2x = LaneLoad(g[2]), h2y = LaneLoad(g[3]);
+    LaneF32 c1 = LaneLoad(g[8]), s1 = LaneLoad(g[9]);
+    LaneF32 c2 = LaneLoad(g[10]), s2 = LaneLoad(g[11]);
+    LaneF32 neg_s1 = LaneNegate(s1);
+    LaneF32 neg_s2 = LaneNegate(s2);
+
+    // dp = pos2 - pos1, d1 = rot1T * dp, d2 = rot2T * dp
+    LaneF32 dpx = LaneSub(LaneLoad(g[6]), LaneLoad(g[4]));
+    LaneF32 dpy = LaneSub(LaneLoad(g[7]), LaneLoad(g[5]));
+    LaneF32 d1x = LaneAdd(LaneMul(c1, dpx), LaneMul(s1, dpy));
+    LaneF32 d1y = LaneAdd(LaneMul(neg_s1, dpx), LaneMul(c1, dpy));
+    LaneF32 d2x = LaneAdd(LaneMul(c2, dpx), LaneMul(s2, dpy));
+    LaneF32 d2y = LaneAdd(LaneMul(neg_s2, dpx), LaneMul(c2, dpy));
+
+    // absC = |rot1T * rot2|
+    LaneF32 a0 = LaneAbs(LaneAdd(LaneMul(c1, c2), LaneMul(s1, s2)));
+    LaneF32 a1 = LaneAbs(LaneAdd(LaneMul(neg_s1, c2), LaneMul(c1, s2)));
+    LaneF32 a2 = LaneAbs(LaneAdd(LaneMul(c1, neg_s2), LaneMul(s1, c2)));
+    LaneF32 a3 = LaneAbs(LaneAdd(LaneMul(neg_s1, neg_s2), LaneMul(c1, c2)));
+
+    // Box 1 and box 2 faces
+    LaneF32 face1x
+        = LaneSub(LaneSub(LaneAbs(d1x), h1x), LaneAdd(LaneMul(a0, h2x), LaneMul(a2, h2y)));
+    LaneF32 face1y
+        = LaneSub(LaneSub(LaneAbs(d1y), h1y), LaneAdd(LaneMul(a1, h2x), LaneMul(a3, h2y)));
+    LaneF32 face2x
+        = LaneSub(LaneSub(LaneAbs(d2x), h2x), LaneAdd(LaneMul(a0, h1x), LaneMul(a1, h1y)));
+    LaneF32 face2y
+        = LaneSub(LaneSub(LaneAbs(d2y), h2y), LaneAdd(LaneMul(a2, h1x), LaneMul(a3, h1y)));
+
+    LaneF32 zero = LaneSet(0.0f);
+    LaneF32 separated = LaneOr(LaneOr(LaneGreater(face1x, zero), LaneGreater(face1y, zero)),
+                               LaneOr(LaneGreater(face2x, zero), LaneGreater(face2y, zero)));
+    u32 separated_mask = LaneMask(separated);
+
+    // Find best axis
+    LaneF32 relative_to_l = LaneSet(0.95f);
+    LaneF32 absolute_to_l = LaneSet(0.01f);
+    LaneF32 axis = LaneSet((f32)FACE_A_X);
+    LaneF32 seperation = face1x;
+    LaneF32 flip = LaneGreater(d1x, zero);
+    LaneF32 nx = LaneSelect(flip, c1, LaneNegate(c1));
+    LaneF32 ny = LaneSelect(flip, s1, LaneNegate(s1));
+
+    LaneF32 take = LaneGreater(
+        face1y, LaneAdd(LaneMul(relative_to_l, seperation), LaneMul(absolute_to_l, h1y)));
+    flip = LaneGreater(d1y, zero);
+    axis = LaneSelect(take, LaneSet((f32)FACE_A_Y), axis);
+    seperation = LaneSelect(take, face1y, seperation);
+    nx = LaneSelect(take, LaneSelect(flip, neg_s1, LaneNegate(neg_s1)), nx);
+    ny = LaneSelect(take, LaneSelect(flip, c1, LaneNegate(c1)), ny);
+
+    take = LaneGreater(face2x,
+                       LaneAdd(LaneMul(relative_to_l, seperation), LaneMul(absolute_to_l, h2x)));
+    flip = LaneGreater(d2x, zero);
+    axis = LaneSelect(take, LaneSet((f32)FACE_B_X), axis);
+    seperation = LaneSelect(take, face2x, seperation);
+    nx = LaneSelect(take, LaneSelect(flip, c2, LaneNegate(c2)), nx);
+    ny = LaneSelect(take, LaneSelect(flip, s2, LaneNegate(s2)), ny);
+
+    take = LaneGreater(face2y,
+                       LaneAdd(LaneMul(relative_to_l, seperation), LaneMul(absolute_to_l, h2y)));
+    flip = LaneGreater(d2y, zero);
+    axis = LaneSelect(take, LaneSet((f32)FACE_B_Y), axis);
+    nx = LaneSelect(take, LaneSelect(flip, neg_s2, LaneNegate(neg_s2)), nx);
+    ny = LaneSelect(take, LaneSelect(flip, c2, LaneNegate(c2)), ny);
+
+    f32 axis_out[COLLIDE_LANES], nx_out[COLLIDE_LANES], ny_out[COLLIDE_LANES];
+    LaneStore(axis_out, axis);
+    LaneStore(nx_out, nx);
+    LaneStore(ny_out, ny);
+    for (u32 lane = 0; lane < COLLIDE_LANES; lane++) {
+      out[lane].axis = (separated_mask & (1u << lane)) ? NO_AXIS : (Axis)(i32)axis_out[lane];
+      out[lane].normal = {nx_out[lane], ny_out[lane]};
+    }
+  }
+#endif
+
+  // Runs the separating axis test for count pairs, COLLIDE_LANES at a time where possible.
+  // Pairs that do not overlap get NO_AXIS.
+  void CollideFindAxes(World *world, const BroadPhasePair *pairs, u32 count, BoxPairAxis *out) {
+    u32 i = 0;
+#if COLLIDE_LANES > 1
+    for (; i + COLLIDE_LANES <= count; i += COLLIDE_LANES) {
+      CollideFindAxesWide(world, pairs + i, out + i);
+    }
+#endif
+
+    Bodies *bodies = &world->bodies;
+    for (; i < count; i++) {
+      u32 i1 = pairs[i].a;
+      u32 i2 = pairs[i].b;
+      if (!CollideFindAxis(out + i, bodies->width[i1] * 0.5f, bodies->width[i2] * 0.5f,
+                           bodies->position[i1], bodies->position[i2], world->rotations[i1],
+                           world->rotations[i2])) {
+        out[i].axis = NO_AXIS;
+      }
+    }
   }
 
-  Arbiter Collide(Body *b1, Body *b2) {
-    Assert(b1 < b2);
+  Arbiter Collide(World *world, u32 i1, u32 i2, BoxPairAxis axis) {
+    Assert(i1 < i2);
+    Bodies *bodies = &world->bodies;
 
-    Arbiter result = {0};
+    Arbiter result = {};
 
-    result.b1 = b1;
-    result.b2 = b2;
+    result.i1 = i1;
+    result.i2 = i2;
 
-    result.combined_friction = SquareRoot(b1->friction * b2->friction);
-    result.contacts_count = Collide(result.contacts, b1, b2);
+    f32 friction1 = bodies->properties[i1].friction;
+    f32 friction2 = bodies->properties[i2].friction;
+    result.combined_friction = SquareRoot(friction1 * friction2);
+    if (axis.axis != NO_AXIS) {
+      result.contacts_count
+          = CollideClip(result.contacts, axis, bodies->width[i1] * 0.5f, bodies->width[i2] * 0.5f,
+                        bodies->position[i1], bodies->position[i2], world->rotations[i1],
+                        world->rotations[i2]);
+    }
 
     return result;
   }
@@ -332,7 +1015,6 @@ namespace physics {
         // Warm starting
         c->acc_normal_impulse = c_old->acc_normal_impulse;
         c->acc_tangent_impulse = c_old->acc_tangent_impulse;
-        c->acc_biased_normal_impulse = c_old->acc_biased_normal_impulse;
       } else {
         merged_contacts[i] = to_merge.contacts[i];
       }
@@ -345,63 +1027,123 @@ namespace physics {
     a->contacts_count = to_merge.contacts_count;
   }
 
-  void ArbiterPreStep(Arbiter *a, f32 inv_dt) {
+  // NOTE: static bodies are shared between arbiters of the same solver color, their
+  // velocities never change so they are not written back, which keeps the parallel solver free
+  // of races.
+  inline void ArbiterStoreVelocities(Bodies *bodies, u32 i1, u32 i2, v2 vel1, v2 vel2,
+                                     f32 ang_vel1, f32 ang_vel2) {
+    if (bodies->inv_mass[i1] > 0.0f) {
+      bodies->velocity[i1] = vel1;
+      bodies->angular_velocity[i1] = ang_vel1;
+    }
+    if (bodies->inv_mass[i2] > 0.0f) {
+      bodies->velocity[i2] = vel2;
+      bodies->angular_velocity[i2] = ang_vel2;
+    }
+  }
+
+  // Contact arms and the effective masses along the normal and the tangent
+  inline void ContactComputeMasses(Contact *c, v2 pos1, v2 pos2, f32 inv_mass1, f32 inv_mass2,
+                                   f32 inv_inertia1, f32 inv_inertia2) {
+    v2 r1 = c->position - pos1;
+    v2 r2 = c->position - pos2;
+    c->r1 = r1;
+    c->r2 = r2;
+
+    f32 rn1 = Vector2DotProduct(r1, c->normal);
+    f32 rn2 = Vector2DotProduct(r2, c->normal);
+    f32 k_normal = inv_mass1 + inv_mass2;
+    k_normal += inv_inertia1 * (Vector2DotProduct(r1, r1) - rn1 * rn1)
+                + inv_inertia2 * (Vector2DotProduct(r2, r2) - rn2 * rn2);
+    c->mass_normal = 1.0f / k_normal;
+
+    v2 tangent = Vector2Cross(c->normal, 1.0f);
+    f32 rt1 = Vector2DotProduct(r1, tangent);
+    f32 rt2 = Vector2DotProduct(r2, tangent);
+    float k_tangent = inv_mass1 + inv_mass2;
+    k_tangent += inv_inertia1 * (Vector2DotProduct(r1, r1) - rt1 * rt1)
+                 + inv_inertia2 * (Vector2DotProduct(r2, r2) - rt2 * rt2);
+    c->mass_tangent = 1.0f / k_tangent;
+  }
+
+  void ArbiterPreStep(World *world, Arbiter *a, f32 inv_dt) {
+    Bodies *bodies = &world->bodies;
+    u32 i1 = a->i1;
+    u32 i2 = a->i2;
+
+    v2 pos1 = bodies->position[i1];
+    v2 pos2 = bodies->position[i2];
+    f32 inv_mass1 = bodies->inv_mass[i1];
+    f32 inv_mass2 = bodies->inv_mass[i2];
+    f32 inv_inertia1 = bodies->inv_inertia[i1];
+    f32 inv_inertia2 = bodies->inv_inertia[i2];
+
+    v2 vel1 = bodies->velocity[i1];
+    v2 vel2 = bodies->velocity[i2];
+    f32 ang_vel1 = bodies->angular_velocity[i1];
+    f32 ang_vel2 = bodies->angular_velocity[i2];
+
     const f32 k_allowed_penetration = 0.01f;
     f32 k_bias_factor = 0.2f;
 
     for (usize i = 0; i < a->contacts_count; i++) {
       Contact *c = a->contacts + i;
 
-      v2 r1 = c->position - a->b1->position;
-      v2 r2 = c->position - a->b2->position;
-
-      // Precompute normal mass, tangent mass, and bias
-      f32 rn1 = Vector2DotProduct(r1, c->normal);
-      f32 rn2 = Vector2DotProduct(r2, c->normal);
-      f32 k_normal = a->b1->inv_mass + a->b2->inv_mass;
-      k_normal += a->b1->inv_inertia * (Vector2DotProduct(r1, r1) - rn1 * rn1)
-                  + a->b2->inv_inertia * (Vector2DotProduct(r2, r2) - rn2 * rn2);
-      c->mass_normal = 1.0f / k_normal;
-
+      // NOTE: positions do not change while iterating, so the contact arms are computed
+      // once here instead of in every ArbiterApplyImpulse.
+      ContactComputeMasses(c, pos1, pos2, inv_mass1, inv_mass2, inv_inertia1, inv_inertia2);
+      v2 r1 = c->r1;
+      v2 r2 = c->r2;
       v2 tangent = Vector2Cross(c->normal, 1.0f);
-      f32 rt1 = Vector2DotProduct(r1, tangent);
-      f32 rt2 = Vector2DotProduct(r2, tangent);
-      float k_tangent = a->b1->inv_mass + a->b2->inv_mass;
-      k_tangent += a->b1->inv_inertia * (Vector2DotProduct(r1, r1) - rt1 * rt1)
-                   + a->b2->inv_inertia * (Vector2DotProduct(r2, r2) - rt2 * rt2);
-      c->mass_tangent = 1.0f / k_tangent;
 
       c->bias = -k_bias_factor * inv_dt * Min(0.0f, c->seperation + k_allowed_penetration);
+      c->position_bias = 0.0f;
+      c->acc_biased_normal_impulse = 0.0f;
+      if (world->split_impulses) {
+        c->position_bias = c->bias;
+        c->bias = 0.0f;
+      }
 
       // accumulate impulses
       {
         v2 P = c->normal * c->acc_normal_impulse + tangent * c->acc_tangent_impulse;
 
-        a->b1->velocity -= P * a->b1->inv_mass;
-        if (!a->b1->lock_rotation) {
-          a->b1->angular_velocity -= a->b1->inv_inertia * Vector2Cross(r1, P);
-        }
+        vel1 -= P * inv_mass1;
+        ang_vel1 -= inv_inertia1 * Vector2Cross(r1, P);
 
-        a->b2->velocity += P * a->b2->inv_mass;
-        if (!a->b1->lock_rotation) {
-          a->b2->angular_velocity += a->b2->inv_inertia * Vector2Cross(r2, P);
-        }
+        vel2 += P * inv_mass2;
+        ang_vel2 += inv_inertia2 * Vector2Cross(r2, P);
       }
     }
+
+    ArbiterStoreVelocities(bodies, i1, i2, vel1, vel2, ang_vel1, ang_vel2);
   }
 
-  void ArbiterApplyImpulse(Arbiter *a) {
-    Body *b1 = a->b1;
-    Body *b2 = a->b2;
+  // Returns the largest change in relative contact velocity the impulses made, which the solver
+  // measures convergence by. Unlike the impulses it does not scale with the masses.
+  f32 ArbiterApplyImpulse(World *world, Arbiter *a) {
+    Bodies *bodies = &world->bodies;
+    u32 i1 = a->i1;
+    u32 i2 = a->i2;
+
+    f32 inv_mass1 = bodies->inv_mass[i1];
+    f32 inv_mass2 = bodies->inv_mass[i2];
+    f32 inv_inertia1 = bodies->inv_inertia[i1];
+    f32 inv_inertia2 = bodies->inv_inertia[i2];
+
+    // NOTE: i1 != i2, so the velocities can live in registers for the whole arbiter and
+    // be written back once at the end.
+    v2 vel1 = bodies->velocity[i1];
+    v2 vel2 = bodies->velocity[i2];
+    f32 ang_vel1 = bodies->angular_velocity[i1];
+    f32 ang_vel2 = bodies->angular_velocity[i2];
+    f32 max_change = 0.0f;
 
     for (usize i = 0; i < a->contacts_count; i++) {
       Contact *c = a->contacts + i;
-      c->r1 = c->position - b1->position;
-      c->r2 = c->position - b2->position;
 
       // Relative velocity at contact
-      v2 dv = b2->velocity + Vector2Cross(b2->angular_velocity, c->r2) - b1->velocity
-              - Vector2Cross(b1->angular_velocity, c->r1);
+      v2 dv = vel2 + Vector2Cross(ang_vel2, c->r2) - vel1 - Vector2Cross(ang_vel1, c->r1);
 
       // Compute normal impulse
       f32 vn = Vector2DotProduct(dv, c->normal);
@@ -412,23 +1154,19 @@ namespace physics {
       f32 Pn0 = c->acc_normal_impulse;
       c->acc_normal_impulse = Max(Pn0 + dPn, 0.0f);
       dPn = c->acc_normal_impulse - Pn0;
+      max_change = Max(max_change, AbsoluteValue(dPn) / c->mass_normal);
 
       // Apply contact impulse
       v2 Pn = c->normal * dPn;
 
-      b1->velocity -= Pn * b1->inv_mass;
-      if (!b1->lock_rotation) {
-        b1->angular_velocity -= b1->inv_inertia * Vector2Cross(c->r1, Pn);
-      }
+      vel1 -= Pn * inv_mass1;
+      ang_vel1 -= inv_inertia1 * Vector2Cross(c->r1, Pn);
 
-      b2->velocity += Pn * b2->inv_mass;
-      if (!b2->lock_rotation) {
-        b2->angular_velocity += b2->inv_inertia * Vector2Cross(c->r2, Pn);
-      }
+      vel2 += Pn * inv_mass2;
+      ang_vel2 += inv_inertia2 * Vector2Cross(c->r2, Pn);
 
       // Relative velocity at contact
-      dv = b2->velocity + Vector2Cross(b2->angular_velocity, c->r2) - b1->velocity
-           - Vector2Cross(b1->angular_velocity, c->r1);
+      dv = vel2 + Vector2Cross(ang_vel2, c->r2) - vel1 - Vector2Cross(ang_vel1, c->r1);
 
       v2 tangent = Vector2Cross(c->normal, 1.0f);
       f32 vt = Vector2DotProduct(dv, tangent);
@@ -443,152 +1181,1456 @@ namespace physics {
         c->acc_tangent_impulse = Clamp(old_tangent_impulse + dPt, -maxPt, maxPt);
         dPt = c->acc_tangent_impulse - old_tangent_impulse;
       }
+      max_change = Max(max_change, AbsoluteValue(dPt) / c->mass_tangent);
 
       // Apply contact impulse
       v2 Pt = tangent * dPt;
 
-      b1->velocity -= Pt * b1->inv_mass;
-      if (!b1->lock_rotation) {
-        b1->angular_velocity -= b1->inv_inertia * Vector2Cross(c->r1, Pt);
-      }
+      vel1 -= Pt * inv_mass1;
+      ang_vel1 -= inv_inertia1 * Vector2Cross(c->r1, Pt);
 
-      b2->velocity += Pt * b2->inv_mass;
-      if (!b2->lock_rotation) {
-        b2->angular_velocity += b2->inv_inertia * Vector2Cross(c->r2, Pt);
-      }
+      vel2 += Pt * inv_mass2;
+      ang_vel2 += inv_inertia2 * Vector2Cross(c->r2, Pt);
     }
+
+    ArbiterStoreVelocities(bodies, i1, i2, vel1, vel2, ang_vel1, ang_vel2);
+    return max_change;
   }
 
-  void BroadPhase(World *world) {
-    // TODO(anton): slow O^2 broad collision detection, use some spatial lookup function...
-    for (u32 i = 0; i < world->bodies_count; i++) {
-      Body *bi = world->bodies + i;
-      for (u32 j = i + 1; j < world->bodies_count; j++) {
-        Body *bj = world->bodies + j;
-
-        if (bi->inv_mass == 0.0f && bj->inv_mass == 0.0f) {
-          continue;
-        }
+  // Split impulses: pushes penetrating contacts apart through the bias velocities alone, the
+  // velocities the bodies keep after the step never see the push. Only the normal is solved,
+  // friction has nothing to correct. Returns the largest change in relative bias velocity.
+  f32 ArbiterApplySplitImpulse(World *world, Arbiter *a) {
+    Bodies *bodies = &world->bodies;
+    u32 i1 = a->i1;
+    u32 i2 = a->i2;
+
+    f32 inv_mass1 = bodies->inv_mass[i1];
+    f32 inv_mass2 = bodies->inv_mass[i2];
+    f32 inv_inertia1 = bodies->inv_inertia[i1];
+    f32 inv_inertia2 = bodies->inv_inertia[i2];
+
+    v2 vel1 = world->bias_velocities[i1];
+    v2 vel2 = world->bias_velocities[i2];
+    f32 ang_vel1 = world->bias_angular_velocities[i1];
+    f32 ang_vel2 = world->bias_angular_velocities[i2];
+
+    f32 max_change = 0.0f;
+    for (usize i = 0; i < a->contacts_count; i++) {
+      Contact *c = a->contacts + i;
 
-        {
-          Body *b1;
-          Body *b2;
-          if (bi < bj) {
-            b1 = bi;
-            b2 = bj;
-          } else {
-            b1 = bj;
-            b2 = bi;
-          }
+      v2 dv = vel2 + Vector2Cross(ang_vel2, c->r2) - vel1 - Vector2Cross(ang_vel1, c->r1);
+      f32 vn = Vector2DotProduct(dv, c->normal);
+      f32 dPnb = c->mass_normal * (-vn + c->position_bias);
 
-          Arbiter arbiter = Collide(b1, b2);
-          ArbiterKey arbiter_key = {b1, b2};
-          u64 hash_table_key = murmur64((void *)&arbiter_key, sizeof(ArbiterKey));
-          Arbiter *iter = HashTableGet(&world->arbiter_table, hash_table_key);
-
-          if (arbiter.contacts_count > 0) {
-            if (iter == nullptr) {
-              HashTableSet(&world->arbiter_table, hash_table_key, arbiter);
-            } else {
-              ArbiterMergeContacts(iter, arbiter);
-              Log("MERGE \n");
-            }
-          }
-        }
-      }
+      f32 Pnb0 = c->acc_biased_normal_impulse;
+      c->acc_biased_normal_impulse = Max(Pnb0 + dPnb, 0.0f);
+      dPnb = c->acc_biased_normal_impulse - Pnb0;
+
+      v2 Pb = c->normal * dPnb;
+      vel1 -= Pb * inv_mass1;
+      ang_vel1 -= inv_inertia1 * Vector2Cross(c->r1, Pb);
+      vel2 += Pb * inv_mass2;
+      ang_vel2 += inv_inertia2 * Vector2Cross(c->r2, Pb);
+
+      max_change = Max(max_change, AbsoluteValue(dPnb) / c->mass_normal);
+    }
+
+    if (inv_mass1 > 0.0f) {
+      world->bias_velocities[i1] = vel1;
+      world->bias_angular_velocities[i1] = ang_vel1;
+    }
+    if (inv_mass2 > 0.0f) {
+      world->bias_velocities[i2] = vel2;
+      world->bias_angular_velocities[i2] = ang_vel2;
     }
+    return max_change;
   }
 
-  void Step(World *world) {
-    f32 dt = GetFrameTime();
-    f32 inv_dt = dt > 0.0f ? 1.0f / dt : 0.0f;
+  // Soft contact constraint of a substep of length h: a spring of the given stiffness and
+  // damping ratio, solved implicitly. Stiffer springs than the substep rate can follow only
+  // make the solver ring.
+  internal SoftContact MakeSoftContact(f32 hertz, f32 damping_ratio, f32 h) {
+    f32 omega = 2.0f * PI * hertz;
+    f32 a1 = 2.0f * damping_ratio + h * omega;
+    f32 a2 = h * omega * a1;
+    f32 a3 = 1.0f / (1.0f + a2);
+    return {omega / a1, a2 * a3, a3};
+  }
 
-    //
-    HashTableClear(&world->arbiter_table);
-    for (usize i = 0; i < world->bodies_count; i++) {
-      Body *b = world->bodies + i;
-      b->is_grounded = false;
+  // SOLVER_SUBSTEP counterpart of ArbiterPreStep. The masses and contact arms stay as they are
+  // at the start of the step, the separation is kept without the arms so that the substeps can
+  // follow it as the bodies move. Warm starting is left to every substep.
+  void ArbiterPrepareSubsteps(World *world, Arbiter *a) {
+    Bodies *bodies = &world->bodies;
+    u32 i1 = a->i1;
+    u32 i2 = a->i2;
+
+    for (usize i = 0; i < a->contacts_count; i++) {
+      Contact *c = a->contacts + i;
+      ContactComputeMasses(c, bodies->position[i1], bodies->position[i2], bodies->inv_mass[i1],
+                           bodies->inv_mass[i2], bodies->inv_inertia[i1], bodies->inv_inertia[i2]);
+      c->adjusted_separation = c->seperation - Vector2DotProduct(c->r2 - c->r1, c->normal);
     }
+  }
 
-    //
-    BroadPhase(world);
+  void ArbiterWarmStart(World *world, Arbiter *a) {
+    Bodies *bodies = &world->bodies;
+    u32 i1 = a->i1;
+    u32 i2 = a->i2;
 
-    // Integrate forces
-    for (usize i = 0; i < world->bodies_count; i++) {
-      Body *b = world->bodies + i;
+    f32 inv_mass1 = bodies->inv_mass[i1];
+    f32 inv_mass2 = bodies->inv_mass[i2];
+    f32 inv_inertia1 = bodies->inv_inertia[i1];
+    f32 inv_inertia2 = bodies->inv_inertia[i2];
 
-      if (b->inv_mass == 0.0f) {
-        continue;
-      }
+    v2 vel1 = bodies->velocity[i1];
+    v2 vel2 = bodies->velocity[i2];
+    f32 ang_vel1 = bodies->angular_velocity[i1];
+    f32 ang_vel2 = bodies->angular_velocity[i2];
 
-      b->velocity += (world->gravity + b->force * b->inv_mass) * dt;
-      b->angular_velocity += (b->torque * b->inv_inertia) * dt;
-    }
+    for (usize i = 0; i < a->contacts_count; i++) {
+      Contact *c = a->contacts + i;
+      v2 tangent = Vector2Cross(c->normal, 1.0f);
+      v2 P = c->normal * c->acc_normal_impulse + tangent * c->acc_tangent_impulse;
 
-    // Perform pre-steps
-    for (usize i = 0; i < world->arbiter_table.entries_count; i++) {
-      Arbiter *a = &world->arbiter_table.entries[i].value;
-      ArbiterPreStep(a, inv_dt);
+      vel1 -= P * inv_mass1;
+      ang_vel1 -= inv_inertia1 * Vector2Cross(c->r1, P);
+
+      vel2 += P * inv_mass2;
+      ang_vel2 += inv_inertia2 * Vector2Cross(c->r2, P);
     }
 
-    // Perform iterations
-    for (usize i = 0; i < world->iterations; i++) {
-      for (usize ai = 0; ai < world->arbiter_table.entries_count; ai++) {
-        Arbiter *a = &world->arbiter_table.entries[ai].value;
-        ArbiterApplyImpulse(a);
+    ArbiterStoreVelocities(bodies, i1, i2, vel1, vel2, ang_vel1, ang_vel2);
+  }
+
+  inline v2 RotateByCosSin(v2 cos_sin, v2 v) {
+    return {cos_sin.x * v.x - cos_sin.y * v.y, cos_sin.y * v.x + cos_sin.x * v.y};
+  }
+
+  // One pass of soft contacts in a substep. The separation is updated from how far the bodies
+  // moved and rotated since the start of the step instead of colliding them again. With
+  // use_bias the penetration is pushed out through the soft constraint, without it only the
+  // velocities are solved, which takes out the energy the push added.
+  void ArbiterSolveSoft(World *world, Arbiter *a, const SoftContact &soft, f32 inv_h,
+                        b32 use_bias) {
+    Bodies *bodies = &world->bodies;
+    u32 i1 = a->i1;
+    u32 i2 = a->i2;
+
+    const f32 k_allowed_penetration = 0.01f;
+    const f32 k_max_push_velocity = 3.0f;  // m/s
+
+    f32 inv_mass1 = bodies->inv_mass[i1];
+    f32 inv_mass2 = bodies->inv_mass[i2];
+    f32 inv_inertia1 = bodies->inv_inertia[i1];
+    f32 inv_inertia2 = bodies->inv_inertia[i2];
+
+    v2 vel1 = bodies->velocity[i1];
+    v2 vel2 = bodies->velocity[i2];
+    f32 ang_vel1 = bodies->angular_velocity[i1];
+    f32 ang_vel2 = bodies->angular_velocity[i2];
+
+    v2 delta_position = world->delta_positions[i2] - world->delta_positions[i1];
+    v2 delta_rotation1 = world->delta_rotations[i1];
+    v2 delta_rotation2 = world->delta_rotations[i2];
+
+    for (usize i = 0; i < a->contacts_count; i++) {
+      Contact *c = a->contacts + i;
+
+      v2 d = delta_position + RotateByCosSin(delta_rotation2, c->r2)
+             - RotateByCosSin(delta_rotation1, c->r1);
+      f32 separation = Vector2DotProduct(d, c->normal) + c->adjusted_separation;
+
+      // NOTE: contacts that drifted apart let the bodies close the gap within the
+      // substep, but no faster
+      f32 bias = 0.0f;
+      f32 mass_scale = 1.0f;
+      f32 impulse_scale = 0.0f;
+      if (separation > 0.0f) {
+        bias = separation * inv_h;
+      } else if (use_bias) {
+        bias = Max(soft.bias_rate * Min(0.0f, separation + k_allowed_penetration),
+                   -k_max_push_velocity);
+        mass_scale = soft.mass_scale;
+        impulse_scale = soft.impulse_scale;
       }
+
+      v2 dv = vel2 + Vector2Cross(ang_vel2, c->r2) - vel1 - Vector2Cross(ang_vel1, c->r1);
+      f32 vn = Vector2DotProduct(dv, c->normal);
+      f32 dPn = -c->mass_normal * mass_scale * (vn + bias) - impulse_scale * c->acc_normal_impulse;
+
+      f32 Pn0 = c->acc_normal_impulse;
+      c->acc_normal_impulse = Max(Pn0 + dPn, 0.0f);
+      dPn = c->acc_normal_impulse - Pn0;
+
+      v2 Pn = c->normal * dPn;
+      vel1 -= Pn * inv_mass1;
+      ang_vel1 -= inv_inertia1 * Vector2Cross(c->r1, Pn);
+      vel2 += Pn * inv_mass2;
+      ang_vel2 += inv_inertia2 * Vector2Cross(c->r2, Pn);
+
+      dv = vel2 + Vector2Cross(ang_vel2, c->r2) - vel1 - Vector2Cross(ang_vel1, c->r1);
+      v2 tangent = Vector2Cross(c->normal, 1.0f);
+      f32 vt = Vector2DotProduct(dv, tangent);
+      f32 dPt = vt * c->mass_tangent * (-1.0f);
+
+      f32 maxPt = a->combined_friction * c->acc_normal_impulse;
+      f32 old_tangent_impulse = c->acc_tangent_impulse;
+      c->acc_tangent_impulse = Clamp(old_tangent_impulse + dPt, -maxPt, maxPt);
+      dPt = c->acc_tangent_impulse - old_tangent_impulse;
+
+      v2 Pt = tangent * dPt;
+      vel1 -= Pt * inv_mass1;
+      ang_vel1 -= inv_inertia1 * Vector2Cross(c->r1, Pt);
+      vel2 += Pt * inv_mass2;
+      ang_vel2 += inv_inertia2 * Vector2Cross(c->r2, Pt);
     }
 
-    // Integrate velocities
-    for (usize i = 0; i < world->bodies_count; i++) {
-      Body *b = world->bodies + i;
+    ArbiterStoreVelocities(bodies, i1, i2, vel1, vel2, ang_vel1, ang_vel2);
+  }
+
+  AABB ComputeAABB(v2 position, const Matrix2x2 &rotation, v2 width) {
+    Matrix2x2 abs_rot = Matrix2x2Abs(rotation);
+    v2 extent = abs_rot * (width * 0.5f);
 
-      b->position += b->velocity * dt;
-      b->rotation += b->angular_velocity * dt;
+    AABB result;
+    result.min = position - extent;
+    result.max = position + extent;
+    return result;
+  }
 
-      b->torque = 0.0f;
-      b->force = Vector2Zero();
+  // Per body work split over the thread pool, indices are relative to first
+  struct BodiesTask {
+    World *world;
+    u32 first;
+    f32 dt;
+  };
+
+  internal void UpdateProxiesTaskRun(void *data, u32 begin, u32 end, u32 /* thread_index */) {
+    BodiesTask *task = (BodiesTask *)data;
+    World *world = task->world;
+    Bodies *bodies = &world->bodies;
+    begin += task->first;
+    end += task->first;
+
+    for (u32 i = begin; i < end; i++) {
+      world->rotations[i] = Matrix2x2FromAngle(bodies->rotation[i]);
+    }
+    for (u32 i = begin; i < end; i++) {
+      world->proxies[i].aabb
+          = ComputeAABB(bodies->position[i], world->rotations[i], bodies->width[i]);
+      world->proxies[i].is_static = ProxyIsStatic(world, i);
     }
   }
 
-  void Draw(World *world) {
-    for (u32 i = 0; i < world->bodies_count; i++) {
-      Body *b = world->bodies + i;
+  // Refreshes the transform cache (rotation matrix and world AABB) of the bodies from first
+  // onwards and refits the broad phase structures that persist across steps.
+  //
+  // NOTE: this is the only place that evaluates sin and cos of body rotations. The
+  // narrow phase, ray casts and Draw all read the cached matrices.
+  void UpdateProxies(World *world, u32 first) {
+    if (first > 0 && first == world->bodies.count) {
+      return;
+    }
 
-      Matrix2x2 rot = Matrix2x2FromAngle(b->rotation);
-      v2 h = b->width * 0.5f;
+    BodiesTask task = {world, first, 0.0f};
+    ThreadPoolParallelFor(world->thread_pool, world->bodies.count - first, PROXY_CHUNK_SIZE,
+                          UpdateProxiesTaskRun, &task);
+    world->transcendental_count += 2 * (world->bodies.count - first);
+    world->proxies_count = world->bodies.count;
+    SyncBroadPhase(world);
+  }
 
-      v2 p1 = rot * (v2){-h.x, -h.y};
-      v2 p2 = rot * (v2){-h.x, +h.y};
-      v2 p3 = rot * (v2){+h.x, +h.y};
-      v2 p4 = rot * (v2){+h.x, -h.y};
+  void BroadPhase(World *world) {
+    // NOTE: proxies are refreshed at the end of every Step, only bodies added since then
+    // need their bounds computed here.
+    UpdateProxies(world, world->proxies_count);
+
+    // NOTE: the candidate pairs only live until the narrow phase is done with them, they
+    // start out with room for a few more than last step.
+    u32 pairs_capacity = world->pairs.pairs_count + world->pairs.pairs_count / 4;
+    PairBufferInit(&world->pairs, world->scratch, Max(pairs_capacity, 256u));
+
+    switch (world->broad_phase_type) {
+      case BROAD_PHASE_GRID: {
+        GridBuild(&world->grid, world->proxies, world->proxies_count);
+        GridQueryPairs(&world->grid, world->proxies, world->proxies_count, &world->pairs);
+      } break;
+      case BROAD_PHASE_TREE: {
+        TreeQueryPairs(&world->tree, world->proxies, world->proxies_count, &world->pairs);
+      } break;
+      case BROAD_PHASE_SAP: {
+        // The overlapping pair set is maintained incrementally by SapUpdate. Bodies removed
+        // since the last update still have to be dropped from it.
+        SapCompact(&world->sap);
+        PairBuffer *pairs = &world->pairs;
+        u32 count = world->sap.pairs.pairs_count;
+        MemoryArenaReserveArray(pairs->arena, &pairs->pairs, &pairs->pairs_capacity, 0, count);
+        MemoryCopy(pairs->pairs, world->sap.pairs.pairs, sizeof(BroadPhasePair) * count);
+        pairs->pairs_count = count;
+      } break;
+    }
+  }
 
-      p1 = p1 + b->position;
-      p2 = p2 + b->position;
-      p3 = p3 + b->position;
-      p4 = p4 + b->position;
+  // Swaps body 1 and 2 of an arbiter, flipping its contacts to match
+  internal void ArbiterFlip(Arbiter *a) {
+    Swap(a->i1, a->i2);
+    Swap(a->next[0], a->next[1]);
+    Swap(a->prev[0], a->prev[1]);
+    for (u32 i = 0; i < a->contacts_count; i++) {
+      Contact *c = a->contacts + i;
+      c->normal = c->normal * -1.0f;
+      Swap(c->r1, c->r2);
+      Swap(c->feature.e.in_edge_1, c->feature.e.in_edge_2);
+      Swap(c->feature.e.out_edge_1, c->feature.e.out_edge_2);
+    }
+  }
 
-      Color c = LIME;
-      PushLine(&game->renderer, p1, p2, c);
-      PushLine(&game->renderer, p2, p3, c);
-      PushLine(&game->renderer, p3, p4, c);
-      PushLine(&game->renderer, p4, p1, c);
-      PushLine(&game->renderer, b->position, b->position + rot * v2{0.10f, 0.0f}, c);
+  // Removes a body and the arbiters that touch it, and wakes the bodies it was touching. The
+  // last body moves into its place so the body arrays stay dense, which changes body indices
+  // but not handles.
+  //
+  // NOTE: this is not O(1). The handle bookkeeping, the body arrays and sweep and prune
+  // (which compacts lazily in its next update) take constant time, but the arbiters of the body
+  // and of the moved last body are visited through their arbiter lists, and the tree removes a
+  // leaf in O(log n).
+  void RemoveBody(World *world, BodyHandle handle) {
+    Bodies *bodies = &world->bodies;
+    ArbiterTable *table = &world->arbiter_table;
+    u32 index = BodyIndex(world, handle);
+    u32 last = bodies->count - 1;
+
+    // NOTE: give every body a proxy first, so that proxies and bodies move together
+    UpdateProxies(world, world->proxies_count);
+
+    // The arbiters of the body go first so that renaming the arbiters of the last body can not
+    // clash with them. Removal unlinks the head of the list.
+    while (table->body_arbiters[index] != 0) {
+      Arbiter *a = table->arbiters + table->body_arbiters[index] - 1;
+      WakeBody(world, a->i1 == index ? a->i2 : a->i1);
+      ArbiterTableRemove(table, a->key);
     }
 
-    for (usize i = 0; i < world->arbiter_table.entries_count; i++) {
-      for (usize j = 0; j < world->arbiter_table.entries[i].value.contacts_count; j++) {
-        PushCircle(&game->renderer, world->arbiter_table.entries[i].value.contacts[j].position,
-                   0.03f, MAGENTA);
+    // The list of the last body becomes the list of index, its arbiters stay where they are in
+    // the dense array and only get a new key
+    if (index != last) {
+      u32 next = table->body_arbiters[last];
+      table->body_arbiters[index] = next;
+      table->body_arbiters[last] = 0;
+      while (next != 0) {
+        Arbiter *a = table->arbiters + next - 1;
+        u32 end = ArbiterEnd(a, last);
+        next = a->next[end];
+        if (end == 0) {
+          a->i1 = index;
+        } else {
+          a->i2 = index;
+        }
+        if (a->i1 > a->i2) {
+          ArbiterFlip(a);
+        }
+        ArbiterTableRekey(table, a, ArbiterKeyFromIndices(a->i1, a->i2));
       }
     }
-  }
 
-  void PrintArbiterTable(World *world) {
-    Log("Arbiters (%ld) {\n", world->arbiter_table.entries_count);
-    // for (u32 i = 0; i < MAX_BODY_COUNT; i++) {
-    //   Log("\t %d:\t %d{\n", world->arbiter_table.hashes[i], world->arbiter_table.);
-    // }
+    if (world->broad_phase_type == BROAD_PHASE_TREE) {
+      TreeRemoveProxy(&world->tree, index);
+    } else if (world->broad_phase_type == BROAD_PHASE_SAP) {
+      SapRemoveProxy(&world->sap, index);
+    }
+
+    if (index != last) {
+      BodyArray arrays[BODY_ARRAYS_COUNT];
+      GetBodyArrays(bodies, arrays);
+      for (u32 i = 0; i < BODY_ARRAYS_COUNT; i++) {
+        u8 *data = (u8 *)*arrays[i].data;
+        u32 size = arrays[i].element_size;
+        MemoryCopy(data + size * index, data + size * last, size);
+      }
+
+      world->proxies[index] = world->proxies[last];
+      world->rotations[index] = world->rotations[last];
+      if (index < world->previous_count) {
+        b32 has_previous = last < world->previous_count;
+        world->previous_positions[index]
+            = has_previous ? world->previous_positions[last] : bodies->position[index];
+        world->previous_rotations[index]
+            = has_previous ? world->previous_rotations[last] : world->rotations[index];
+      }
+
+      u32 moved_slot = world->body_slot[last];
+      world->body_slots[moved_slot].index = index;
+      world->body_slot[index] = moved_slot;
+    }
+
+    bodies->count--;
+    world->proxies_count--;
+    world->previous_count = Min(world->previous_count, bodies->count);
+
+    BodySlot *slot = world->body_slots + handle.index;
+    slot->generation++;
+    slot->index = world->free_body_slot;
+    world->free_body_slot = handle.index;
+  }
+
+  // Returns the bodies whose bounds overlap the region
+  u32 QueryRegion(World *world, AABB region, BodyHandle *out, u32 out_max) {
+    UpdateProxies(world, world->proxies_count);
+
+    u32 count = 0;
+    if (world->broad_phase_type == BROAD_PHASE_TREE) {
+      u32 *candidates = world->query_results;
+      u32 candidates_count
+          = TreeQueryAABB(&world->tree, region, candidates, world->bodies.capacity);
+      for (u32 i = 0; i < candidates_count && count < out_max; i++) {
+        if (AABBOverlap(world->proxies[candidates[i]].aabb, region)) {
+          out[count++] = BodyHandleFromIndex(world, candidates[i]);
+        }
+      }
+    } else {
+      for (u32 i = 0; i < world->proxies_count && count < out_max; i++) {
+        if (AABBOverlap(world->proxies[i].aabb, region)) {
+          out[count++] = BodyHandleFromIndex(world, i);
+        }
+      }
+    }
+
+    return count;
+  }
+
+  // Intersects the segment p1 -> p2 with the box of b, fraction is along the segment
+  internal b32 RayCastBody(World *world, u32 index, v2 p1, v2 p2, f32 *fraction, v2 *normal) {
+    Bodies *bodies = &world->bodies;
+    Matrix2x2 rot = world->rotations[index];
+    Matrix2x2 rotT = Matrix2x2Transpose(rot);
+    v2 h = bodies->width[index] * 0.5f;
+
+    // Slab test in the body's local frame
+    v2 origin = rotT * (p1 - bodies->position[index]);
+    v2 d = rotT * (p2 - p1);
+
+    f32 t_min = 0.0f;
+    f32 t_max = 1.0f;
+    v2 local_normal = Vector2Zero();
+
+    f32 o[2] = {origin.x, origin.y};
+    f32 dir[2] = {d.x, d.y};
+    f32 extent[2] = {h.x, h.y};
+    for (u32 axis = 0; axis < 2; axis++) {
+      if (AbsoluteValue(dir[axis]) < 1e-9f) {
+        if (o[axis] < -extent[axis] || o[axis] > extent[axis]) {
+          return false;
+        }
+        continue;
+      }
+
+      f32 inv_d = 1.0f / dir[axis];
+      f32 t1 = (-extent[axis] - o[axis]) * inv_d;
+      f32 t2 = (extent[axis] - o[axis]) * inv_d;
+      f32 s = -1.0f;
+      if (t1 > t2) {
+        Swap(t1, t2);
+        s = 1.0f;
+      }
+
+      if (t1 > t_min) {
+        t_min = t1;
+        local_normal = axis == 0 ? (v2){s, 0.0f} : (v2){0.0f, s};
+      }
+      t_max = Min(t_max, t2);
+
+      if (t_min > t_max) {
+        return false;
+      }
+    }
+
+    // Segments starting inside the box do not hit it
+    if (t_min <= 0.0f) {
+      return false;
+    }
+
+    *fraction = t_min;
+    *normal = rot * local_normal;
+    return true;
+  }
+
+  // Returns the closest body hit by the segment p1 -> p2
+  RayCastResult RayCast(World *world, v2 p1, v2 p2) {
+    UpdateProxies(world, world->proxies_count);
+
+    RayCastResult result = {};
+    result.fraction = 1.0f;
+
+    u32 *candidates = world->query_results;
+    u32 candidates_count = 0;
+    if (world->broad_phase_type == BROAD_PHASE_TREE) {
+      candidates_count
+          = TreeQuerySegment(&world->tree, p1, p2, candidates, world->bodies.capacity);
+    } else {
+      for (u32 i = 0; i < world->proxies_count; i++) {
+        if (AABBSegmentOverlap(world->proxies[i].aabb, p1, p2)) {
+          candidates[candidates_count++] = i;
+        }
+      }
+    }
+
+    for (u32 i = 0; i < candidates_count; i++) {
+      f32 fraction;
+      v2 normal;
+      if (RayCastBody(world, candidates[i], p1, p2, &fraction, &normal) && fraction < result.fraction) {
+        result.hit = true;
+        result.body = BodyHandleFromIndex(world, candidates[i]);
+        result.fraction = fraction;
+        result.normal = normal;
+      }
+    }
+
+    if (result.hit) {
+      result.point = p1 + (p2 - p1) * result.fraction;
+    }
+
+    return result;
+  }
+
+  // Stores the result of colliding a pair in the arbiter table, an arbiter without contacts
+  // removes the pair
+  internal void NarrowPhaseUpdateArbiter(World *world, u32 i1, u32 i2, Arbiter &arbiter) {
+    ArbiterTable *table = &world->arbiter_table;
+    u64 key = ArbiterKeyFromIndices(i1, i2);
+    Arbiter *iter = ArbiterTableGet(table, key);
+
+    if (arbiter.contacts_count > 0) {
+      world->contacts_count += arbiter.contacts_count;
+      if (arbiter.contacts[0].normal.y < 0.0f) {
+        world->bodies.properties[i1].is_grounded = true;
+      }
+
+      arbiter.last_touched_step = world->step_count;
+      if (iter == nullptr) {
+        ArbiterTableInsert(table, key, arbiter);
+      } else {
+        ArbiterMergeContacts(iter, arbiter);
+        iter->combined_friction = arbiter.combined_friction;
+        iter->last_touched_step = world->step_count;
+      }
+    } else if (iter != nullptr) {
+      ArbiterTableRemove(table, key);
+    }
+  }
+
+  // Collides one chunk of pairs and keeps the touching ones in the scratch arena of the thread.
+  // Only reads the bodies, the arbiter table is updated afterwards in pair order.
+  internal void NarrowPhaseTaskRun(void *data, u32 begin, u32 end, u32 thread_index) {
+    World *world = (World *)data;
+    Bodies *bodies = &world->bodies;
+    MemoryArena *scratch = ThreadPoolScratch(world->thread_pool, thread_index);
+
+    NarrowPhaseChunk *chunk = world->narrow_phase_chunks + begin / NARROW_PHASE_CHUNK_SIZE;
+    chunk->results = (NarrowPhaseResult *)MemoryArenaPush(scratch, sizeof(NarrowPhaseResult)
+                                                                       * (end - begin));
+    chunk->results_count = 0;
+
+    BoxPairAxis axes[NARROW_PHASE_CHUNK_SIZE];
+    CollideFindAxes(world, world->pairs.pairs + begin, end - begin, axes);
+    for (u32 i = begin; i < end; i++) {
+      u32 i1 = world->pairs.pairs[i].a;
+      u32 i2 = world->pairs.pairs[i].b;
+      if (axes[i - begin].axis == NO_AXIS
+          || (!BodyIsAwake(bodies, i1) && !BodyIsAwake(bodies, i2))) {
+        continue;
+      }
+
+      Arbiter arbiter = Collide(world, i1, i2, axes[i - begin]);
+      if (arbiter.contacts_count > 0) {
+        chunk->results[chunk->results_count++] = {i, arbiter};
+      }
+    }
+
+    // NOTE: the chunk is the last thing pushed onto this scratch arena
+    u32 unused_count = (end - begin) - chunk->results_count;
+    MemoryArenaPop(scratch, sizeof(NarrowPhaseResult) * unused_count);
+  }
+
+  // Arbiters persist across steps so that the accumulated impulses can warm start the solver.
+  // They are created when a pair starts touching, merged through the feature pairs while it
+  // keeps touching and removed once it separates or leaves the broad phase.
+  //
+  // With a thread pool the pairs are collided in parallel and the results are applied to the
+  // arbiter table in pair order afterwards, the same order as without one.
+  void NarrowPhase(World *world) {
+    ArbiterTable *table = &world->arbiter_table;
+    Bodies *bodies = &world->bodies;
+    u32 pairs_count = world->pairs.pairs_count;
+
+    if (world->thread_pool) {
+      u32 chunks_count = (pairs_count + NARROW_PHASE_CHUNK_SIZE - 1) / NARROW_PHASE_CHUNK_SIZE;
+      world->narrow_phase_chunks = (NarrowPhaseChunk *)MemoryArenaPush(
+          world->scratch, sizeof(NarrowPhaseChunk) * chunks_count);
+      ThreadPoolClearScratch(world->thread_pool);
+      ThreadPoolParallelFor(world->thread_pool, pairs_count, NARROW_PHASE_CHUNK_SIZE,
+                            NarrowPhaseTaskRun, world);
+
+      for (u32 chunk_index = 0; chunk_index < chunks_count; chunk_index++) {
+        NarrowPhaseChunk *chunk = world->narrow_phase_chunks + chunk_index;
+        u32 begin = chunk_index * NARROW_PHASE_CHUNK_SIZE;
+        u32 end = Min(begin + NARROW_PHASE_CHUNK_SIZE, pairs_count);
+
+        u32 result_index = 0;
+        for (u32 i = begin; i < end; i++) {
+          u32 i1 = world->pairs.pairs[i].a;
+          u32 i2 = world->pairs.pairs[i].b;
+          if (!BodyIsAwake(bodies, i1) && !BodyIsAwake(bodies, i2)) {
+            continue;
+          }
+
+          Arbiter none = {};
+          NarrowPhaseResult *result = chunk->results + result_index;
+          if (result_index < chunk->results_count && result->pair_index == i) {
+            NarrowPhaseUpdateArbiter(world, i1, i2, result->arbiter);
+            result_index++;
+          } else {
+            NarrowPhaseUpdateArbiter(world, i1, i2, none);
+          }
+        }
+      }
+    } else {
+      // NOTE: the separating axis test runs over a batch of pairs first, only pairs that
+      // overlap go through the branchy clipping.
+      BoxPairAxis axes[NARROW_PHASE_CHUNK_SIZE];
+      for (u32 i = 0; i < pairs_count; i++) {
+        u32 batch_index = i % ArrayCount(axes);
+        if (batch_index == 0) {
+          u32 batch_count = Min(pairs_count - i, (u32)ArrayCount(axes));
+          CollideFindAxes(world, world->pairs.pairs + i, batch_count, axes);
+        }
+
+        u32 i1 = world->pairs.pairs[i].a;
+        u32 i2 = world->pairs.pairs[i].b;
+        if (!BodyIsAwake(bodies, i1) && !BodyIsAwake(bodies, i2)) {
+          continue;  // the arbiter of a sleeping pair is kept as it is below
+        }
+
+        Arbiter arbiter = Collide(world, i1, i2, axes[batch_index]);
+        NarrowPhaseUpdateArbiter(world, i1, i2, arbiter);
+      }
+    }
+
+    // Remove arbiters whose pair is no longer reported by the broad phase. Iterate backwards,
+    // removal moves the last arbiter into the hole.
+    for (i64 i = (i64)table->arbiters_count - 1; i >= 0; i--) {
+      Arbiter *a = table->arbiters + i;
+      if (a->last_touched_step == world->step_count) {
+        continue;
+      }
+
+      if (BodyIsAwake(bodies, a->i1) || BodyIsAwake(bodies, a->i2)) {
+        ArbiterTableRemove(table, a->key);
+      } else if (a->contacts[0].normal.y < 0.0f) {
+        bodies->properties[a->i1].is_grounded = true;
+      }
+    }
+  }
+
+  inline u32 IslandFind(u32 *parent, u32 index) {
+    while (parent[index] != index) {
+      parent[index] = parent[parent[index]];  // path halving
+      index = parent[index];
+    }
+    return index;
+  }
+
+  // Radix sorts the arbiter indices by key into world->arbiter_order, a byte at a time and
+  // skipping the bytes that are the same for every key
+  internal void SortArbitersByKey(World *world) {
+    ArbiterTable *table = &world->arbiter_table;
+    u32 count = table->arbiters_count;
+
+    u32 *order = (u32 *)MemoryArenaPush(world->scratch, sizeof(u32) * count);
+    u32 *scratch = (u32 *)MemoryArenaPush(world->scratch, sizeof(u32) * count);
+    for (u32 i = 0; i < count; i++) {
+      order[i] = i;
+    }
+
+    for (u32 shift = 0; shift < 64; shift += 8) {
+      u32 offsets[256] = {};
+      for (u32 i = 0; i < count; i++) {
+        offsets[(table->arbiters[i].key >> shift) & 0xff]++;
+      }
+      if (count == 0 || offsets[(table->arbiters[0].key >> shift) & 0xff] == count) {
+        continue;
+      }
+
+      u32 start = 0;
+      for (u32 digit = 0; digit < 256; digit++) {
+        u32 digit_count = offsets[digit];
+        offsets[digit] = start;
+        start += digit_count;
+      }
+      for (u32 i = 0; i < count; i++) {
+        u32 index = order[i];
+        scratch[offsets[(table->arbiters[index].key >> shift) & 0xff]++] = index;
+      }
+
+      u32 *swap = order;
+      order = scratch;
+      scratch = swap;
+    }
+
+    world->arbiter_order = order;
+  }
+
+  // Groups the dynamic bodies into islands through the arbiters and lists the arbiters island by
+  // island in world->island_arbiters.
+  //
+  // The union-find root of a set is its smallest body index, so islands are numbered in body
+  // order and the arbiters of an island keep their arbiter table order. An island with any
+  // awake body wakes up as a whole, that is how a sleeping pile notices something touching it.
+  void BuildIslands(World *world) {
+    ArbiterTable *table = &world->arbiter_table;
+    Bodies *bodies = &world->bodies;
+    u32 *parent = world->island_parent;
+
+    for (u32 i = 0; i < bodies->count; i++) {
+      parent[i] = i;
+    }
+    for (u32 i = 0; i < table->arbiters_count; i++) {
+      Arbiter *a = table->arbiters + i;
+      if (bodies->inv_mass[a->i1] > 0.0f && bodies->inv_mass[a->i2] > 0.0f) {
+        u32 root1 = IslandFind(parent, a->i1);
+        u32 root2 = IslandFind(parent, a->i2);
+        if (root1 < root2) {
+          parent[root2] = root1;
+        } else {
+          parent[root1] = root2;
+        }
+      }
+    }
+
+    world->islands = (Island *)MemoryArenaPush(world->scratch, sizeof(Island) * bodies->count);
+    world->islands_count = 0;
+    for (u32 i = 0; i < bodies->count; i++) {
+      if (bodies->inv_mass[i] == 0.0f) {
+        continue;
+      }
+
+      u32 root = IslandFind(parent, i);
+      if (root == i) {
+        world->island_index[i] = world->islands_count;
+        world->islands[world->islands_count++] = {};
+      } else {
+        world->island_index[i] = world->island_index[root];
+      }
+
+      if (!bodies->is_sleeping[i]) {
+        world->islands[world->island_index[i]].awake_count++;
+      }
+    }
+
+    for (u32 i = 0; i < bodies->count; i++) {
+      if (bodies->is_sleeping[i] && world->islands[world->island_index[i]].awake_count > 0) {
+        WakeBody(world, i);
+      }
+    }
+
+    // Counting sort of the arbiters by island
+    for (u32 i = 0; i < table->arbiters_count; i++) {
+      Arbiter *a = table->arbiters + i;
+      u32 body = bodies->inv_mass[a->i1] > 0.0f ? a->i1 : a->i2;
+      world->islands[world->island_index[body]].arbiters_count++;
+    }
+
+    u32 first_arbiter = 0;
+    for (u32 i = 0; i < world->islands_count; i++) {
+      Island *island = world->islands + i;
+      island->first_arbiter = first_arbiter;
+      island->is_sleeping = island->awake_count == 0;
+      first_arbiter += island->arbiters_count;
+      island->arbiters_count = 0;
+    }
+
+    // NOTE: the arbiter table order depends on when pairs started touching, in
+    // deterministic mode the islands list their arbiters by key instead.
+    u32 *order = 0;
+    if (world->deterministic) {
+      SortArbitersByKey(world);
+      order = world->arbiter_order;
+    }
+
+    world->island_arbiters
+        = (u32 *)MemoryArenaPush(world->scratch, sizeof(u32) * table->arbiters_count);
+    for (u32 k = 0; k < table->arbiters_count; k++) {
+      u32 i = order ? order[k] : k;
+      Arbiter *a = table->arbiters + i;
+      u32 body = bodies->inv_mass[a->i1] > 0.0f ? a->i1 : a->i2;
+      Island *island = world->islands + world->island_index[body];
+      world->island_arbiters[island->first_arbiter + island->arbiters_count++] = i;
+    }
+  }
+
+  // Puts islands to sleep once all of their bodies stayed below the sleep tolerances for
+  // world->time_to_sleep seconds. Runs on the solved velocities before they are integrated, so
+  // a body that falls asleep does not move in the step it falls asleep.
+  void UpdateSleep(World *world, f32 dt) {
+    if (world->time_to_sleep <= 0.0f) {
+      return;
+    }
+
+    Bodies *bodies = &world->bodies;
+    f32 linear_tolerance_sq = world->sleep_linear_tolerance * world->sleep_linear_tolerance;
+    f32 angular_tolerance_sq = world->sleep_angular_tolerance * world->sleep_angular_tolerance;
+
+    for (u32 i = 0; i < world->islands_count; i++) {
+      world->islands[i].min_sleep_time = F32_Max;
+    }
+
+    for (u32 i = 0; i < bodies->count; i++) {
+      if (!BodyIsAwake(bodies, i)) {
+        continue;
+      }
+
+      v2 velocity = bodies->velocity[i];
+      f32 angular_velocity = bodies->angular_velocity[i];
+      if (Vector2DotProduct(velocity, velocity) > linear_tolerance_sq
+          || angular_velocity * angular_velocity > angular_tolerance_sq) {
+        bodies->sleep_time[i] = 0.0f;
+      } else {
+        bodies->sleep_time[i] += dt;
+      }
+
+      Island *island = world->islands + world->island_index[i];
+      island->min_sleep_time = Min(island->min_sleep_time, bodies->sleep_time[i]);
+    }
+
+    for (u32 i = 0; i < bodies->count; i++) {
+      if (BodyIsAwake(bodies, i)
+          && world->islands[world->island_index[i]].min_sleep_time >= world->time_to_sleep) {
+        bodies->is_sleeping[i] = true;
+        bodies->velocity[i] = Vector2Zero();
+        bodies->angular_velocity[i] = 0.0f;
+      }
+    }
+  }
+
+  // Splits the arbiters of the islands marked solve_colored into colors such that no two
+  // arbiters of a color share a dynamic body, and lists them color by color in
+  // world->solver_order.
+  //
+  // Greedy first fit in island order, so the coloring only depends on the arbiter order and
+  // not on the thread count. Static bodies take no part, otherwise every arbiter against the
+  // ground would need its own color. Arbiters that find no free color out of SOLVER_MAX_COLORS
+  // end up in an overflow batch that is solved on one thread.
+  void ColorArbiters(World *world) {
+    ArbiterTable *table = &world->arbiter_table;
+    Bodies *bodies = &world->bodies;
+
+    world->solver_order
+        = (u32 *)MemoryArenaPush(world->scratch, sizeof(u32) * table->arbiters_count);
+    MemorySet(world->body_colors, 0, sizeof(u64) * bodies->count);
+
+    u32 color_counts[SOLVER_MAX_COLORS + 1] = {};
+    for (u32 island_index = 0; island_index < world->islands_count; island_index++) {
+      Island *island = world->islands + island_index;
+      if (!island->solve_colored) {
+        continue;
+      }
+
+      for (u32 i = 0; i < island->arbiters_count; i++) {
+        Arbiter *a = table->arbiters + world->island_arbiters[island->first_arbiter + i];
+        b32 dynamic1 = bodies->inv_mass[a->i1] > 0.0f;
+        b32 dynamic2 = bodies->inv_mass[a->i2] > 0.0f;
+
+        u64 used = 0;
+        if (dynamic1) {
+          used |= world->body_colors[a->i1];
+        }
+        if (dynamic2) {
+          used |= world->body_colors[a->i2];
+        }
+
+        if (used == ~0ull) {
+          a->color = SOLVER_MAX_COLORS;
+        } else {
+          a->color = (u32)__builtin_ctzll(~used);
+          u64 bit = 1ull << a->color;
+          if (dynamic1) {
+            world->body_colors[a->i1] |= bit;
+          }
+          if (dynamic2) {
+            world->body_colors[a->i2] |= bit;
+          }
+        }
+        color_counts[a->color]++;
+      }
+    }
+
+    // Counting sort by color, stable so the order within a color follows the islands
+    u32 start = 0;
+    world->colors_count = 0;
+    for (u32 color = 0; color <= SOLVER_MAX_COLORS; color++) {
+      world->color_start[color] = start;
+      start += color_counts[color];
+      if (color < SOLVER_MAX_COLORS && color_counts[color] > 0) {
+        world->colors_count = color + 1;
+      }
+    }
+    world->color_start[SOLVER_MAX_COLORS + 1] = start;
+
+    u32 cursor[SOLVER_MAX_COLORS + 1];
+    MemoryCopy(cursor, world->color_start, sizeof(cursor));
+    for (u32 island_index = 0; island_index < world->islands_count; island_index++) {
+      Island *island = world->islands + island_index;
+      if (!island->solve_colored) {
+        continue;
+      }
+
+      for (u32 i = 0; i < island->arbiters_count; i++) {
+        u32 arbiter_index = world->island_arbiters[island->first_arbiter + i];
+        world->solver_order[cursor[table->arbiters[arbiter_index].color]++] = arbiter_index;
+      }
+    }
+  }
+
+  // What a solver task does to each arbiter it visits
+  enum SolverPass {
+    SOLVER_PASS_PRE_STEP,  // SOLVER_ITERATIONS
+    SOLVER_PASS_ITERATE,
+    SOLVER_PASS_SPLIT_IMPULSE,  // split impulses, iterated like SOLVER_PASS_ITERATE
+    SOLVER_PASS_PREPARE_SUBSTEPS,  // SOLVER_SUBSTEP
+    SOLVER_PASS_WARM_START,
+    SOLVER_PASS_SOLVE,
+    SOLVER_PASS_RELAX,
+  };
+
+  internal b32 SolverPassIsIterated(SolverPass pass) {
+    return pass == SOLVER_PASS_ITERATE || pass == SOLVER_PASS_SPLIT_IMPULSE;
+  }
+
+  struct SolverTask {
+    World *world;
+    const u32 *order;  // arbiter indices of the color being solved
+    SolverPass pass;
+    u32 max_iterations;  // of an iterated pass
+    f32 inv_dt;  // of the substep in SOLVER_SUBSTEP
+    SoftContact soft;
+    f32 max_change[THREAD_POOL_MAX_THREADS];  // per thread, see ArbiterApplyImpulse
+  };
+
+  // Returns the velocity change of the iterated passes, 0 for the other passes
+  internal f32 ArbiterRunPass(SolverTask *task, Arbiter *a) {
+    World *world = task->world;
+    switch (task->pass) {
+      case SOLVER_PASS_PRE_STEP: ArbiterPreStep(world, a, task->inv_dt); break;
+      case SOLVER_PASS_ITERATE: return ArbiterApplyImpulse(world, a);
+      case SOLVER_PASS_SPLIT_IMPULSE: return ArbiterApplySplitImpulse(world, a);
+      case SOLVER_PASS_PREPARE_SUBSTEPS: ArbiterPrepareSubsteps(world, a); break;
+      case SOLVER_PASS_WARM_START: ArbiterWarmStart(world, a); break;
+      case SOLVER_PASS_SOLVE: ArbiterSolveSoft(world, a, task->soft, task->inv_dt, true); break;
+      case SOLVER_PASS_RELAX: ArbiterSolveSoft(world, a, task->soft, task->inv_dt, false); break;
+    }
+    return 0.0f;
+  }
+
+  internal void SolverTaskRun(void *data, u32 begin, u32 end, u32 thread_index) {
+    SolverTask *task = (SolverTask *)data;
+    Arbiter *arbiters = task->world->arbiter_table.arbiters;
+    f32 max_change = task->max_change[thread_index];
+    for (u32 i = begin; i < end; i++) {
+      f32 change = ArbiterRunPass(task, arbiters + task->order[i]);
+      max_change = Max(max_change, change);
+    }
+    task->max_change[thread_index] = max_change;
+  }
+
+  // Runs one pass over the colored arbiters, one color after the other. The arbiters are
+  // visited in the same order whatever the number of threads, and arbiters of one color touch
+  // disjoint bodies, so the result does not depend on the thread count. Returns the largest
+  // velocity change of the pass.
+  internal f32 SolveColors(World *world, SolverPass pass, f32 inv_dt, SoftContact soft) {
+    f32 max_change = 0.0f;
+    for (u32 color = 0; color <= SOLVER_MAX_COLORS; color++) {
+      u32 begin = world->color_start[color];
+      u32 count = world->color_start[color + 1] - begin;
+      if (count == 0) {
+        continue;
+      }
+
+      SolverTask task = {world, world->solver_order + begin, pass, 0, inv_dt, soft, {}};
+      if (color == SOLVER_MAX_COLORS || count < SOLVER_PARALLEL_MIN_BATCH) {
+        SolverTaskRun(&task, 0, count, 0);
+      } else {
+        ThreadPoolParallelFor(world->thread_pool, count, SOLVER_CHUNK_SIZE, SolverTaskRun, &task);
+      }
+
+      u32 threads_count = world->thread_pool ? world->thread_pool->threads_count : 1;
+      for (u32 i = 0; i < threads_count; i++) {
+        max_change = Max(max_change, task.max_change[i]);
+      }
+    }
+    return max_change;
+  }
+
+  // Runs a pass over whole islands, one island per index. The iterated passes run all the
+  // iterations of an island.
+  internal void IslandTaskRun(void *data, u32 begin, u32 end, u32 /* thread_index */) {
+    SolverTask *task = (SolverTask *)data;
+    World *world = task->world;
+    Arbiter *arbiters = world->arbiter_table.arbiters;
+
+    for (u32 island_index = begin; island_index < end; island_index++) {
+      Island *island = world->islands + world->solver_islands[island_index];
+      const u32 *order = world->island_arbiters + island->first_arbiter;
+
+      if (!SolverPassIsIterated(task->pass)) {
+        for (u32 i = 0; i < island->arbiters_count; i++) {
+          ArbiterRunPass(task, arbiters + order[i]);
+        }
+        continue;
+      }
+      island->iterations = 0;
+      while (island->iterations < task->max_iterations) {
+        f32 max_change = 0.0f;
+        for (u32 i = 0; i < island->arbiters_count; i++) {
+          f32 change = ArbiterRunPass(task, arbiters + order[i]);
+          max_change = Max(max_change, change);
+        }
+        island->iterations++;
+        if (max_change < world->solver_tolerance) {
+          break;
+        }
+      }
+    }
+  }
+
+  // NOTE: visiting the arbiters island by island or color by color costs cache misses,
+  // on one thread it is enough to skip sleeping arbiters in table order. Islands are
+  // independent, so this matches solving them one after the other.
+  internal b32 SolveInTableOrder(World *world) {
+    return !world->thread_pool && !world->deterministic;
+  }
+
+  // Splits the awake islands into the ones solved as one task and the colored ones
+  internal void PrepareSolverIslands(World *world) {
+    world->solver_islands
+        = (u32 *)MemoryArenaPush(world->scratch, sizeof(u32) * world->islands_count);
+    world->solver_islands_count = 0;
+    for (u32 i = 0; i < world->islands_count; i++) {
+      Island *island = world->islands + i;
+      island->solve_colored = false;
+      if (island->is_sleeping || island->arbiters_count == 0) {
+        continue;
+      }
+
+      if (island->arbiters_count >= SOLVER_ISLAND_COLOR_MIN && !world->deterministic) {
+        island->solve_colored = true;
+      } else {
+        world->solver_islands[world->solver_islands_count++] = i;
+      }
+    }
+    ColorArbiters(world);
+  }
+
+  // Runs a single pass over the awake arbiters, see IterateSolverPass for the iterated ones.
+  //
+  // NOTE: islands share no dynamic body, so running a pass over all of them before the
+  // next pass over any gives the same results as solving them one after the other.
+  internal void RunSolverPass(World *world, SolverPass pass, f32 inv_dt, SoftContact soft) {
+    Assert(!SolverPassIsIterated(pass));
+    SolverTask task = {world, 0, pass, 0, inv_dt, soft, {}};
+
+    if (SolveInTableOrder(world)) {
+      ArbiterTable *table = &world->arbiter_table;
+      Bodies *bodies = &world->bodies;
+      for (u32 i = 0; i < table->arbiters_count; i++) {
+        Arbiter *a = table->arbiters + i;
+        if (BodyIsAwake(bodies, a->i1) || BodyIsAwake(bodies, a->i2)) {
+          ArbiterRunPass(&task, a);
+        }
+      }
+      return;
+    }
+
+    ThreadPoolParallelFor(world->thread_pool, world->solver_islands_count, 1, IslandTaskRun,
+                          &task);
+    SolveColors(world, pass, inv_dt, soft);
+  }
+
+  // Repeats an iterated pass over the awake arbiters until an iteration changes no relative
+  // contact velocity by world->solver_tolerance or more, or max_iterations ran. Returns the
+  // most iterations an island took.
+  internal u32 IterateSolverPass(World *world, SolverPass pass, u32 max_iterations, f32 inv_dt) {
+    SolverTask task = {world, 0, pass, max_iterations, inv_dt, {}, {}};
+    u32 iterations = 0;
+
+    if (SolveInTableOrder(world)) {
+      ArbiterTable *table = &world->arbiter_table;
+      Bodies *bodies = &world->bodies;
+      while (iterations < max_iterations) {
+        f32 max_change = 0.0f;
+        for (u32 i = 0; i < table->arbiters_count; i++) {
+          Arbiter *a = table->arbiters + i;
+          if (BodyIsAwake(bodies, a->i1) || BodyIsAwake(bodies, a->i2)) {
+            f32 change = ArbiterRunPass(&task, a);
+            max_change = Max(max_change, change);
+          }
+        }
+        iterations++;
+        if (max_change < world->solver_tolerance) {
+          break;
+        }
+      }
+      return iterations;
+    }
+
+    ThreadPoolParallelFor(world->thread_pool, world->solver_islands_count, 1, IslandTaskRun,
+                          &task);
+    for (u32 i = 0; i < world->solver_islands_count; i++) {
+      Island *island = world->islands + world->solver_islands[i];
+      iterations = Max(iterations, island->iterations);
+    }
+
+    // NOTE: the colored islands converge together, they are solved one color at a time
+    // across all of them
+    b32 has_colored = world->color_start[SOLVER_MAX_COLORS + 1] > 0;
+    for (u32 colored = 1; has_colored && colored <= max_iterations; colored++) {
+      f32 max_change = SolveColors(world, pass, inv_dt, {});
+      iterations = Max(iterations, colored);
+      if (max_change < world->solver_tolerance) {
+        break;
+      }
+    }
+    return iterations;
+  }
+
+  // Solves the arbiters of the awake islands. Islands share no dynamic body, so with a thread
+  // pool every small island is one task and the large ones are split into colors. In
+  // deterministic mode every island is solved in key order as one task, with or without a
+  // thread pool, which gives up parallelism inside large islands.
+  internal void SolveIslands(World *world, f32 inv_dt) {
+    Bodies *bodies = &world->bodies;
+    world->solver_iterations = 0;
+    world->solver_position_iterations = 0;
+    world->bias_velocities = 0;
+    world->bias_angular_velocities = 0;
+
+    if (world->split_impulses) {
+      world->bias_velocities = (v2 *)MemoryArenaPush(world->scratch, sizeof(v2) * bodies->count);
+      world->bias_angular_velocities
+          = (f32 *)MemoryArenaPush(world->scratch, sizeof(f32) * bodies->count);
+      MemorySet(world->bias_velocities, 0, sizeof(v2) * bodies->count);
+      MemorySet(world->bias_angular_velocities, 0, sizeof(f32) * bodies->count);
+    }
+
+    if (!SolveInTableOrder(world)) {
+      PrepareSolverIslands(world);
+    }
+    {
+      ProfileScope(world, PROFILE_PRE_STEP);
+      RunSolverPass(world, SOLVER_PASS_PRE_STEP, inv_dt, {});
+    }
+
+    ProfileScope(world, PROFILE_ITERATIONS);
+    world->solver_iterations
+        = IterateSolverPass(world, SOLVER_PASS_ITERATE, (u32)world->iterations, inv_dt);
+
+    if (world->split_impulses) {
+      world->solver_position_iterations = IterateSolverPass(
+          world, SOLVER_PASS_SPLIT_IMPULSE, (u32)world->position_iterations, inv_dt);
+    }
+  }
+
+  internal void IntegrateForcesTaskRun(void *data, u32 begin, u32 end, u32 /* thread_index */) {
+    BodiesTask *task = (BodiesTask *)data;
+    World *world = task->world;
+    Bodies *bodies = &world->bodies;
+    f32 dt = task->dt;
+
+    // NOTE: branch free so the loops vectorize, static bodies have zero inverse mass and
+    // inertia and sleeping bodies have no force or torque, so only gravity has to be masked out.
+    for (u32 i = begin; i < end; i++) {
+      f32 inv_mass = bodies->inv_mass[i];
+      f32 gravity_scale = BodyIsAwake(bodies, i) ? 1.0f : 0.0f;
+      bodies->velocity[i] += (world->gravity * gravity_scale + bodies->force[i] * inv_mass) * dt;
+    }
+    for (u32 i = begin; i < end; i++) {
+      bodies->angular_velocity[i] += (bodies->torque[i] * bodies->inv_inertia[i]) * dt;
+    }
+  }
+
+  internal void IntegrateVelocitiesTaskRun(void *data, u32 begin, u32 end,
+                                           u32 /* thread_index */) {
+    BodiesTask *task = (BodiesTask *)data;
+    Bodies *bodies = &task->world->bodies;
+    f32 dt = task->dt;
+
+    for (u32 i = begin; i < end; i++) {
+      bodies->position[i] += bodies->velocity[i] * dt;
+    }
+    for (u32 i = begin; i < end; i++) {
+      bodies->rotation[i] += bodies->angular_velocity[i] * dt;
+    }
+    if (task->world->bias_velocities) {
+      World *world = task->world;
+      for (u32 i = begin; i < end; i++) {
+        bodies->position[i] += world->bias_velocities[i] * dt;
+      }
+      for (u32 i = begin; i < end; i++) {
+        bodies->rotation[i] += world->bias_angular_velocities[i] * dt;
+      }
+    }
+    MemorySet(bodies->force + begin, 0, sizeof(v2) * (end - begin));
+    MemorySet(bodies->torque + begin, 0, sizeof(f32) * (end - begin));
+  }
+
+  // IntegrateVelocitiesTaskRun of a substep, which also tracks how far the bodies moved for
+  // ArbiterSolveSoft. Forces stay until the last substep.
+  internal void IntegrateSubstepTaskRun(void *data, u32 begin, u32 end, u32 /* thread_index */) {
+    BodiesTask *task = (BodiesTask *)data;
+    World *world = task->world;
+    Bodies *bodies = &world->bodies;
+    f32 h = task->dt;
+
+    for (u32 i = begin; i < end; i++) {
+      v2 delta_position = bodies->velocity[i] * h;
+      bodies->position[i] += delta_position;
+      world->delta_positions[i] += delta_position;
+    }
+    for (u32 i = begin; i < end; i++) {
+      f32 delta_angle = bodies->angular_velocity[i] * h;
+      bodies->rotation[i] += delta_angle;
+
+      // NOTE: first order update of the cosine and sine, renormalized, so that the
+      // substeps do not evaluate sin and cos
+      v2 q = world->delta_rotations[i];
+      q += v2{-q.y, q.x} * delta_angle;
+      world->delta_rotations[i] = q * (1.0f / sqrtf(q.x * q.x + q.y * q.y));
+    }
+  }
+
+  // SOLVER_SUBSTEP: instead of iterating over all contacts at the full step, the step is split
+  // into world->solver_substeps substeps that each integrate gravity, warm start, run one pass
+  // of soft contacts and integrate the positions. Contacts are not collided again, their
+  // separation follows the bodies through delta_positions and delta_rotations. A final relax
+  // pass without the push out bias takes out the velocity it added.
+  //
+  // Every substep sees the bodies where the previous one left them, so tall stacks come to
+  // rest with a few substeps where many iterations keep them jittering. Contacts are springs,
+  // so resting contacts sink in a little deeper than with rigid iterations.
+  internal void SolveSubsteps(World *world, f32 dt) {
+    Bodies *bodies = &world->bodies;
+    u32 substeps = Max(world->solver_substeps, 1u);
+    f32 h = dt / substeps;
+    f32 inv_h = h > 0.0f ? 1.0f / h : 0.0f;
+    world->solver_iterations = substeps;
+
+    world->delta_positions = (v2 *)MemoryArenaPush(world->scratch, sizeof(v2) * bodies->count);
+    world->delta_rotations = (v2 *)MemoryArenaPush(world->scratch, sizeof(v2) * bodies->count);
+    MemorySet(world->delta_positions, 0, sizeof(v2) * bodies->count);
+    for (u32 i = 0; i < bodies->count; i++) {
+      world->delta_rotations[i] = {1.0f, 0.0f};
+    }
+
+    // NOTE: contact hertz is capped at a quarter of the substep rate, stiffer contacts
+    // would overshoot within a substep
+    f32 contact_hertz = Min(30.0f, 0.25f * inv_h);
+    SoftContact soft = MakeSoftContact(contact_hertz, 10.0f, h);
+
+    if (!SolveInTableOrder(world)) {
+      PrepareSolverIslands(world);
+    }
+    {
+      ProfileScope(world, PROFILE_PRE_STEP);
+      RunSolverPass(world, SOLVER_PASS_PREPARE_SUBSTEPS, inv_h, soft);
+    }
+
+    ProfileScope(world, PROFILE_ITERATIONS);
+    BodiesTask task = {world, 0, h};
+    for (u32 substep = 0; substep < substeps; substep++) {
+      ThreadPoolParallelFor(world->thread_pool, bodies->count, INTEGRATE_CHUNK_SIZE,
+                            IntegrateForcesTaskRun, &task);
+      RunSolverPass(world, SOLVER_PASS_WARM_START, inv_h, soft);
+      RunSolverPass(world, SOLVER_PASS_SOLVE, inv_h, soft);
+      ThreadPoolParallelFor(world->thread_pool, bodies->count, INTEGRATE_CHUNK_SIZE,
+                            IntegrateSubstepTaskRun, &task);
+    }
+    RunSolverPass(world, SOLVER_PASS_RELAX, inv_h, soft);
+
+    MemorySet(bodies->force, 0, sizeof(v2) * bodies->count);
+    MemorySet(bodies->torque, 0, sizeof(f32) * bodies->count);
+  }
+
+  // Hash of the state of every body, chained onto seed. Two worlds that agree on it agree bit
+  // for bit on where their bodies are and where they are going.
+  u64 BodiesStateHash(World *world, u64 seed) {
+    Bodies *bodies = &world->bodies;
+    u64 hash = murmur64_seed(&bodies->count, sizeof(bodies->count), seed);
+    hash = murmur64_seed(bodies->position, sizeof(v2) * bodies->count, hash);
+    hash = murmur64_seed(bodies->rotation, sizeof(f32) * bodies->count, hash);
+    hash = murmur64_seed(bodies->velocity, sizeof(v2) * bodies->count, hash);
+    hash = murmur64_seed(bodies->angular_velocity, sizeof(f32) * bodies->count, hash);
+    hash = murmur64_seed(bodies->sleep_time, sizeof(f32) * bodies->count, hash);
+    hash = murmur64_seed(bodies->is_sleeping, sizeof(b32) * bodies->count, hash);
+    return hash;
+  }
+
+  // Advances the world by exactly dt. Most callers want Advance instead.
+  //
+  // In deterministic mode a step only depends on the state of the world: every step has to be
+  // world->fixed_dt long, and the solver visits the arbiters in key order instead of arbiter
+  // table order, so a world that took a different route to the same state and any thread count
+  // give the same results. Reproducing them on another machine also takes the same build,
+  // compiled with -ffp-contract=off as build.sh does, and the same sinf and cosf.
+  void Step(World *world, f32 dt) {
+    Assert(!world->deterministic || dt == world->fixed_dt);
+    f32 inv_dt = dt > 0.0f ? 1.0f / dt : 0.0f;
+
+    MemoryArenaTemp scratch = MemoryArenaTempBegin(world->scratch);
+    Defer(MemoryArenaTempEnd(scratch));
+    u64 push_count = world->arena->push_count;
+    u64 commit_count = world->scratch->commit_count;
+
+    //
+    world->step_count++;
+    world->transcendental_count = 0;
+    world->contacts_count = 0;
+    ProfileBeginStep(world);
+    Bodies *bodies = &world->bodies;
+    for (u32 i = 0; i < bodies->count; i++) {
+      bodies->properties[i].is_grounded = false;
+
+      v2 force = bodies->force[i];
+      b32 pushed = force.x != 0.0f || force.y != 0.0f || bodies->torque[i] != 0.0f;
+      if (bodies->is_sleeping[i] && pushed) {
+        WakeBody(world, i);
+      }
+    }
+
+    // Keep the poses at the start of the step around for interpolation
+    UpdateProxies(world, world->proxies_count);
+    MemoryCopy(world->previous_positions, bodies->position, sizeof(v2) * bodies->count);
+    MemoryCopy(world->previous_rotations, world->rotations, sizeof(Matrix2x2) * bodies->count);
+    world->previous_count = bodies->count;
+
+    //
+    {
+      ProfileScope(world, PROFILE_BROAD_PHASE);
+      BroadPhase(world);
+    }
+    {
+      ProfileScope(world, PROFILE_NARROW_PHASE);
+      NarrowPhase(world);
+    }
+
+    if (world->solver_type == SOLVER_SUBSTEP) {
+      // NOTE: the substeps integrate forces and velocities themselves
+      {
+        ProfileScope(world, PROFILE_ISLANDS);
+        BuildIslands(world);
+      }
+      SolveSubsteps(world, dt);
+      {
+        ProfileScope(world, PROFILE_SLEEP);
+        UpdateSleep(world, dt);
+      }
+    } else {
+      BodiesTask task = {world, 0, dt};
+      {
+        ProfileScope(world, PROFILE_INTEGRATE_FORCES);
+        ThreadPoolParallelFor(world->thread_pool, bodies->count, INTEGRATE_CHUNK_SIZE,
+                              IntegrateForcesTaskRun, &task);
+      }
+      {
+        ProfileScope(world, PROFILE_ISLANDS);
+        BuildIslands(world);
+      }
+      SolveIslands(world, inv_dt);
+      {
+        ProfileScope(world, PROFILE_SLEEP);
+        UpdateSleep(world, dt);
+      }
+      {
+        ProfileScope(world, PROFILE_INTEGRATE_VELOCITIES);
+        ThreadPoolParallelFor(world->thread_pool, bodies->count, INTEGRATE_CHUNK_SIZE,
+                              IntegrateVelocitiesTaskRun, &task);
+      }
+    }
+    {
+      ProfileScope(world, PROFILE_UPDATE_PROXIES);
+      UpdateProxies(world, 0);
+    }
+    world->interpolation_alpha = 1.0f;
+
+    world->allocation_count = world->arena->push_count - push_count;
+    world->allocation_count += world->scratch->commit_count - commit_count;
+
+    if (world->deterministic) {
+      world->state_hash = BodiesStateHash(world, world->state_hash);
+    }
+    ProfileEndStep(world);
+  }
+
+  // Runs as many fixed steps of world->fixed_dt as fit into the time accumulated so far, but
+  // at most world->max_substeps, and returns the number of steps taken. Time that does not
+  // fit is carried over to the next call. Time beyond the substep limit is dropped, so that
+  // one slow frame cannot snowball into ever more steps per frame.
+  u32 Advance(World *world, f32 frame_dt) {
+    world->accumulator += frame_dt;
+
+    u32 substeps = 0;
+    while (world->accumulator >= world->fixed_dt && substeps < world->max_substeps) {
+      Step(world, world->fixed_dt);
+      world->accumulator -= world->fixed_dt;
+      substeps++;
+    }
+
+    if (world->accumulator >= world->fixed_dt) {
+      world->accumulator = FMod(world->accumulator, world->fixed_dt);
+    }
+    world->interpolation_alpha = world->accumulator / world->fixed_dt;
+
+    return substeps;
+  }
+
+  // Pose of a body between the start and the end of the last step, for drawing
+  void InterpolatedPose(World *world, u32 index, v2 *position, Matrix2x2 *rotation) {
+    Assert(index < world->proxies_count);
+    *position = world->bodies.position[index];
+    *rotation = world->rotations[index];
+    if (index >= world->previous_count) {
+      return;
+    }
+
+    f32 t = world->interpolation_alpha;
+    v2 previous_position = world->previous_positions[index];
+    *position = previous_position + (*position - previous_position) * t;
+
+    // NOTE: normalized lerp of the matrix columns, exact enough for the small angles a
+    // single step rotates by and does not need another sin/cos.
+    v2 previous_col1 = world->previous_rotations[index].col1;
+    v2 col1 = previous_col1 + (rotation->col1 - previous_col1) * t;
+    f32 length = SquareRoot(Vector2DotProduct(col1, col1));
+    if (length > 0.0f) {
+      col1 = col1 * (1.0f / length);
+      rotation->col1 = col1;
+      rotation->col2 = {-col1.y, col1.x};
+    }
+  }
+
+  v2 BodyInterpolatedPosition(World *world, BodyHandle handle) {
+    UpdateProxies(world, world->proxies_count);
+
+    v2 position;
+    Matrix2x2 rotation;
+    InterpolatedPose(world, BodyIndex(world, handle), &position, &rotation);
+    return position;
+  }
+
+  void PrintArbiterTable(World *world) {
+    Log("Arbiters (%u) {\n", world->arbiter_table.arbiters_count);
+    for (u32 i = 0; i < world->arbiter_table.arbiters_count; i++) {
+      Arbiter *a = world->arbiter_table.arbiters + i;
+      Log("\t %u - %u: %u contacts\n", a->i1, a->i2, a->contacts_count);
+    }
     Log("}\n");
   }
 };  // namespace physics
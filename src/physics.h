@@ -1,13 +1,38 @@
 #pragma once
-#define MAX_BODY_COUNT 256
 #define MAX_CONTACT_POINTS 2
 #define METER_2_PIXEL 100.0f
 #define PIXEL_2_METER (1.0f / METER_2_PIXEL)
+#define SOLVER_MAX_COLORS 64  // arbiters that need more colors go to a serial overflow batch
+#define SOLVER_PARALLEL_MIN_BATCH 128  // smaller batches are not worth waking the workers for
+#define SOLVER_CHUNK_SIZE 32
+#define SOLVER_ISLAND_COLOR_MIN 512  // islands with more arbiters are split into colors
+#define NARROW_PHASE_CHUNK_SIZE 64  // pairs per batch of the separating axis test
+#define PROXY_CHUNK_SIZE 256
+#define INTEGRATE_CHUNK_SIZE 4096
+#define BODY_ARRAYS_COUNT 12  // per body arrays in Bodies, see GetBodyArrays
+#define BODY_SLOT_NONE 0xffffffff
+#define PROFILE_HISTORY 128  // steps the profiler keeps, a power of two
 
+// Pairs per batch in the wide separating axis test, 1 = scalar only. Define PHYSICS_NO_SIMD to
+// force the scalar path.
+#if !defined(PHYSICS_NO_SIMD) && defined(__AVX__)
+#include <immintrin.h>
+#define COLLIDE_LANES 8
+#elif !defined(PHYSICS_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define COLLIDE_LANES 4
+#else
+#define COLLIDE_LANES 1
+#endif
+
+#ifndef PHYSICS_HEADLESS
 #include <raymath.h>
+#endif
 
+#include "broad_phase.h"
 #include "language_layer.h"
 #include "memory.h"
+#include "thread_pool.h"
 
 namespace physics {
 
@@ -24,7 +49,7 @@ namespace physics {
   //        e3
   //
 
-  enum Axis { FACE_A_X, FACE_A_Y, FACE_B_X, FACE_B_Y };
+  enum Axis { FACE_A_X, FACE_A_Y, FACE_B_X, FACE_B_Y, NO_AXIS };
 
   enum EdgeNumbers { NO_EDGE = 0, EDGE1, EDGE2, EDGE3, EDGE4 };
 
@@ -43,25 +68,49 @@ namespace physics {
     FeaturePair fp;
   };
 
-  struct Body {
-    v2 position;
-    f32 rotation;
+  // Per-body data that the integrator and solver loops never touch
+  struct BodyProperties {
+    f32 friction;
+    f32 mass;
+    f32 inertia;
 
-    v2 velocity;
-    f32 angular_velocity;
+    b32 lock_rotation;
+    b32 is_grounded;
+  };
 
-    v2 force;
-    f32 torque;
+  // Body state as a structure of arrays, all indexed by body index.
+  //
+  // The integrator and solver stream through the handful of arrays they need instead of
+  // dragging whole bodies through the cache. Gameplay code goes through the accessors in
+  // physics.cpp (BodyPosition, BodyVelocity, GetBodyProperties, ...).
+  struct Bodies {
+    v2 *position;
+    f32 *rotation;
 
-    v2 width;
+    v2 *velocity;
+    f32 *angular_velocity;
 
-    f32 friction;
-    f32 mass, inv_mass;
+    v2 *force;
+    f32 *torque;
 
-    f32 inertia, inv_inertia;
+    f32 *inv_mass;
+    f32 *inv_inertia;  // 0 when the rotation is locked
 
-    b32 lock_rotation;
-    b32 is_grounded;
+    v2 *width;
+
+    BodyProperties *properties;
+
+    f32 *sleep_time;  // seconds spent below the sleep tolerances
+    b32 *is_sleeping;  // sleeping bodies are not integrated or solved until woken
+
+    u32 count;
+    u32 capacity;
+  };
+
+  // Reference face and contact normal of an overlapping box pair
+  struct BoxPairAxis {
+    Axis axis;
+    v2 normal;
   };
 
   struct Contact {
@@ -71,34 +120,262 @@ namespace physics {
     f32 seperation;
     f32 acc_normal_impulse;
     f32 acc_tangent_impulse;
-    f32 acc_biased_normal_impulse;
+    f32 acc_biased_normal_impulse;  // split impulses, zeroed every step
     f32 mass_normal;
     f32 mass_tangent;
     f32 bias;
+    f32 position_bias;  // split impulses, the penetration part of bias
+    f32 adjusted_separation;  // SOLVER_SUBSTEP, separation without the contact arms
     FeaturePair feature;
   };
 
-  struct ArbiterKey {
-    Body *b1;
-    Body *b2;
+  // Soft contact constraint for one substep, see MakeSoftContact
+  struct SoftContact {
+    f32 bias_rate;
+    f32 mass_scale;
+    f32 impulse_scale;
+  };
+
+  // Refers to a body through World::body_slots. Stays valid when the body storage grows or
+  // other bodies are removed, and goes stale when its own body is removed, see BodyIsValid.
+  struct BodyHandle {
+    u32 index;  // slot, not the body index
+    u32 generation;
+  };
+
+  // Where the body of a handle is. Free slots are chained through index into a free list.
+  struct BodySlot {
+    u32 index;  // body index, or the next free slot
+    u32 generation;  // bumped every time the body in this slot is removed
   };
 
   struct Arbiter {
-    Body *b1;
-    Body *b2;
+    u32 i1;  // body indices, i1 < i2
+    u32 i2;
     float combined_friction;
 
     Contact contacts[MAX_CONTACT_POINTS];
     u32 contacts_count;
+
+    u64 key;
+    u64 last_touched_step;
+    u32 color;  // solver batch, see ColorArbiters
+
+    // Links in the arbiter lists of body i1 (0) and i2 (1), arbiter index + 1, 0 = none
+    u32 next[2];
+    u32 prev[2];
+  };
+
+  // Touching pair found by a narrow phase task
+  struct NarrowPhaseResult {
+    u32 pair_index;
+    Arbiter arbiter;
+  };
+
+  // Touching pairs of one chunk of NARROW_PHASE_CHUNK_SIZE pairs, in the scratch arena of the
+  // thread that collided them
+  struct NarrowPhaseChunk {
+    NarrowPhaseResult *results;
+    u32 results_count;
+  };
+
+  struct ArbiterSlot {
+    u64 key;
+    u32 index;  // arbiter index + 1, 0 = empty
+  };
+
+  // Contact pair cache keyed on the body indices of the pair.
+  //
+  // Arbiters are stored densely for the solver loops, next to an open addressing index with
+  // linear probing. Removal swaps the last arbiter into the hole and uses backward shift
+  // deletion, so there are no tombstones. Both arrays grow out of the arena when full.
+  //
+  // Every body also heads a doubly linked list of its arbiters, so the arbiters of one body can
+  // be found without a scan (see RemoveBody).
+  struct ArbiterTable {
+    MemoryArena *arena;
+
+    Arbiter *arbiters;
+    u32 arbiters_count;
+    u32 arbiters_capacity;
+
+    ArbiterSlot *slots;
+    u32 slots_mask;  // slots count - 1, count is a power of two
+    u32 slots_shift;  // 64 - log2(slots count)
+    u32 slots_capacity;
+
+    u32 *body_arbiters;  // body index -> first arbiter index + 1, 0 = none
+    u32 bodies_capacity;
+  };
+
+  // Bodies connected through arbiters, static bodies do not connect islands. An island sleeps
+  // and wakes as a whole.
+  struct Island {
+    u32 first_arbiter;  // into World::island_arbiters
+    u32 arbiters_count;
+    u32 awake_count;  // bodies of the island that are awake
+    f32 min_sleep_time;
+    b32 is_sleeping;
+    b32 solve_colored;  // solved as graph colored batches instead of as one task
+    u32 iterations;  // iterations the last iterated solver pass took to converge
+  };
+
+  enum SolverType {
+    // Velocity iterations over all contacts once per step, see World::iterations
+    SOLVER_ITERATIONS,
+    // World::solver_substeps substeps of one soft contact pass each, see SolveSubsteps
+    SOLVER_SUBSTEP,
+  };
+
+  // Timed parts of a Step, see physics_profile.cpp
+  enum ProfilePhase {
+    PROFILE_STEP,  // the whole step
+    PROFILE_BROAD_PHASE,
+    PROFILE_NARROW_PHASE,
+    PROFILE_INTEGRATE_FORCES,
+    PROFILE_ISLANDS,
+    PROFILE_PRE_STEP,
+    PROFILE_ITERATIONS,  // the impulse loop, or the substeps with their integration
+    PROFILE_SLEEP,
+    PROFILE_INTEGRATE_VELOCITIES,
+    PROFILE_UPDATE_PROXIES,
+    PROFILE_PHASES_COUNT
+  };
+
+  // Timings and counters of one step. Times are in nanoseconds, start is relative to the start
+  // of the step. A phase that runs more than once in a step adds up.
+  struct StepProfile {
+    u64 step;
+    u64 start_time;  // of the step, on the monotonic clock
+    u64 start[PROFILE_PHASES_COUNT];
+    u64 duration[PROFILE_PHASES_COUNT];
+
+    u32 pairs_tested;  // candidate pairs from the broad phase
+    u32 contacts_count;  // contact points the narrow phase found
+    u32 arbiters_count;  // alive at the end of the step
+    u32 solver_iterations;
+  };
+
+  // The last PROFILE_HISTORY steps, see ProfileGetStep
+  struct Profiler {
+    b32 enabled;
+    u64 steps_count;  // steps recorded so far, the latest one is at (steps_count - 1)
+    StepProfile steps[PROFILE_HISTORY];
+  };
+
+  struct RayCastResult {
+    b32 hit;
+    BodyHandle body;
+    v2 point;
+    v2 normal;
+    f32 fraction;
   };
 
   struct World {
-    Body bodies[MAX_BODY_COUNT];
-    HashTable<Arbiter, MAX_BODY_COUNT> arbiter_table;
+    MemoryArena *arena;
+    // Memory for the duration of a Step, see InitWorld. Everything that only lives during a
+    // step is pushed here and freed at its end.
+    MemoryArena *scratch;
+
+    Bodies bodies;
+
+    // Generational handles, see AddBody and RemoveBody
+    BodySlot *body_slots;  // bodies.capacity
+    u32 body_slots_count;
+    u32 free_body_slot;  // BODY_SLOT_NONE when there is none
+    u32 *body_slot;  // bodies.capacity, slot of a body index
+
+    ArbiterTable arbiter_table;
+
+    BroadPhaseType broad_phase_type;
+    BroadPhaseProxy *proxies;  // bodies.capacity
+    u32 proxies_count;
+    Grid grid;
+    DynamicTree tree;
+    SweepAndPrune sap;
+    PairBuffer pairs;
+    u32 *query_results;  // bodies.capacity, scratch for RayCast and QueryRegion
+    NarrowPhaseChunk *narrow_phase_chunks;  // scratch, used with a thread pool
+    Matrix2x2 *rotations;  // bodies.capacity, cached next to the proxy AABBs
+
+    // Simulation islands, rebuilt every step from the arbiters, see BuildIslands. The lists
+    // are in scratch memory and only valid during a step.
+    u32 *island_parent;  // bodies.capacity, union-find forest over body indices
+    u32 *island_index;  // bodies.capacity, island of a dynamic body
+    Island *islands;
+    u32 islands_count;
+    u32 *island_arbiters;  // arbiter indices grouped by island
+    u32 *solver_islands;  // islands solved as one task each
+    u32 solver_islands_count;
+
+    // Islands whose bodies all stay below the tolerances for time_to_sleep seconds go to sleep,
+    // a time_to_sleep of 0 disables sleeping
+    f32 time_to_sleep;
+    f32 sleep_linear_tolerance;
+    f32 sleep_angular_tolerance;
+
+    // Threading, the solver and the narrow phase split their work over the pool
+    ThreadPool *thread_pool;  // optional, everything runs on the calling thread without one
+
+    // Deterministic mode, see Step. The results only depend on the world state and not on the
+    // history of the arbiter table or the thread count, state_hash chains BodiesStateHash over
+    // all steps.
+    b32 deterministic;
+    u64 state_hash;
+    u32 *arbiter_order;  // scratch, arbiter indices sorted by key
+
+    // Graph coloring of the arbiters of large islands for the parallel solver. Arbiters of one
+    // color share no dynamic body, so each color can be solved in parallel.
+    u64 *body_colors;  // bodies.capacity, colors used by the arbiters of a body
+    u32 *solver_order;  // scratch, arbiter indices grouped by color
+    u32 color_start[SOLVER_MAX_COLORS + 2];  // + overflow batch + end
+    u32 colors_count;
 
-    u32 bodies_count;
     Vector2 gravity;
+    u64 step_count;
+
+    // The solver stops iterating over an island once an iteration changes no relative contact
+    // velocity by solver_tolerance or more, and after iterations at the latest. A tolerance of
+    // 0 always runs all iterations.
     usize iterations;
+    f32 solver_tolerance;  // m/s
+    u32 solver_iterations;  // most iterations an island took in the last step, or substeps
+
+    // Split impulses: penetration is recovered by a separate pass of at most
+    // position_iterations into bias velocities that move the bodies for one step and are then
+    // dropped, instead of through the velocity bias. The pass starts from zero every step.
+    // SOLVER_ITERATIONS only.
+    b32 split_impulses;
+    usize position_iterations;
+    u32 solver_position_iterations;  // most position iterations an island took in the last step
+    v2 *bias_velocities;  // scratch
+    f32 *bias_angular_velocities;  // scratch
+
+    // Solver substeps, see SolveSubsteps. Not to be confused with the fixed steps of Advance,
+    // these split a single step.
+    SolverType solver_type;
+    u32 solver_substeps;
+    v2 *delta_positions;  // scratch, SOLVER_SUBSTEP, how far bodies moved since the step start
+    v2 *delta_rotations;  // scratch, cosine and sine of how far they rotated
+
+    // Fixed timestep stepping, see Advance
+    f32 fixed_dt;
+    u32 max_substeps;
+    f32 accumulator;
+    f32 interpolation_alpha;  // 0 = previous poses, 1 = current poses
+
+    v2 *previous_positions;  // bodies.capacity, poses at the start of the last Step
+    Matrix2x2 *previous_rotations;
+    u32 previous_count;
+
+    // Stats, reset at the start of every Step
+    u64 transcendental_count;  // sin and cos evaluations, scales with bodies and not pairs
+    // Pushes onto the world arena plus pages committed for scratch memory. Only growing
+    // capacities allocate, so this stays 0 once a scene of a steady size has run a step.
+    u64 allocation_count;
+    u32 contacts_count;  // contact points the narrow phase found
+
+    Profiler profiler;
 
 #if DEVELOPER
     b32 debug;
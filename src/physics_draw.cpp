@@ -0,0 +1,44 @@
+#include <raylib.h>
+
+#include "physics.h"
+#include "renderer.h"
+
+// Debug drawing of the physics world, kept apart from physics.cpp so that the simulation itself
+// builds without raylib.
+namespace physics {
+  void Draw(World *world, Renderer *renderer) {
+    UpdateProxies(world, world->proxies_count);
+
+    Bodies *bodies = &world->bodies;
+    for (u32 i = 0; i < bodies->count; i++) {
+      v2 position;
+      Matrix2x2 rot;
+      InterpolatedPose(world, i, &position, &rot);
+      v2 h = bodies->width[i] * 0.5f;
+
+      v2 p1 = rot * (v2){-h.x, -h.y};
+      v2 p2 = rot * (v2){-h.x, +h.y};
+      v2 p3 = rot * (v2){+h.x, +h.y};
+      v2 p4 = rot * (v2){+h.x, -h.y};
+
+      p1 = p1 + position;
+      p2 = p2 + position;
+      p3 = p3 + position;
+      p4 = p4 + position;
+
+      Color c = LIME;
+      PushLine(renderer, p1, p2, c);
+      PushLine(renderer, p2, p3, c);
+      PushLine(renderer, p3, p4, c);
+      PushLine(renderer, p4, p1, c);
+      PushLine(renderer, position, position + rot * v2{0.10f, 0.0f}, c);
+    }
+
+    for (usize i = 0; i < world->arbiter_table.arbiters_count; i++) {
+      Arbiter *a = world->arbiter_table.arbiters + i;
+      for (usize j = 0; j < a->contacts_count; j++) {
+        PushCircle(renderer, a->contacts[j].position, 0.03f, MAGENTA);
+      }
+    }
+  }
+};  // namespace physics
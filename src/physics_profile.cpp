@@ -0,0 +1,161 @@
+#include "physics.h"
+
+#include "language_layer.h"
+
+// Step profiler. Step times its phases with ProfileScope and keeps the timings and counters of
+// the last PROFILE_HISTORY steps in a ring buffer in the world, so a running game can tell
+// where its steps go without attaching a profiler:
+//
+//   world->profiler.enabled = true;
+//   ...
+//   f64 average_ms, max_ms;
+//   ProfilePhaseStats(world, PROFILE_NARROW_PHASE, 60, &average_ms, &max_ms);
+//   WriteProfileTrace(world, "steps.json");  // open in chrome://tracing or Perfetto
+//
+// Times come from the monotonic clock. A disabled profiler costs a branch per scope.
+namespace physics {
+  global const char *profile_phase_names[PROFILE_PHASES_COUNT] = {
+      "Step",         "BroadPhase", "NarrowPhase", "IntegrateForces",     "Islands",
+      "PreStep",      "Iterations", "Sleep",       "IntegrateVelocities", "UpdateProxies",
+  };
+
+  const char *ProfilePhaseName(ProfilePhase phase) { return profile_phase_names[phase]; }
+
+  internal u64 ProfileNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+  }
+
+  internal StepProfile *ProfileCurrentStep(Profiler *profiler) {
+    return profiler->steps + (profiler->steps_count & (PROFILE_HISTORY - 1));
+  }
+
+  internal u64 ProfileBegin(World *world) { return world->profiler.enabled ? ProfileNow() : 0; }
+
+  internal void ProfileEnd(World *world, ProfilePhase phase, u64 begin) {
+    Profiler *profiler = &world->profiler;
+    if (!profiler->enabled) {
+      return;
+    }
+
+    StepProfile *profile = ProfileCurrentStep(profiler);
+    if (profile->duration[phase] == 0) {
+      profile->start[phase] = begin - profile->start_time;
+    }
+    profile->duration[phase] += ProfileNow() - begin;
+  }
+
+// Times the rest of the enclosing scope as a phase of the current step, only used inside Step
+#define ProfileScope(world, phase)                 \
+  u64 profile_begin_##phase = ProfileBegin(world); \
+  Defer(ProfileEnd(world, phase, profile_begin_##phase))
+
+  // Starts the record of a step in the ring buffer, overwriting the oldest one
+  internal void ProfileBeginStep(World *world) {
+    Profiler *profiler = &world->profiler;
+    if (!profiler->enabled) {
+      return;
+    }
+
+    StepProfile *profile = ProfileCurrentStep(profiler);
+    *profile = {};
+    profile->step = world->step_count;
+    profile->start_time = ProfileNow();
+  }
+
+  internal void ProfileEndStep(World *world) {
+    Profiler *profiler = &world->profiler;
+    if (!profiler->enabled) {
+      return;
+    }
+
+    StepProfile *profile = ProfileCurrentStep(profiler);
+    profile->duration[PROFILE_STEP] = ProfileNow() - profile->start_time;
+    profile->pairs_tested = world->pairs.pairs_count;
+    profile->contacts_count = world->contacts_count;
+    profile->arbiters_count = world->arbiter_table.arbiters_count;
+    profile->solver_iterations = world->solver_iterations;
+    profiler->steps_count++;
+  }
+
+  // Profile of a recorded step, 0 is the latest one. Returns null for steps that were not
+  // recorded or fell out of the history.
+  const StepProfile *ProfileGetStep(World *world, u32 steps_ago) {
+    Profiler *profiler = &world->profiler;
+    if (steps_ago >= profiler->steps_count || steps_ago >= PROFILE_HISTORY) {
+      return 0;
+    }
+    u64 index = (profiler->steps_count - 1 - steps_ago) & (PROFILE_HISTORY - 1);
+    return profiler->steps + index;
+  }
+
+  // Average and worst time of a phase over the last steps_count recorded steps, in
+  // milliseconds. Returns the number of steps that went into them.
+  u32 ProfilePhaseStats(World *world, ProfilePhase phase, u32 steps_count, f64 *average_ms,
+                        f64 *max_ms) {
+    u64 total = 0;
+    u64 worst = 0;
+    u32 count = 0;
+    for (; count < steps_count; count++) {
+      const StepProfile *profile = ProfileGetStep(world, count);
+      if (!profile) {
+        break;
+      }
+      total += profile->duration[phase];
+      worst = Max(worst, profile->duration[phase]);
+    }
+
+    *average_ms = count > 0 ? (f64)total / count * 1e-6 : 0.0;
+    *max_ms = (f64)worst * 1e-6;
+    return count;
+  }
+
+  // Writes the recorded steps in the Chrome trace event format, oldest first. Every phase is a
+  // complete event nested in its step and the counters are counter events.
+  b32 WriteProfileTrace(World *world, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+      LogError("Could not create profile trace %s", path);
+      return false;
+    }
+    Defer(fclose(file));
+
+    u32 recorded = (u32)Min(world->profiler.steps_count, (u64)PROFILE_HISTORY);
+    const StepProfile *oldest = ProfileGetStep(world, recorded - 1);
+    u64 origin = oldest ? oldest->start_time : 0;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *separator = "";
+    for (i64 i = (i64)recorded - 1; i >= 0; i--) {
+      const StepProfile *profile = ProfileGetStep(world, (u32)i);
+      f64 step_start = (f64)(profile->start_time - origin) * 1e-3;
+
+      for (u32 phase = 0; phase < PROFILE_PHASES_COUNT; phase++) {
+        if (phase != PROFILE_STEP && profile->duration[phase] == 0) {
+          continue;
+        }
+        fprintf(file,
+                "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"step\":%llu}}",
+                separator, profile_phase_names[phase],
+                step_start + (f64)profile->start[phase] * 1e-3,
+                (f64)profile->duration[phase] * 1e-3, (unsigned long long)profile->step);
+        separator = ",\n";
+      }
+
+      fprintf(file,
+              "%s{\"name\":\"Counters\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{"
+              "\"pairs_tested\":%u,\"contacts\":%u,\"arbiters\":%u,\"solver_iterations\":%u}}",
+              separator, step_start, profile->pairs_tested, profile->contacts_count,
+              profile->arbiters_count, profile->solver_iterations);
+    }
+    fprintf(file, "\n]}\n");
+
+    if (ferror(file)) {
+      LogError("Could not write profile trace %s", path);
+      return false;
+    }
+    return true;
+  }
+};  // namespace physics
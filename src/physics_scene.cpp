@@ -0,0 +1,202 @@
+#include "physics.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "language_layer.h"
+
+// Scene files, levels stored in the layout of the body arrays so that loading one is an mmap
+// and no AddBody calls. Mass, inertia and their inverses are stored precomputed.
+//
+// Layout, all little endian:
+//
+//   SceneFileHeader
+//   SceneFileArray   x arrays_count, where to find each per body array
+//   per body arrays  x bodies_count each, every one aligned to SCENE_FILE_ALIGNMENT
+//
+// The array table names each array by its index in GetBodyArrays along with its element size,
+// so a reader can find the arrays it knows and tell when their layout changed.
+namespace physics {
+#define SCENE_FILE_MAGIC 0x43535043  // "CPSC"
+#define SCENE_FILE_VERSION 1
+#define SCENE_FILE_ALIGNMENT 64
+
+  struct SceneFileHeader {
+    u32 magic;
+    u32 version;
+    u32 bodies_count;
+    u32 arrays_count;
+
+    v2 gravity;
+    u32 iterations;
+    u32 broad_phase_type;
+  };
+
+  struct SceneFileArray {
+    u32 field;  // index in GetBodyArrays
+    u32 element_size;
+    u64 offset;  // from the start of the file
+  };
+
+  // A scene file mapped into a world, see LoadSceneFile
+  struct SceneMapping {
+    void *base;
+    u64 size;
+  };
+
+  // Writes the bodies and settings of the world as a scene file
+  b32 WriteSceneFile(World *world, const char *path) {
+    Bodies *bodies = &world->bodies;
+    BodyArray arrays[BODY_ARRAYS_COUNT];
+    GetBodyArrays(bodies, arrays);
+
+    SceneFileHeader header = {};
+    header.magic = SCENE_FILE_MAGIC;
+    header.version = SCENE_FILE_VERSION;
+    header.bodies_count = bodies->count;
+    header.arrays_count = BODY_ARRAYS_COUNT;
+    header.gravity = world->gravity;
+    header.iterations = (u32)world->iterations;
+    header.broad_phase_type = world->broad_phase_type;
+
+    SceneFileArray table[BODY_ARRAYS_COUNT];
+    u64 offset = sizeof(header) + sizeof(table);
+    for (u32 i = 0; i < BODY_ARRAYS_COUNT; i++) {
+      offset = AlignUpPow2(offset, SCENE_FILE_ALIGNMENT);
+      table[i] = {i, arrays[i].element_size, offset};
+      offset += (u64)arrays[i].element_size * bodies->count;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+      LogError("Could not create scene file %s", path);
+      return false;
+    }
+    Defer(fclose(file));
+
+    b32 ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(table, sizeof(table), 1, file) == 1;
+    for (u32 i = 0; ok && i < BODY_ARRAYS_COUNT; i++) {
+      u8 padding[SCENE_FILE_ALIGNMENT] = {};
+      u64 padding_size = table[i].offset - (u64)ftell(file);
+      u64 array_size = (u64)arrays[i].element_size * bodies->count;
+      ok = padding_size == 0 || fwrite(padding, padding_size, 1, file) == 1;
+      ok = ok && (array_size == 0 || fwrite(*arrays[i].data, array_size, 1, file) == 1);
+    }
+
+    if (!ok) {
+      LogError("Could not write scene file %s", path);
+    }
+    return ok;
+  }
+
+  // Maps a scene file into an empty world. The body arrays point straight into the mapping,
+  // so loading costs an mmap and pages are read in as the first step touches them. The
+  // mapping is private, the simulation writing to it never changes the file.
+  //
+  // The arrays move into the world arena the first time the world outgrows the file, for
+  // example on the next AddBody. Until then the mapping must outlive the world, see
+  // UnmapSceneFile.
+  b32 LoadSceneFile(World *world, const char *path, SceneMapping *mapping) {
+    Bodies *bodies = &world->bodies;
+    if (bodies->count > 0) {
+      LogError("Scene file %s needs an empty world", path);
+      return false;
+    }
+
+    i32 fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      LogError("Could not open scene file %s", path);
+      return false;
+    }
+    Defer(close(fd));
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (u64)file_stat.st_size < sizeof(SceneFileHeader)) {
+      LogError("%s is not a scene file", path);
+      return false;
+    }
+    u64 size = (u64)file_stat.st_size;
+
+    void *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+      LogError("Could not map scene file %s", path);
+      return false;
+    }
+
+    SceneFileHeader *header = (SceneFileHeader *)base;
+    SceneFileArray *table = (SceneFileArray *)(header + 1);
+    b32 ok = header->magic == SCENE_FILE_MAGIC && header->version == SCENE_FILE_VERSION
+             && sizeof(*header) + sizeof(*table) * header->arrays_count <= size;
+
+    // NOTE: every array the world has must be in the file with the same element size,
+    // arrays the world does not know about are skipped.
+    BodyArray arrays[BODY_ARRAYS_COUNT];
+    GetBodyArrays(bodies, arrays);
+    void *mapped[BODY_ARRAYS_COUNT] = {};
+    for (u32 i = 0; ok && i < header->arrays_count; i++) {
+      SceneFileArray *array = table + i;
+      if (array->field >= BODY_ARRAYS_COUNT) {
+        continue;
+      }
+      u64 array_size = (u64)array->element_size * header->bodies_count;
+      ok = array->element_size == arrays[array->field].element_size
+           && array->offset % SCENE_FILE_ALIGNMENT == 0 && array->offset + array_size <= size;
+      mapped[array->field] = (u8 *)base + array->offset;
+    }
+    for (u32 i = 0; ok && i < BODY_ARRAYS_COUNT; i++) {
+      ok = mapped[i] != 0;
+    }
+
+    if (!ok) {
+      LogError("%s is not a scene file this build can read", path);
+      munmap(base, size);
+      return false;
+    }
+
+    // NOTE: reserve the per body arrays that are not in the file, the body arrays
+    // reserved along with them are never touched. Handles are handed out in body order.
+    ReserveBodies(world, header->bodies_count);
+    for (u32 i = 0; i < BODY_ARRAYS_COUNT; i++) {
+      *arrays[i].data = mapped[i];
+    }
+    bodies->count = header->bodies_count;
+    bodies->capacity = header->bodies_count;
+
+    for (u32 i = 0; i < bodies->count; i++) {
+      world->body_slots[i] = {i, 1};
+      world->body_slot[i] = i;
+    }
+    world->body_slots_count = bodies->count;
+    world->free_body_slot = BODY_SLOT_NONE;
+
+    world->gravity = header->gravity;
+    world->iterations = header->iterations;
+    SetBroadPhase(world, (BroadPhaseType)header->broad_phase_type);
+
+    mapping->base = base;
+    mapping->size = size;
+    return true;
+  }
+
+  void UnmapSceneFile(SceneMapping *mapping) {
+    if (mapping->base) {
+      munmap(mapping->base, mapping->size);
+    }
+    *mapping = {};
+  }
+
+  // True if the file starts like a scene file, to tell them apart from text scenes
+  b32 IsSceneFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+      return false;
+    }
+    Defer(fclose(file));
+
+    u32 magic = 0;
+    return fread(&magic, sizeof(magic), 1, file) == 1 && magic == SCENE_FILE_MAGIC;
+  }
+};  // namespace physics
@@ -0,0 +1,424 @@
+#include "physics.h"
+
+#include "language_layer.h"
+
+// Saving and restoring the simulation state of a world as a binary blob, for rollback,
+// crash recovery and scene loading.
+//
+// The blob holds no pointers, bodies and arbiters refer to bodies and each other by index.
+// Layout, in this order, all little endian:
+//
+//   SnapshotHeader
+//   Arbiter          x arbiters_count, ArbiterTable::arbiters
+//   ArbiterSlot      x arbiter_slots_count, ArbiterTable::slots
+//   u32              x bodies_count, ArbiterTable::body_arbiters
+//   per body arrays  x bodies_count each, in the order of GetBodyArrays
+//   u32              x bodies_count, World::body_slot
+//   BodySlot         x body_slots_count
+//   Matrix2x2        x bodies_count, World::rotations
+//   BroadPhaseProxy  x bodies_count, World::proxies
+//
+// The arbiter table and the transform cache are stored as the world lays them out, so a
+// restore is a handful of copies. Only the tree and sweep and prune broad phases are rebuilt,
+// everything else a step derives again, like contact arms and masses, is recomputed by the
+// next step.
+namespace physics {
+#define SNAPSHOT_MAGIC 0x53485043  // "CPHS"
+#define SNAPSHOT_VERSION 6
+
+  struct SnapshotHeader {
+    u32 magic;
+    u32 version;
+    u32 contact_points;  // MAX_CONTACT_POINTS of the writer
+    u32 properties_size;  // sizeof(BodyProperties) of the writer
+    u32 arbiter_size;  // sizeof(Arbiter) of the writer
+    u64 size;  // of the whole blob
+
+    u32 bodies_count;
+    u32 arbiters_count;
+    u32 arbiter_slots_count;
+    u32 body_slots_count;
+    u32 free_body_slot;
+    u64 step_count;
+    u64 state_hash;
+
+    v2 gravity;
+    u32 iterations;
+    u32 broad_phase_type;
+    f32 fixed_dt;
+    f32 accumulator;
+    u32 max_substeps;
+    b32 deterministic;
+    f32 time_to_sleep;
+    f32 sleep_linear_tolerance;
+    f32 sleep_angular_tolerance;
+    f32 solver_tolerance;
+    u32 solver_type;
+    u32 solver_substeps;
+    b32 split_impulses;
+    u32 position_iterations;
+  };
+
+  enum SnapshotCopy { SNAPSHOT_MEASURE, SNAPSHOT_WRITE, SNAPSHOT_READ };
+
+  // Copies the per body arrays to or from the blob and returns the bytes they take up
+  internal u64 SnapshotCopyBodies(Bodies *bodies, u8 *blob, SnapshotCopy copy) {
+    BodyArray arrays[BODY_ARRAYS_COUNT];
+    GetBodyArrays(bodies, arrays);
+
+    u64 size = 0;
+    for (u32 i = 0; i < BODY_ARRAYS_COUNT; i++) {
+      u64 array_size = (u64)arrays[i].element_size * bodies->count;
+      if (copy == SNAPSHOT_WRITE) {
+        MemoryCopy(blob + size, *arrays[i].data, array_size);
+      } else if (copy == SNAPSHOT_READ) {
+        MemoryCopy(*arrays[i].data, blob + size, array_size);
+      }
+      size += array_size;
+    }
+    return size;
+  }
+
+  internal u64 SnapshotSizeFromCounts(u32 bodies_count, u32 arbiters_count,
+                                      u32 arbiter_slots_count, u32 body_slots_count) {
+    Bodies measure = {};
+    measure.count = bodies_count;
+    u64 size = sizeof(SnapshotHeader);
+    size += (u64)sizeof(Arbiter) * arbiters_count + (u64)sizeof(ArbiterSlot) * arbiter_slots_count;
+    size += (u64)sizeof(u32) * bodies_count;
+    size += SnapshotCopyBodies(&measure, 0, SNAPSHOT_MEASURE);
+    size += (u64)sizeof(u32) * bodies_count + (u64)sizeof(BodySlot) * body_slots_count;
+    size += (u64)(sizeof(Matrix2x2) + sizeof(BroadPhaseProxy)) * bodies_count;
+    return size;
+  }
+
+  // Bytes WriteSnapshot needs for the world as it is now
+  u64 SnapshotSize(World *world) {
+    ArbiterTable *table = &world->arbiter_table;
+    return SnapshotSizeFromCounts(world->bodies.count, table->arbiters_count,
+                                  table->slots_mask + 1, world->body_slots_count);
+  }
+
+  // The fields of an arbiter in the blob that RestoreSnapshot checks. The blob does not have to
+  // be aligned, so they are copied out one by one.
+  struct SnapshotArbiterLinks {
+    u32 i1;
+    u32 i2;
+    u32 contacts_count;
+    u64 key;
+    u32 next[2];
+    u32 prev[2];
+  };
+
+  internal SnapshotArbiterLinks SnapshotReadArbiterLinks(const u8 *arbiters, u32 index) {
+    const u8 *a = arbiters + (u64)sizeof(Arbiter) * index;
+    SnapshotArbiterLinks links;
+    MemoryCopy(&links.i1, a + offsetof(Arbiter, i1), sizeof(links.i1));
+    MemoryCopy(&links.i2, a + offsetof(Arbiter, i2), sizeof(links.i2));
+    MemoryCopy(&links.contacts_count, a + offsetof(Arbiter, contacts_count),
+               sizeof(links.contacts_count));
+    MemoryCopy(&links.key, a + offsetof(Arbiter, key), sizeof(links.key));
+    MemoryCopy(links.next, a + offsetof(Arbiter, next), sizeof(links.next));
+    MemoryCopy(links.prev, a + offsetof(Arbiter, prev), sizeof(links.prev));
+    return links;
+  }
+
+  inline ArbiterSlot SnapshotReadArbiterSlot(const u8 *slots, u32 index) {
+    ArbiterSlot slot;
+    MemoryCopy(&slot, slots + (u64)sizeof(ArbiterSlot) * index, sizeof(slot));
+    return slot;
+  }
+
+  inline BodySlot SnapshotReadBodySlot(const u8 *slots, u32 index) {
+    BodySlot slot;
+    MemoryCopy(&slot, slots + (u64)sizeof(BodySlot) * index, sizeof(slot));
+    return slot;
+  }
+
+  inline u32 SnapshotReadU32(const u8 *array, u32 index) {
+    u32 value;
+    MemoryCopy(&value, array + (u64)sizeof(u32) * index, sizeof(value));
+    return value;
+  }
+
+  // Checks that the arbiter table of a blob is one the world can take over as is: every arbiter
+  // joins two bodies, has its key and is found under it in the index, and the arbiter lists of
+  // the bodies are intact. Linear in the number of arbiters and slots.
+  internal b32 SnapshotArbitersAreValid(const SnapshotHeader &header, const u8 *arbiters,
+                                        const u8 *slots, const u8 *body_arbiters) {
+    u32 arbiters_count = header.arbiters_count;
+    u32 slots_count = header.arbiter_slots_count;
+    if (slots_count == 0 || (slots_count & (slots_count - 1)) != 0
+        || arbiters_count >= slots_count) {
+      return false;
+    }
+
+    u32 used_slots_count = 0;
+    for (u32 i = 0; i < slots_count; i++) {
+      u32 index = SnapshotReadArbiterSlot(slots, i).index;
+      if (index > arbiters_count) {
+        return false;
+      }
+      used_slots_count += index != 0;
+    }
+    if (used_slots_count != arbiters_count) {
+      return false;
+    }
+
+    // Every arbiter has to be found by its key, which also rules out two arbiters of one pair
+    ArbiterTable index_table = {};
+    index_table.slots_mask = slots_count - 1;
+    index_table.slots_shift = ArbiterSlotsShift(slots_count);
+    for (u32 i = 0; i < arbiters_count; i++) {
+      SnapshotArbiterLinks a = SnapshotReadArbiterLinks(arbiters, i);
+      if (a.i1 >= a.i2 || a.i2 >= header.bodies_count || a.contacts_count > MAX_CONTACT_POINTS
+          || a.key != ArbiterKeyFromIndices(a.i1, a.i2)) {
+        return false;
+      }
+
+      u32 slot = ArbiterSlotHome(&index_table, a.key);
+      ArbiterSlot s = SnapshotReadArbiterSlot(slots, slot);
+      while (s.index != 0 && s.key != a.key) {
+        slot = (slot + 1) & index_table.slots_mask;
+        s = SnapshotReadArbiterSlot(slots, slot);
+      }
+      if (s.index != i + 1) {
+        return false;
+      }
+    }
+
+    // Walk the list of every body. Each arbiter is in two lists, so the lists have to hold
+    // 2 * arbiters_count links, and the prev links have to point back the way the walk came.
+    u64 links_count = 0;
+    for (u32 body = 0; body < header.bodies_count; body++) {
+      u32 prev = 0;
+      u32 index = SnapshotReadU32(body_arbiters, body);
+      while (index != 0) {
+        if (index > arbiters_count || links_count == 2 * (u64)arbiters_count) {
+          return false;
+        }
+        SnapshotArbiterLinks a = SnapshotReadArbiterLinks(arbiters, index - 1);
+        if (a.i1 != body && a.i2 != body) {
+          return false;
+        }
+        u32 end = a.i1 == body ? 0 : 1;
+        if (a.prev[end] != prev) {
+          return false;
+        }
+        prev = index;
+        index = a.next[end];
+        links_count++;
+      }
+    }
+    return links_count == 2 * (u64)arbiters_count;
+  }
+
+  // Checks that every body has a slot that leads back to it, and that the free list only holds
+  // the other slots, each once.
+  internal b32 SnapshotBodySlotsAreValid(const SnapshotHeader &header, const u8 *body_slot,
+                                         const u8 *body_slots) {
+    for (u32 i = 0; i < header.bodies_count; i++) {
+      u32 slot = SnapshotReadU32(body_slot, i);
+      if (slot >= header.body_slots_count || SnapshotReadBodySlot(body_slots, slot).index != i) {
+        return false;
+      }
+    }
+
+    // Body slots are in use when their body points back at them. The walk is bounded by the
+    // number of free slots, so a cycle in the list is caught by not ending in time.
+    u32 free_slots_count = header.body_slots_count - header.bodies_count;
+    u32 slot = header.free_body_slot;
+    for (u32 i = 0; i < free_slots_count; i++) {
+      if (slot >= header.body_slots_count) {
+        return false;
+      }
+      u32 next = SnapshotReadBodySlot(body_slots, slot).index;
+      if (next < header.bodies_count && SnapshotReadU32(body_slot, next) == slot) {
+        return false;
+      }
+      slot = next;
+    }
+    return slot == BODY_SLOT_NONE;
+  }
+
+  // Writes the world into buffer and returns the size of the snapshot, or 0 if it does not fit
+  u64 WriteSnapshot(World *world, void *buffer, u64 buffer_size) {
+    // Bodies added since the last step have no transform cache yet, Step would fill it in next
+    UpdateProxies(world, world->proxies_count);
+
+    u64 size = SnapshotSize(world);
+    if (size > buffer_size) {
+      return 0;
+    }
+
+    Bodies *bodies = &world->bodies;
+    ArbiterTable *table = &world->arbiter_table;
+
+    SnapshotHeader header = {};
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.contact_points = MAX_CONTACT_POINTS;
+    header.properties_size = sizeof(BodyProperties);
+    header.arbiter_size = sizeof(Arbiter);
+    header.size = size;
+    header.bodies_count = bodies->count;
+    header.arbiters_count = table->arbiters_count;
+    header.arbiter_slots_count = table->slots_mask + 1;
+    header.body_slots_count = world->body_slots_count;
+    header.free_body_slot = world->free_body_slot;
+    header.step_count = world->step_count;
+    header.state_hash = world->state_hash;
+    header.gravity = world->gravity;
+    header.iterations = (u32)world->iterations;
+    header.broad_phase_type = world->broad_phase_type;
+    header.fixed_dt = world->fixed_dt;
+    header.accumulator = world->accumulator;
+    header.max_substeps = world->max_substeps;
+    header.deterministic = world->deterministic;
+    header.time_to_sleep = world->time_to_sleep;
+    header.sleep_linear_tolerance = world->sleep_linear_tolerance;
+    header.sleep_angular_tolerance = world->sleep_angular_tolerance;
+    header.solver_tolerance = world->solver_tolerance;
+    header.solver_type = world->solver_type;
+    header.solver_substeps = world->solver_substeps;
+    header.split_impulses = world->split_impulses;
+    header.position_iterations = (u32)world->position_iterations;
+
+    u8 *cursor = (u8 *)buffer;
+    MemoryCopy(cursor, &header, sizeof(header));
+    cursor += sizeof(header);
+
+    MemoryCopy(cursor, table->arbiters, sizeof(Arbiter) * table->arbiters_count);
+    cursor += sizeof(Arbiter) * table->arbiters_count;
+    MemoryCopy(cursor, table->slots, sizeof(ArbiterSlot) * header.arbiter_slots_count);
+    cursor += sizeof(ArbiterSlot) * header.arbiter_slots_count;
+    MemoryCopy(cursor, table->body_arbiters, sizeof(u32) * bodies->count);
+    cursor += sizeof(u32) * bodies->count;
+
+    cursor += SnapshotCopyBodies(bodies, cursor, SNAPSHOT_WRITE);
+    MemoryCopy(cursor, world->body_slot, sizeof(u32) * bodies->count);
+    cursor += sizeof(u32) * bodies->count;
+    MemoryCopy(cursor, world->body_slots, sizeof(BodySlot) * world->body_slots_count);
+    cursor += sizeof(BodySlot) * world->body_slots_count;
+    MemoryCopy(cursor, world->rotations, sizeof(Matrix2x2) * bodies->count);
+    cursor += sizeof(Matrix2x2) * bodies->count;
+    MemoryCopy(cursor, world->proxies, sizeof(BroadPhaseProxy) * bodies->count);
+    cursor += sizeof(BroadPhaseProxy) * bodies->count;
+
+    Assert((u64)(cursor - (u8 *)buffer) == size);
+    return size;
+  }
+
+  // Replaces the state of the world with a snapshot. Returns false and leaves the world alone
+  // if the blob is not a snapshot this build can read.
+  //
+  // A world in deterministic mode continues exactly as the one the snapshot was taken from,
+  // see Step.
+  b32 RestoreSnapshot(World *world, const void *buffer, u64 size) {
+    SnapshotHeader header;
+    if (size < sizeof(header)) {
+      return false;
+    }
+    MemoryCopy(&header, buffer, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION
+        || header.contact_points != MAX_CONTACT_POINTS
+        || header.properties_size != sizeof(BodyProperties)
+        || header.arbiter_size != sizeof(Arbiter) || header.size != size) {
+      return false;
+    }
+
+    u64 expected_size = SnapshotSizeFromCounts(header.bodies_count, header.arbiters_count,
+                                               header.arbiter_slots_count,
+                                               header.body_slots_count);
+    if (expected_size != size || header.body_slots_count < header.bodies_count
+        || header.broad_phase_type > BROAD_PHASE_SAP || header.solver_type > SOLVER_SUBSTEP) {
+      return false;
+    }
+
+    const u8 *arbiters = (const u8 *)buffer + sizeof(header);
+    const u8 *arbiter_slots = arbiters + (u64)sizeof(Arbiter) * header.arbiters_count;
+    const u8 *body_arbiters
+        = arbiter_slots + (u64)sizeof(ArbiterSlot) * header.arbiter_slots_count;
+    Bodies measure = {};
+    measure.count = header.bodies_count;
+    const u8 *body_slot = body_arbiters + (u64)sizeof(u32) * header.bodies_count
+                          + SnapshotCopyBodies(&measure, 0, SNAPSHOT_MEASURE);
+    const u8 *body_slots = body_slot + (u64)sizeof(u32) * header.bodies_count;
+    if (!SnapshotArbitersAreValid(header, arbiters, arbiter_slots, body_arbiters)
+        || !SnapshotBodySlotsAreValid(header, body_slot, body_slots)) {
+      return false;
+    }
+
+    // Nothing of the world changes before this point
+
+    Bodies *bodies = &world->bodies;
+    ArbiterTable *table = &world->arbiter_table;
+    b32 same_bodies_count = header.bodies_count == bodies->count;
+    u32 old_bodies_count = bodies->count;
+
+    world->step_count = header.step_count;
+    world->state_hash = header.state_hash;
+    world->gravity = header.gravity;
+    world->iterations = header.iterations;
+    world->fixed_dt = header.fixed_dt;
+    world->accumulator = header.accumulator;
+    world->max_substeps = header.max_substeps;
+    world->deterministic = header.deterministic;
+    world->time_to_sleep = header.time_to_sleep;
+    world->sleep_linear_tolerance = header.sleep_linear_tolerance;
+    world->sleep_angular_tolerance = header.sleep_angular_tolerance;
+    world->solver_tolerance = header.solver_tolerance;
+    world->solver_type = (SolverType)header.solver_type;
+    world->solver_substeps = header.solver_substeps;
+    world->split_impulses = header.split_impulses;
+    world->position_iterations = header.position_iterations;
+
+    // The per body arrays, body_arbiters included, have to fit the body slots as well
+    ReserveBodies(world, header.body_slots_count);
+
+    const u8 *cursor = body_arbiters;
+    MemoryArenaReserveArray(table->arena, &table->arbiters, &table->arbiters_capacity, 0,
+                            header.arbiters_count);
+    MemoryCopy(table->arbiters, arbiters, sizeof(Arbiter) * header.arbiters_count);
+    table->arbiters_count = header.arbiters_count;
+    ArbiterTableAllocateSlots(table, header.arbiter_slots_count);
+    MemoryCopy(table->slots, arbiter_slots, sizeof(ArbiterSlot) * header.arbiter_slots_count);
+    MemoryCopy(table->body_arbiters, cursor, sizeof(u32) * header.bodies_count);
+    cursor += sizeof(u32) * header.bodies_count;
+    if (old_bodies_count > header.bodies_count) {
+      MemorySet(table->body_arbiters + header.bodies_count, 0,
+                sizeof(u32) * (old_bodies_count - header.bodies_count));
+    }
+
+    bodies->count = header.bodies_count;
+    cursor += SnapshotCopyBodies(bodies, (u8 *)cursor, SNAPSHOT_READ);
+    MemoryCopy(world->body_slot, cursor, sizeof(u32) * bodies->count);
+    cursor += sizeof(u32) * bodies->count;
+    MemoryCopy(world->body_slots, cursor, sizeof(BodySlot) * header.body_slots_count);
+    cursor += sizeof(BodySlot) * header.body_slots_count;
+    world->body_slots_count = header.body_slots_count;
+    world->free_body_slot = header.free_body_slot;
+    MemoryCopy(world->rotations, cursor, sizeof(Matrix2x2) * bodies->count);
+    cursor += sizeof(Matrix2x2) * bodies->count;
+    MemoryCopy(world->proxies, cursor, sizeof(BroadPhaseProxy) * bodies->count);
+    cursor += sizeof(BroadPhaseProxy) * bodies->count;
+
+    // NOTE: the incremental broad phases can follow bodies that moved, but not bodies
+    // that went away, so they are emptied in place and refilled when the number of bodies
+    // changed. The proxies were written for the broad phase of the snapshot.
+    BroadPhaseType broad_phase_type = (BroadPhaseType)header.broad_phase_type;
+    if (!same_bodies_count || broad_phase_type != world->broad_phase_type) {
+      world->broad_phase_type = broad_phase_type;
+      ClearBroadPhase(world);
+    }
+    world->proxies_count = bodies->count;
+    SyncBroadPhase(world);
+
+    MemoryCopy(world->previous_positions, bodies->position, sizeof(v2) * bodies->count);
+    MemoryCopy(world->previous_rotations, world->rotations, sizeof(Matrix2x2) * bodies->count);
+    world->previous_count = bodies->count;
+    world->interpolation_alpha = 1.0f;
+
+    return true;
+  }
+};  // namespace physics
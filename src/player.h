@@ -3,7 +3,7 @@
 #include "physics.h"
 
 struct Player {
-  physics::Body *body;
+  physics::BodyHandle body;
 
   f32 acc;
   f32 speed_max;
@@ -0,0 +1,214 @@
+#include "thread_pool.h"
+
+#include <sched.h>
+
+#include "language_layer.h"
+#include "memory.h"
+
+#define THREAD_POOL_SPIN_COUNT 2048
+
+inline void ThreadPoolPause() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+inline void ThreadPoolDequeLock(ThreadPoolDeque *deque) {
+  while (__atomic_exchange_n(&deque->lock, 1, __ATOMIC_ACQUIRE)) {
+    ThreadPoolPause();
+  }
+}
+
+inline void ThreadPoolDequeUnlock(ThreadPoolDeque *deque) {
+  __atomic_store_n(&deque->lock, 0, __ATOMIC_RELEASE);
+}
+
+internal void ThreadPoolDequePush(ThreadPoolDeque *deque, const ThreadPoolJob &job) {
+  ThreadPoolDequeLock(deque);
+  Assert(deque->bottom - deque->top < THREAD_POOL_DEQUE_SIZE);
+  deque->jobs[deque->bottom % THREAD_POOL_DEQUE_SIZE] = job;
+  __atomic_store_n(&deque->bottom, deque->bottom + 1, __ATOMIC_RELAXED);
+  ThreadPoolDequeUnlock(deque);
+}
+
+// Takes the most recently pushed job, the one most likely to still be in cache
+internal b32 ThreadPoolDequePop(ThreadPoolDeque *deque, ThreadPoolJob *job) {
+  b32 result = false;
+  ThreadPoolDequeLock(deque);
+  if (deque->bottom != deque->top) {
+    __atomic_store_n(&deque->bottom, deque->bottom - 1, __ATOMIC_RELAXED);
+    *job = deque->jobs[deque->bottom % THREAD_POOL_DEQUE_SIZE];
+    result = true;
+  }
+  ThreadPoolDequeUnlock(deque);
+  return result;
+}
+
+// Takes the oldest job, which is also the largest range left by the splitting
+internal b32 ThreadPoolDequeSteal(ThreadPoolDeque *deque, ThreadPoolJob *job) {
+  if (__atomic_load_n(&deque->bottom, __ATOMIC_RELAXED)
+      == __atomic_load_n(&deque->top, __ATOMIC_RELAXED)) {
+    return false;
+  }
+
+  b32 result = false;
+  ThreadPoolDequeLock(deque);
+  if (deque->bottom != deque->top) {
+    *job = deque->jobs[deque->top % THREAD_POOL_DEQUE_SIZE];
+    __atomic_store_n(&deque->top, deque->top + 1, __ATOMIC_RELAXED);
+    result = true;
+  }
+  ThreadPoolDequeUnlock(deque);
+  return result;
+}
+
+internal void ThreadPoolWakeWorkers(ThreadPool *pool) {
+  __atomic_fetch_add(&pool->work_generation, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->sleeping_count, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+
+// Runs one job from the own deque or stolen from another thread, returns false if there was
+// none to be found
+internal b32 ThreadPoolRunJob(ThreadPool *pool, u32 thread_index) {
+  ThreadPoolJob job;
+  if (!ThreadPoolDequePop(&pool->workers[thread_index].deque, &job)) {
+    b32 stolen = false;
+    for (u32 i = 1; i < pool->threads_count && !stolen; i++) {
+      u32 victim = (thread_index + i) % pool->threads_count;
+      stolen = ThreadPoolDequeSteal(&pool->workers[victim].deque, &job);
+    }
+    if (!stolen) {
+      return false;
+    }
+  }
+
+  // NOTE: split at multiples of chunk_size, so that every range handed to the task is
+  // one aligned chunk whatever thread ends up running it.
+  while (job.end - job.begin > job.chunk_size) {
+    u32 chunks = (job.end - job.begin + job.chunk_size - 1) / job.chunk_size;
+    ThreadPoolJob upper = job;
+    upper.begin = job.begin + (chunks / 2) * job.chunk_size;
+    job.end = upper.begin;
+    ThreadPoolDequePush(&pool->workers[thread_index].deque, upper);
+    ThreadPoolWakeWorkers(pool);
+  }
+
+  job.task(job.data, job.begin, job.end, thread_index);
+  __atomic_fetch_sub(&job.group->remaining, job.end - job.begin, __ATOMIC_RELEASE);
+  return true;
+}
+
+internal void *ThreadPoolWorkerMain(void *argument) {
+  ThreadPoolWorker *worker = (ThreadPoolWorker *)argument;
+  ThreadPool *pool = worker->pool;
+
+  while (!__atomic_load_n(&pool->quit, __ATOMIC_ACQUIRE)) {
+    u32 generation = __atomic_load_n(&pool->work_generation, __ATOMIC_SEQ_CST);
+    if (ThreadPoolRunJob(pool, worker->thread_index)) {
+      continue;
+    }
+
+    u32 spins = 0;
+    while (spins++ < THREAD_POOL_SPIN_COUNT
+           && __atomic_load_n(&pool->work_generation, __ATOMIC_RELAXED) == generation) {
+      ThreadPoolPause();
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_fetch_add(&pool->sleeping_count, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->work_generation, __ATOMIC_SEQ_CST) == generation
+           && !pool->quit) {
+      pthread_cond_wait(&pool->wake, &pool->mutex);
+    }
+    __atomic_fetch_sub(&pool->sleeping_count, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  return 0;
+}
+
+// Starts threads_count - 1 workers, the calling thread takes part as thread index 0. Every
+// thread gets a scratch arena of its own that commits memory as it grows, like any other
+// arena, and keeps up to scratch_size bytes of it committed between parallel phases.
+void ThreadPoolInit(ThreadPool *pool, u32 threads_count, u64 scratch_size) {
+  *pool = {};
+  pool->threads_count = Min(Max(threads_count, 1u), (u32)THREAD_POOL_MAX_THREADS);
+  pthread_mutex_init(&pool->mutex, 0);
+  pthread_cond_init(&pool->wake, 0);
+
+  for (u32 i = 0; i < pool->threads_count; i++) {
+    ThreadPoolWorker *worker = pool->workers + i;
+    worker->pool = pool;
+    worker->thread_index = i;
+    worker->scratch = MemoryArenaInitialize();
+    worker->scratch.decommit_threshold = scratch_size;
+  }
+  for (u32 i = 1; i < pool->threads_count; i++) {
+    ThreadPoolWorker *worker = pool->workers + i;
+    pthread_create(&worker->thread, 0, ThreadPoolWorkerMain, worker);
+  }
+}
+
+// Scratch memory of a thread, only to be used by that thread while inside a parallel for.
+// Whoever starts a parallel phase clears them with ThreadPoolClearScratch.
+inline MemoryArena *ThreadPoolScratch(ThreadPool *pool, u32 thread_index) {
+  return &pool->workers[thread_index].scratch;
+}
+
+void ThreadPoolClearScratch(ThreadPool *pool) {
+  for (u32 i = 0; i < pool->threads_count; i++) {
+    MemoryArenaClear(&pool->workers[i].scratch);
+  }
+}
+
+// Runs task over [0, count) in ranges of at most chunk_size that start at multiples of
+// chunk_size, and returns once all of them are done. Must be called from the thread that
+// created the pool. Tasks that write disjoint outputs per index give the same results
+// whatever the thread count, only the thread that runs a range changes.
+void ThreadPoolParallelFor(ThreadPool *pool, u32 count, u32 chunk_size, ThreadPoolTask *task,
+                           void *data) {
+  chunk_size = Max(chunk_size, 1u);
+  if (pool == 0 || pool->threads_count == 1 || count <= chunk_size) {
+    for (u32 begin = 0; begin < count; begin += chunk_size) {
+      task(data, begin, Min(begin + chunk_size, count), 0);
+    }
+    return;
+  }
+
+  ThreadPoolGroup group = {count};
+  ThreadPoolJob job = {task, data, 0, count, chunk_size, &group};
+  ThreadPoolDequePush(&pool->workers[0].deque, job);
+  ThreadPoolWakeWorkers(pool);
+
+  u32 spins = 0;
+  while (__atomic_load_n(&group.remaining, __ATOMIC_ACQUIRE) > 0) {
+    if (ThreadPoolRunJob(pool, 0)) {
+      spins = 0;
+    } else if (spins++ < THREAD_POOL_SPIN_COUNT) {
+      ThreadPoolPause();
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+void ThreadPoolShutdown(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  __atomic_store_n(&pool->quit, true, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&pool->work_generation, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (u32 i = 1; i < pool->threads_count; i++) {
+    pthread_join(pool->workers[i].thread, 0);
+  }
+  for (u32 i = 0; i < pool->threads_count; i++) {
+    MemoryArenaRelease(&pool->workers[i].scratch);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->wake);
+}
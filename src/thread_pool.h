@@ -0,0 +1,63 @@
+#pragma once
+#define THREAD_POOL_MAX_THREADS 64
+#define THREAD_POOL_DEQUE_SIZE 128  // jobs, a parallel for needs about log2(count / chunk_size)
+
+#include <pthread.h>
+
+#include "language_layer.h"
+#include "memory.h"
+
+// Processes the indices [begin, end) of a parallel for, thread_index is 0 for the calling thread
+typedef void ThreadPoolTask(void *data, u32 begin, u32 end, u32 thread_index);
+
+// Indices of a parallel for that have not been processed yet, the caller waits for 0
+struct ThreadPoolGroup {
+  u32 remaining;
+};
+
+struct ThreadPoolJob {
+  ThreadPoolTask *task;
+  void *data;
+  u32 begin;
+  u32 end;
+  u32 chunk_size;
+  ThreadPoolGroup *group;
+};
+
+// The owner pushes and pops jobs at the bottom, other threads steal from the top. Jobs are
+// small and short lived, so a spin lock is enough.
+struct ThreadPoolDeque {
+  ThreadPoolJob jobs[THREAD_POOL_DEQUE_SIZE];
+  u32 top;
+  u32 bottom;
+  u32 lock;
+};
+
+struct ThreadPool;
+
+struct ThreadPoolWorker {
+  ThreadPool *pool;
+  u32 thread_index;
+  pthread_t thread;
+
+  ThreadPoolDeque deque;
+  MemoryArena scratch;  // owned by the thread, see ThreadPoolScratch
+};
+
+// Fixed set of worker threads with work stealing, shared with the calling thread.
+//
+// A parallel for starts out as one job on the deque of the calling thread. Whoever runs a job
+// splits it in halves until it is down to chunk_size indices, leaving the other halves on its
+// own deque for idle threads to steal. Workers spin briefly when they run out of jobs, since
+// a step issues many short parallel fors back to back, and then go to sleep.
+struct ThreadPool {
+  ThreadPoolWorker workers[THREAD_POOL_MAX_THREADS];  // [0] is the calling thread
+  u32 threads_count;
+
+  u32 work_generation;  // bumped whenever jobs are pushed
+  u32 sleeping_count;
+  b32 quit;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+};